@@ -0,0 +1,147 @@
+#include "Timestamp.h"
+#include "BandwidthLimiter.h"
+
+namespace i2p
+{
+namespace util
+{
+	TokenBucket::TokenBucket (uint32_t rate):
+		m_Rate (rate), m_Tokens (rate), m_LastUpdateTime (GetMillisecondsSinceEpoch ()),
+		m_MeterStartTime (m_LastUpdateTime), m_MeterBytes (0), m_CurrentRate (0),
+		m_NumBytes (0), m_NumRejected (0)
+	{
+	}
+
+	void TokenBucket::SetRate (uint32_t rate)
+	{
+		std::unique_lock<std::mutex> l(m_Mutex);
+		if (!m_Rate || m_Tokens > rate) m_Tokens = rate; // start with full bucket
+		m_Rate = rate;
+		m_LastUpdateTime = GetMillisecondsSinceEpoch ();
+	}
+
+	bool TokenBucket::Consume (size_t len)
+	{
+		std::unique_lock<std::mutex> l(m_Mutex);
+		uint64_t ts = GetMillisecondsSinceEpoch ();
+		if (m_Rate)
+		{
+			Update (ts);
+			if (m_Tokens <= 0)
+			{
+				m_NumRejected++;
+				return false;
+			}
+			m_Tokens -= len;
+		}
+		Account (len, ts);
+		return true;
+	}
+
+	bool TokenBucket::IsAvailable ()
+	{
+		std::unique_lock<std::mutex> l(m_Mutex);
+		if (!m_Rate) return true;
+		Update (GetMillisecondsSinceEpoch ());
+		if (m_Tokens <= 0)
+		{
+			m_NumRejected++;
+			return false;
+		}
+		return true;
+	}
+
+	void TokenBucket::ForceConsume (size_t len)
+	{
+		std::unique_lock<std::mutex> l(m_Mutex);
+		uint64_t ts = GetMillisecondsSinceEpoch ();
+		if (m_Rate)
+		{
+			Update (ts);
+			m_Tokens -= len;
+		}
+		Account (len, ts);
+	}
+
+	int TokenBucket::GetDelay ()
+	{
+		std::unique_lock<std::mutex> l(m_Mutex);
+		if (!m_Rate) return 0;
+		Update (GetMillisecondsSinceEpoch ());
+		if (m_Tokens > 0) return 0;
+		return -m_Tokens*1000/m_Rate + 1;
+	}
+
+	uint32_t TokenBucket::GetCurrentRate ()
+	{
+		std::unique_lock<std::mutex> l(m_Mutex);
+		uint64_t elapsed = GetMillisecondsSinceEpoch () - m_MeterStartTime;
+		if (elapsed >= 1000) // traffic has stopped
+			return m_MeterBytes*1000/elapsed;
+		return m_CurrentRate;
+	}
+
+	void TokenBucket::Update (uint64_t ts)
+	{
+		if (ts > m_LastUpdateTime)
+		{
+			m_Tokens += (double)m_Rate*(ts - m_LastUpdateTime)/1000;
+			if (m_Tokens > m_Rate) m_Tokens = m_Rate;
+			m_LastUpdateTime = ts;
+		}
+	}
+
+	void TokenBucket::Account (size_t len, uint64_t ts)
+	{
+		if (ts >= m_MeterStartTime + 1000)
+		{
+			m_CurrentRate = m_MeterBytes*1000/(ts - m_MeterStartTime);
+			m_MeterStartTime = ts;
+			m_MeterBytes = 0;
+		}
+		m_MeterBytes += len;
+		m_NumBytes += len;
+	}
+
+	BandwidthLimiter::BandwidthLimiter ():
+		m_TransitShare (DEFAULT_TRANSIT_SHARE), m_NumTransitTunnels (0), m_TransitTunnelRate (0)
+	{
+	}
+
+	void BandwidthLimiter::SetLimits (uint32_t inbound, uint32_t outbound, int transitShare)
+	{
+		m_Inbound.SetRate (inbound);
+		m_Outbound.SetRate (outbound);
+		m_TransitShare = transitShare;
+		uint32_t transit = 0;
+		if (outbound)
+		{
+			transit = (uint64_t)outbound*transitShare/100;
+			if (!transit) transit = 1; // 0 would mean unlimited
+		}
+		m_Transit.SetRate (transit);
+		UpdateTransitTunnelRate ();
+	}
+
+	void BandwidthLimiter::SetNumTransitTunnels (int num)
+	{
+		if (num != m_NumTransitTunnels)
+		{
+			m_NumTransitTunnels = num;
+			UpdateTransitTunnelRate ();
+		}
+	}
+
+	void BandwidthLimiter::UpdateTransitTunnelRate ()
+	{
+		uint64_t rate = m_Transit.GetRate ();
+		if (rate)
+		{
+			int num = m_NumTransitTunnels;
+			rate = rate*TRANSIT_TUNNEL_OVERBOOKING/(num > 0 ? num : 1);
+			if (rate < TRANSIT_TUNNEL_MIN_RATE) rate = TRANSIT_TUNNEL_MIN_RATE;
+		}
+		m_TransitTunnelRate = rate;
+	}
+}
+}
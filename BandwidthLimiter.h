@@ -0,0 +1,83 @@
+#ifndef BANDWIDTH_LIMITER_H__
+#define BANDWIDTH_LIMITER_H__
+
+#include <inttypes.h>
+#include <mutex>
+#include <atomic>
+
+namespace i2p
+{
+namespace util
+{
+	const int DEFAULT_TRANSIT_SHARE = 80; // percent of outbound bandwidth
+	const int TRANSIT_TUNNEL_OVERBOOKING = 4; // transit tunnel might use 4 fair shares if others are idle
+	const uint32_t TRANSIT_TUNNEL_MIN_RATE = 4096; // in bytes per second
+
+	// Tokens are refilled at rate up to one second of traffic. Bucket might go into debt,
+	// nothing is consumed by Consume till debt is paid
+	class TokenBucket
+	{
+		public:
+
+			TokenBucket (uint32_t rate = 0); // bytes per second, 0 means unlimited
+			~TokenBucket () {};
+
+			void SetRate (uint32_t rate);
+			uint32_t GetRate () const { return m_Rate; };
+
+			bool Consume (size_t len); // false if bucket is empty
+			bool IsAvailable (); // false if bucket is empty, counted as rejected
+			void ForceConsume (size_t len); // for traffic already received or not subject to limit
+			int GetDelay (); // in milliseconds till bucket is not empty
+
+			uint32_t GetCurrentRate (); // measured, in bytes per second
+			uint64_t GetNumBytes () const { return m_NumBytes; };
+			uint64_t GetNumRejected () const { return m_NumRejected; };
+
+		private:
+
+			void Update (uint64_t ts);
+			void Account (size_t len, uint64_t ts);
+
+		private:
+
+			std::mutex m_Mutex;
+			std::atomic<uint32_t> m_Rate;
+			double m_Tokens;
+			uint64_t m_LastUpdateTime; // in milliseconds
+			uint64_t m_MeterStartTime, m_MeterBytes; // current second
+			uint32_t m_CurrentRate; // of previous second
+			std::atomic<uint64_t> m_NumBytes, m_NumRejected;
+	};
+
+	// router-wide limits, transit traffic is accounted in outbound too
+	class BandwidthLimiter
+	{
+		public:
+
+			BandwidthLimiter ();
+
+			void SetLimits (uint32_t inbound, uint32_t outbound, int transitShare); // bytes per second, 0 means unlimited
+			int GetTransitShare () const { return m_TransitShare; };
+			void SetNumTransitTunnels (int num);
+			uint32_t GetTransitTunnelRate () const { return m_TransitTunnelRate; }; // 0 means unlimited
+
+			TokenBucket& GetInbound () { return m_Inbound; };
+			TokenBucket& GetOutbound () { return m_Outbound; };
+			TokenBucket& GetTransit () { return m_Transit; };
+
+		private:
+
+			void UpdateTransitTunnelRate ();
+
+		private:
+
+			TokenBucket m_Inbound, m_Outbound, m_Transit;
+			int m_TransitShare;
+			std::atomic<int> m_NumTransitTunnels;
+			std::atomic<uint32_t> m_TransitTunnelRate;
+	};
+}
+}
+
+#endif
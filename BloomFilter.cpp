@@ -0,0 +1,137 @@
+#include <string.h>
+#include <math.h>
+#include <random>
+#include "Log.h"
+#include "Timestamp.h"
+#include "BloomFilter.h"
+
+namespace i2p
+{
+namespace util
+{
+	RotatingBloomFilter::RotatingBloomFilter (size_t size, double falsePositiveRate, int interval):
+		m_Interval (interval), m_FalsePositiveRate (0), m_NumWords (0), m_NumHashes (0), m_Capacity (0),
+		m_CurrentGeneration (0), m_NumKeys (0), m_NextRotationTime (0),
+		m_NumDuplicates (0), m_NumRotations (0), m_NumEarlyRotations (0)
+	{
+		// keys are chosen by remote side, so positions must not be predictable
+		std::random_device rd;
+		for (int i = 0; i < 2; i++)
+			m_Seeds[i] = ((uint64_t)rd () << 32) | rd ();
+		Configure (size, falsePositiveRate);
+	}
+
+	void RotatingBloomFilter::Configure (size_t size, double falsePositiveRate)
+	{
+		if (falsePositiveRate <= 0 || falsePositiveRate >= 1) falsePositiveRate = 0.000001;
+		m_FalsePositiveRate = falsePositiveRate;
+		m_NumWords = size/(8*BLOOM_FILTER_NUM_GENERATIONS);
+		if (!m_NumWords) m_NumWords = 1;
+		m_Bits.reset (new std::atomic<uint64_t>[m_NumWords*BLOOM_FILTER_NUM_GENERATIONS]);
+		for (size_t i = 0; i < m_NumWords*BLOOM_FILTER_NUM_GENERATIONS; i++)
+			m_Bits[i] = 0;
+		// lookup checks every generation, so each one gets a share of false positive rate
+		double p = falsePositiveRate/BLOOM_FILTER_NUM_GENERATIONS;
+		size_t numBits = m_NumWords*64;
+		m_NumHashes = (int)ceil (-log2 (p)); // optimal for filled generation
+		m_Capacity = numBits*M_LN2*M_LN2/(-log (p)); // n = -m*ln2^2/ln(p)
+		if (!m_Capacity) m_Capacity = 1;
+		m_CurrentGeneration = 0;
+		m_NumKeys = 0;
+		m_NextRotationTime = i2p::util::GetSecondsSinceEpoch () + m_Interval;
+		LogPrint ("Bloom filter of ", GetSize ()/1024, "K, capacity=", m_Capacity, " per generation, hashes=", m_NumHashes);
+	}
+
+	void RotatingBloomFilter::Hash (const uint8_t * key, size_t len, uint64_t& h1, uint64_t& h2) const
+	{
+		// seeded 64-bit mixing of 8-byte words, finalizer is from MurmurHash3
+		auto mix = [](uint64_t h)->uint64_t
+		{
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdULL;
+			h ^= h >> 33;
+			h *= 0xc4ceb9fe1a85ec53ULL;
+			h ^= h >> 33;
+			return h;
+		};
+		h1 = m_Seeds[0] ^ len; h2 = m_Seeds[1] ^ len;
+		while (len > 0)
+		{
+			uint64_t w = 0;
+			size_t l = len < 8 ? len : 8;
+			memcpy (&w, key, l);
+			h1 = mix (h1 ^ w);
+			h2 = mix (h2 + w + 0x9e3779b97f4a7c15ULL);
+			key += l; len -= l;
+		}
+		h2 |= 1; // odd step
+	}
+
+	bool RotatingBloomFilter::Contains (int generation, uint64_t h1, uint64_t h2) const
+	{
+		const std::atomic<uint64_t> * bits = m_Bits.get () + generation*m_NumWords;
+		uint64_t numBits = m_NumWords*64;
+		for (int i = 0; i < m_NumHashes; i++)
+		{
+			uint64_t bit = (h1 + i*h2) % numBits;
+			if (!(bits[bit >> 6].load (std::memory_order_relaxed) & (1ULL << (bit & 63))))
+				return false;
+		}
+		return true;
+	}
+
+	bool RotatingBloomFilter::CheckAndAdd (const uint8_t * key, size_t len)
+	{
+		uint64_t ts = i2p::util::GetSecondsSinceEpoch ();
+		bool isFull = m_NumKeys >= m_Capacity;
+		if (isFull || ts >= m_NextRotationTime)
+			Rotate (ts, isFull);
+
+		uint64_t h1, h2;
+		Hash (key, len, h1, h2);
+		int current = m_CurrentGeneration;
+		bool isPresent = false;
+		for (int i = 0; i < BLOOM_FILTER_NUM_GENERATIONS && !isPresent; i++)
+			if (i != current)
+				isPresent = Contains (i, h1, h2);
+		// add to current generation, key is there already if all bits were set
+		std::atomic<uint64_t> * bits = m_Bits.get () + current*m_NumWords;
+		uint64_t numBits = m_NumWords*64;
+		bool isNew = false;
+		for (int i = 0; i < m_NumHashes; i++)
+		{
+			uint64_t bit = (h1 + i*h2) % numBits;
+			uint64_t mask = 1ULL << (bit & 63);
+			if (!(bits[bit >> 6].fetch_or (mask, std::memory_order_relaxed) & mask))
+				isNew = true;
+		}
+		if (isNew)
+			m_NumKeys++;
+		else
+			isPresent = true;
+		if (isPresent) m_NumDuplicates++;
+		return isPresent;
+	}
+
+	void RotatingBloomFilter::Rotate (uint64_t ts, bool isFull)
+	{
+		std::unique_lock<std::mutex> l(m_RotationMutex, std::try_to_lock);
+		if (!l.owns_lock ()) return; // other thread rotates
+		if (m_NumKeys < m_Capacity && ts < m_NextRotationTime) return; // rotated already
+		// clear oldest generation and make it current
+		int next = (m_CurrentGeneration + 1) % BLOOM_FILTER_NUM_GENERATIONS;
+		std::atomic<uint64_t> * bits = m_Bits.get () + next*m_NumWords;
+		for (size_t i = 0; i < m_NumWords; i++)
+			bits[i].store (0, std::memory_order_relaxed);
+		m_CurrentGeneration = next;
+		m_NumKeys = 0;
+		m_NextRotationTime = ts + m_Interval;
+		m_NumRotations++;
+		if (isFull)
+		{
+			m_NumEarlyRotations++;
+			LogPrint ("Bloom filter generation is full before ", m_Interval, " seconds. Consider bigger size");
+		}
+	}
+}
+}
@@ -0,0 +1,61 @@
+#ifndef BLOOM_FILTER_H__
+#define BLOOM_FILTER_H__
+
+#include <inttypes.h>
+#include <memory>
+#include <atomic>
+#include <mutex>
+
+namespace i2p
+{
+namespace util
+{
+	const int BLOOM_FILTER_NUM_GENERATIONS = 3;
+
+	// Bloom filter of fixed size split into generations. New keys go to current generation,
+	// oldest one is cleared and becomes current every interval or when current one gets full.
+	// Keys are remembered for (BLOOM_FILTER_NUM_GENERATIONS - 1)*interval at least if not full
+	class RotatingBloomFilter
+	{
+		public:
+
+			RotatingBloomFilter (size_t size, double falsePositiveRate, int interval); // size in bytes, interval in seconds
+			~RotatingBloomFilter () {};
+
+			void Configure (size_t size, double falsePositiveRate); // must not be called concurrently with CheckAndAdd
+			bool CheckAndAdd (const uint8_t * key, size_t len); // true if key has been added before, thread-safe
+
+			size_t GetSize () const { return m_NumWords*BLOOM_FILTER_NUM_GENERATIONS*8; }; // in bytes
+			size_t GetCapacity () const { return m_Capacity; }; // per generation
+			size_t GetNumKeys () const { return m_NumKeys; }; // in current generation
+			int GetNumHashes () const { return m_NumHashes; };
+			double GetFalsePositiveRate () const { return m_FalsePositiveRate; };
+			uint64_t GetNumDuplicates () const { return m_NumDuplicates; };
+			uint64_t GetNumRotations () const { return m_NumRotations; };
+			uint64_t GetNumEarlyRotations () const { return m_NumEarlyRotations; }; // because of capacity
+
+		private:
+
+			void Rotate (uint64_t ts, bool isFull);
+			void Hash (const uint8_t * key, size_t len, uint64_t& h1, uint64_t& h2) const;
+			bool Contains (int generation, uint64_t h1, uint64_t h2) const;
+
+		private:
+
+			int m_Interval;
+			double m_FalsePositiveRate;
+			std::unique_ptr<std::atomic<uint64_t>[]> m_Bits; // all generations
+			size_t m_NumWords; // per generation
+			int m_NumHashes;
+			size_t m_Capacity;
+			uint64_t m_Seeds[2];
+			std::atomic<int> m_CurrentGeneration;
+			std::atomic<size_t> m_NumKeys;
+			std::atomic<uint64_t> m_NextRotationTime;
+			std::mutex m_RotationMutex;
+			std::atomic<uint64_t> m_NumDuplicates, m_NumRotations, m_NumEarlyRotations;
+	};
+}
+}
+
+#endif
@@ -0,0 +1,84 @@
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#include <inttypes.h>
+#include "Log.h"
+#include "CPU.h"
+
+namespace i2p
+{
+namespace cpu
+{
+	bool aesni = false;
+	bool pclmul = false;
+	bool shani = false;
+	bool avx2 = false;
+	bool vaes = false;
+
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+	static void CPUID (unsigned int leaf, unsigned int subleaf, unsigned int regs[4]) // eax, ebx, ecx, edx
+	{
+#if defined(_MSC_VER)
+		__cpuidex ((int *)regs, leaf, subleaf);
+#else
+		__cpuid_count (leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+	}
+
+	static bool IsYMMEnabled () // by OS
+	{
+		uint32_t lo, hi;
+#if defined(_MSC_VER)
+		uint64_t xcr0 = _xgetbv (0);
+		lo = (uint32_t)xcr0; hi = xcr0 >> 32;
+#else
+		__asm__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+#endif
+		(void)hi;
+		return (lo & 0x06) == 0x06; // XMM and YMM state
+	}
+#endif
+
+	void Detect ()
+	{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+		unsigned int regs[4];
+		CPUID (0, 0, regs);
+		unsigned int maxLeaf = regs[0];
+		if (maxLeaf >= 1)
+		{
+			CPUID (1, 0, regs);
+			aesni = regs[2] & (1 << 25);
+			pclmul = regs[2] & (1 << 1);
+			bool ymm = (regs[2] & (1 << 27)) && (regs[2] & (1 << 28)) && IsYMMEnabled (); // OSXSAVE and AVX
+			if (maxLeaf >= 7)
+			{
+				CPUID (7, 0, regs);
+				avx2 = ymm && (regs[1] & (1 << 5));
+				shani = regs[1] & (1 << 29);
+				vaes = ymm && (regs[2] & (1 << 9));
+			}
+		}
+#endif
+		LogPrint ("CPU features: AES-NI ", aesni ? "yes" : "no", ", PCLMUL ", pclmul ? "yes" : "no", 
+			", SHA-NI ", shani ? "yes" : "no", ", AVX2 ", avx2 ? "yes" : "no", ", VAES ", vaes ? "yes" : "no");
+		LogPrint ("AES: ", GetAESImplementation (), ", SHA: ", GetSHAImplementation ());
+	}
+
+	const char * GetAESImplementation ()
+	{
+#ifdef AESNI
+		if (aesni) return "AES-NI";
+#endif
+		return "Crypto++";
+	}
+
+	const char * GetSHAImplementation ()
+	{
+		// we don't have own SHA kernels, crypto++ makes its own choice
+		return "Crypto++";
+	}
+}
+}
@@ -0,0 +1,26 @@
+#ifndef CPU_H__
+#define CPU_H__
+
+// AES-NI code is compiled for x86-64 always and used only if CPU supports it
+#if !defined(AESNI) && defined(__x86_64__) && defined(__GNUC__)
+	#define AESNI
+#endif
+
+namespace i2p
+{
+namespace cpu
+{
+	// detected features, false until Detect is called
+	extern bool aesni;
+	extern bool pclmul;
+	extern bool shani;
+	extern bool avx2;
+	extern bool vaes;
+
+	void Detect ();
+	const char * GetAESImplementation ();
+	const char * GetSHAImplementation ();
+}
+}
+
+#endif
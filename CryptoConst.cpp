@@ -1,4 +1,10 @@
 #include <inttypes.h>
+#include <memory>
+#include <cryptopp/dh.h>
+#include <cryptopp/modexppc.h>
+#include <cryptopp/eprecomp.h>
+#include <cryptopp/osrng.h>
+#include "Log.h"
 #include "CryptoConst.h"
 
 namespace i2p
@@ -27,6 +33,60 @@ namespace crypto
 
 	const CryptoPP::Integer elgp (elgp_, 256);
 	const CryptoPP::Integer elgg (2); 
+
+	const int ELGG_PRECOMPUTATION_STORAGE = 64; // 32 bits windows for 2048 bits exponent, 16K
+
+	class ElggPrecomputation
+	{
+		public:
+
+			ElggPrecomputation (): m_IsValid (true)
+			{
+				CryptoPP::ModExpPrecomputation group;
+				group.SetModulus (elgp);
+				m_Table.SetBase (group, elgg);
+				m_Table.Precompute (group, elgp.BitCount (), ELGG_PRECOMPUTATION_STORAGE);
+				// check against plain exponentiation
+				CryptoPP::AutoSeededRandomPool rnd;
+				CryptoPP::Integer x (rnd, CryptoPP::Integer::One (), elgp - 1);
+				if (m_Table.Exponentiate (group, x) != a_exp_b_mod_c (elgg, x, elgp))
+				{
+					LogPrint ("ElGamal precomputation mismatch. Disabled");
+					m_IsValid = false;
+				}	
+			}	
+
+			CryptoPP::Integer Exponentiate (const CryptoPP::Integer& x) const
+			{
+				if (!m_IsValid) return a_exp_b_mod_c (elgg, x, elgp);
+				// Montgomery representation has mutable workspace, one per thread
+				static thread_local std::unique_ptr<CryptoPP::ModExpPrecomputation> group;
+				if (!group)
+				{
+					group.reset (new CryptoPP::ModExpPrecomputation ());
+					group->SetModulus (elgp);
+				}	
+				return m_Table.Exponentiate (*group, x);
+			}	
+
+		private:
+
+			CryptoPP::DL_FixedBasePrecomputationImpl<CryptoPP::Integer> m_Table;
+			bool m_IsValid;
+	};	
+
+	CryptoPP::Integer ElggExp (const CryptoPP::Integer& x)
+	{
+		static ElggPrecomputation precomputation; // built once on first use
+		return precomputation.Exponentiate (x);
+	}	
+
+	void GenerateElGamalKeyPair (CryptoPP::RandomNumberGenerator& rnd, uint8_t * privateKey, uint8_t * publicKey)
+	{
+		CryptoPP::DH dh (elgp, elgg);
+		dh.GeneratePrivateKey (rnd, privateKey);
+		ElggExp (CryptoPP::Integer (privateKey, 256)).Encode (publicKey, 256);
+	}	
 	
 	const uint8_t dsap_[128]=
 	{
@@ -1,6 +1,7 @@
 #ifndef CRYPTO_CONST_H__
 #define CRYPTO_CONST_H__
 
+#include <inttypes.h>
 #include <cryptopp/integer.h>
 
 namespace i2p
@@ -11,6 +12,9 @@ namespace crypto
 	extern const CryptoPP::Integer elgp;
 	extern const CryptoPP::Integer elgg; 
 
+	// g^x mod p with precomputed powers of elgg, thread safe
+	CryptoPP::Integer ElggExp (const CryptoPP::Integer& x);
+	void GenerateElGamalKeyPair (CryptoPP::RandomNumberGenerator& rnd, uint8_t * privateKey, uint8_t * publicKey);
 
 	// DSA
 	extern const CryptoPP::Integer dsap;		
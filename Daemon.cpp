@@ -12,6 +12,7 @@
 #include "NetDb.h"
 #include "Garlic.h"
 #include "util.h"
+#include "CPU.h"
 #include "Streaming.h"
 #include "HTTPServer.h"
 #include "HTTPProxy.h"
@@ -46,6 +47,7 @@ namespace i2p
 			LogPrint("\n\n\n\ni2pd starting\n");
 			LogPrint("data directory: ", i2p::util::filesystem::GetDataDir().string());
 			i2p::util::filesystem::ReadConfigFile(i2p::util::config::mapArgs, i2p::util::config::mapMultiArgs);
+			i2p::cpu::Detect (); // before any AES key is set
 
 			isDaemon = i2p::util::config::GetArg("-daemon", 0);
 			isLogging = i2p::util::config::GetArg("-log", 1);
@@ -85,12 +87,26 @@ namespace i2p
 			d.httpServer->Start();
 			LogPrint("HTTPServer started");
 
+			i2p::data::netdb.SetQueueCapacity (i2p::util::config::GetArg("-netdbqueue", i2p::data::NETDB_QUEUE_CAPACITY));
+			i2p::tunnel::tunnels.SetQueueCapacity (i2p::util::config::GetArg("-tunnelsqueue", i2p::tunnel::TUNNELS_QUEUE_CAPACITY));
+			i2p::garlic::routing.SetQueueCapacity (i2p::util::config::GetArg("-garlicqueue", i2p::garlic::GARLIC_QUEUE_CAPACITY));
+			i2p::tunnel::tunnels.SetNumThreads (i2p::util::config::GetArg("-tunnelsthreads", 0));
+			i2p::transports.SetNumThreads (i2p::util::config::GetArg("-transportsthreads", 0));
+			i2p::transports.SetNumCryptoThreads (i2p::util::config::GetArg("-cryptothreads", 0));
+			i2p::transports.SetMaxNumHandshakes (i2p::util::config::GetArg("-maxhandshakes", i2p::TRANSPORTS_MAX_NUM_HANDSHAKES));
+			i2p::transports.SetNTCPMaxBatchSize (i2p::util::config::GetArg("-ntcpbatchsize", i2p::ntcp::NTCP_MAX_BATCH_SIZE));
+			i2p::transports.SetReplayFilterParams (i2p::util::config::GetArg("-replayfiltersize", i2p::REPLAY_FILTER_SIZE/1024)*1024,
+				i2p::util::config::GetArg("-replayfalsepositives", i2p::REPLAY_FILTER_FALSE_POSITIVES)/1000000.0);
+			i2p::transports.SetBandwidthLimits (i2p::util::config::GetArg("-bandwidthin", 0)*1024,
+				i2p::util::config::GetArg("-bandwidthout", 0)*1024,
+				i2p::util::config::GetArg("-transitshare", i2p::util::DEFAULT_TRANSIT_SHARE));
 			i2p::data::netdb.Start();
 			LogPrint("NetDB started");
-			i2p::transports.Start();
-			LogPrint("Transports started");
+			// tunnels must be ready before first message comes from transports
 			i2p::tunnel::tunnels.Start();
 			LogPrint("Tunnels started");
+			i2p::transports.Start();
+			LogPrint("Transports started");
 			i2p::garlic::routing.Start();
 			LogPrint("Routing started");
 			i2p::stream::StartStreaming();
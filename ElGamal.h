@@ -19,7 +19,7 @@ namespace crypto
 
 			ElGamalEncryption (const uint8_t * key):
 				y (key, 256), k (rnd, CryptoPP::Integer::One(), elgp-1),
-				a (a_exp_b_mod_c (elgg, k, elgp)), b1 (a_exp_b_mod_c (y, k, elgp))
+				a (ElggExp (k)), b1 (a_exp_b_mod_c (y, k, elgp))
 			{
 			}
 
@@ -240,8 +240,10 @@ namespace garlic
 	}
 		
 	GarlicRouting routing;	
-	GarlicRouting::GarlicRouting (): m_IsRunning (false), m_Thread (nullptr)
+	GarlicRouting::GarlicRouting (): m_IsRunning (false), m_Thread (nullptr), m_Queue ("garlic")
 	{
+		m_Queue.SetCapacity (GARLIC_QUEUE_CAPACITY);
+		m_Queue.SetDropper (i2p::DeleteI2NPMessage);
 	}
 	
 	GarlicRouting::~GarlicRouting ()
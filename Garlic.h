@@ -36,6 +36,7 @@ namespace garlic
 #pragma pack()	
 
 	const int TAGS_EXPIRATION_TIMEOUT = 900; // 15 minutes
+	const int GARLIC_QUEUE_CAPACITY = 4096; // messages
 	class GarlicRoutingSession
 	{
 		public:
@@ -100,6 +101,7 @@ namespace garlic
 			void AddSessionKey (const uint8_t * key, const uint8_t * tag); // one tag 
 		
 			void HandleGarlicMessage (I2NPMessage * msg);
+			void SetQueueCapacity (size_t capacity) { m_Queue.SetCapacity (capacity); };
 			void HandleDeliveryStatusMessage (uint8_t * buf, size_t len);
 			
 			I2NPMessage * WrapSingleMessage (const i2p::data::RoutingDestination& destination, I2NPMessage * msg);
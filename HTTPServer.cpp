@@ -2,9 +2,11 @@
 #include <boost/lexical_cast.hpp>
 #include "base64.h"
 #include "Log.h"
+#include "CPU.h"
 #include "Tunnel.h"
 #include "TransitTunnel.h"
 #include "Transports.h"
+#include "OutboundQueue.h"
 #include "NetDb.h"
 #include "HTTPServer.h"
 
@@ -183,7 +185,9 @@ namespace util
 	void HTTPConnection::RunRequest ()
 	{
 		auto address = ExtractAddress ();
-		if (address.length () > 1) // not just '/'
+		if (address == "/stats")
+			HandleStatsRequest ();
+		else if (address.length () > 1) // not just '/'
 		{
 			std::string uri ("/"), b32;
 			size_t pos = address.find ('/', 1);
@@ -235,6 +239,136 @@ namespace util
 		SendReply (s.str ());
 	}	
 
+	static void WriteMetricHeader (std::stringstream& s, const char * name, const char * type, const char * help)
+	{
+		s << "# HELP " << name << " " << help << "\n";
+		s << "# TYPE " << name << " " << type << "\n";
+	}
+
+	void HTTPConnection::HandleStatsRequest ()
+	{
+		// Prometheus text format, series of one metric follow its HELP and TYPE
+		std::stringstream s;
+		std::vector<QueueStats> queues;
+		QueueBase::GetAllQueuesStats (queues);
+		WriteMetricHeader (s, "i2pd_queue_depth", "gauge", "Messages waiting in queue");
+		for (auto& it: queues)
+			s << "i2pd_queue_depth{queue=\"" << it.name << "\"} " << it.depth << "\n";
+		WriteMetricHeader (s, "i2pd_queue_max_depth", "gauge", "Maximal number of messages waiting in queue");
+		for (auto& it: queues)
+			s << "i2pd_queue_max_depth{queue=\"" << it.name << "\"} " << it.maxDepth << "\n";
+		WriteMetricHeader (s, "i2pd_queue_processed_total", "counter", "Messages taken from queue");
+		for (auto& it: queues)
+			s << "i2pd_queue_processed_total{queue=\"" << it.name << "\"} " << it.numProcessed << "\n";
+		WriteMetricHeader (s, "i2pd_queue_dropped_total", "counter", "Messages dropped by queue");
+		for (auto& it: queues)
+		{
+			s << "i2pd_queue_dropped_total{queue=\"" << it.name << "\",class=\"local\"} " << it.numDropped[eQueueClassLocal] << "\n";
+			s << "i2pd_queue_dropped_total{queue=\"" << it.name << "\",class=\"transit\"} " << it.numDropped[eQueueClassTransit] << "\n";
+		}
+		WriteMetricHeader (s, "i2pd_queue_sojourn_microseconds", "histogram", "Time messages spent in queue");
+		for (auto& it: queues)
+		{
+			std::string label = "{queue=\"" + it.name + "\"";
+			uint64_t count = 0;
+			for (int i = 0; i < QUEUE_SOJOURN_HISTOGRAM_SIZE; i++)
+			{
+				count += it.sojournHistogram[i];
+				s << "i2pd_queue_sojourn_microseconds_bucket" << label << ",le=\"";
+				if (i < QUEUE_SOJOURN_HISTOGRAM_SIZE - 1)
+					s << (1ULL << i);
+				else
+					s << "+Inf";
+				s << "\"} " << count << "\n";
+			}
+			s << "i2pd_queue_sojourn_microseconds_sum" << label << "} " << it.totalSojourn << "\n";
+			s << "i2pd_queue_sojourn_microseconds_count" << label << "} " << count << "\n";
+		}	
+		WriteMetricHeader (s, "i2pd_ntcp_writes_total", "counter", "NTCP socket writes");
+		s << "i2pd_ntcp_writes_total " << i2p::transports.GetNumNTCPWrites () << "\n";
+		WriteMetricHeader (s, "i2pd_ntcp_sent_messages_total", "counter", "I2NP messages sent over NTCP");
+		s << "i2pd_ntcp_sent_messages_total " << i2p::transports.GetNumNTCPSentMessages () << "\n";
+		WriteMetricHeader (s, "i2pd_ntcp_sent_bytes_total", "counter", "Bytes sent over NTCP");
+		s << "i2pd_ntcp_sent_bytes_total " << i2p::transports.GetNumNTCPSentBytes () << "\n";
+		auto ssuServer = i2p::transports.GetSSUServer ();
+		if (ssuServer)
+		{
+			WriteMetricHeader (s, "i2pd_ssu_sessions", "gauge", "SSU sessions");
+			s << "i2pd_ssu_sessions " << ssuServer->GetNumSessions () << "\n";
+			WriteMetricHeader (s, "i2pd_ssu_relays", "gauge", "Sessions we are introducer for");
+			s << "i2pd_ssu_relays " << ssuServer->GetNumRelays () << "\n";
+			WriteMetricHeader (s, "i2pd_ssu_sent_data_packets_total", "counter", "SSU data packets sent");
+			s << "i2pd_ssu_sent_data_packets_total " << ssuServer->GetNumSentDataPackets () << "\n";
+			WriteMetricHeader (s, "i2pd_ssu_sent_ack_packets_total", "counter", "SSU packets sent with ACKs only");
+			s << "i2pd_ssu_sent_ack_packets_total " << ssuServer->GetNumSentAckPackets () << "\n";
+			WriteMetricHeader (s, "i2pd_ssu_sent_acks_total", "counter", "SSU message ACKs sent");
+			s << "i2pd_ssu_sent_acks_total " << ssuServer->GetNumSentAcks () << "\n";
+		}	
+		auto& replayFilter = i2p::transports.GetReplayFilter ();
+		WriteMetricHeader (s, "i2pd_replay_filter_duplicates_total", "counter", "Duplicates found by replay filter");
+		s << "i2pd_replay_filter_duplicates_total " << replayFilter.GetNumDuplicates () << "\n";
+		WriteMetricHeader (s, "i2pd_replay_filter_keys", "gauge", "Keys in current generation of replay filter");
+		s << "i2pd_replay_filter_keys " << replayFilter.GetNumKeys () << "\n";
+		WriteMetricHeader (s, "i2pd_replay_filter_capacity", "gauge", "Capacity of replay filter");
+		s << "i2pd_replay_filter_capacity " << replayFilter.GetCapacity () << "\n";
+		WriteMetricHeader (s, "i2pd_replay_filter_rotations_total", "counter", "Replay filter rotations");
+		s << "i2pd_replay_filter_rotations_total " << replayFilter.GetNumRotations () << "\n";
+		WriteMetricHeader (s, "i2pd_replay_filter_early_rotations_total", "counter", "Replay filter rotations because of capacity");
+		s << "i2pd_replay_filter_early_rotations_total " << replayFilter.GetNumEarlyRotations () << "\n";
+		i2p::OutboundQueueStats outboundStats[i2p::NUM_OUTBOUND_CLASSES];
+		for (int i = 0; i < i2p::NUM_OUTBOUND_CLASSES; i++)
+			outboundStats[i] = i2p::GetOutboundQueueStats (i);
+		WriteMetricHeader (s, "i2pd_outbound_queue_messages", "gauge", "Messages waiting for transport");
+		for (int i = 0; i < i2p::NUM_OUTBOUND_CLASSES; i++)
+			s << "i2pd_outbound_queue_messages{class=\"" << i2p::GetOutboundClassName (i) << "\"} " << outboundStats[i].numQueued << "\n";
+		WriteMetricHeader (s, "i2pd_outbound_queue_bytes", "gauge", "Bytes waiting for transport");
+		for (int i = 0; i < i2p::NUM_OUTBOUND_CLASSES; i++)
+			s << "i2pd_outbound_queue_bytes{class=\"" << i2p::GetOutboundClassName (i) << "\"} " << outboundStats[i].numQueuedBytes << "\n";
+		WriteMetricHeader (s, "i2pd_outbound_queue_sent_total", "counter", "Messages passed to transport");
+		for (int i = 0; i < i2p::NUM_OUTBOUND_CLASSES; i++)
+			s << "i2pd_outbound_queue_sent_total{class=\"" << i2p::GetOutboundClassName (i) << "\"} " << outboundStats[i].numSent << "\n";
+		WriteMetricHeader (s, "i2pd_outbound_queue_sent_bytes_total", "counter", "Bytes passed to transport");
+		for (int i = 0; i < i2p::NUM_OUTBOUND_CLASSES; i++)
+			s << "i2pd_outbound_queue_sent_bytes_total{class=\"" << i2p::GetOutboundClassName (i) << "\"} " << outboundStats[i].numSentBytes << "\n";
+		WriteMetricHeader (s, "i2pd_outbound_queue_expired_total", "counter", "Messages expired before sending");
+		for (int i = 0; i < i2p::NUM_OUTBOUND_CLASSES; i++)
+			s << "i2pd_outbound_queue_expired_total{class=\"" << i2p::GetOutboundClassName (i) << "\"} " << outboundStats[i].numExpired << "\n";
+		WriteMetricHeader (s, "i2pd_outbound_queue_dropped_total", "counter", "Messages dropped because queue was full");
+		for (int i = 0; i < i2p::NUM_OUTBOUND_CLASSES; i++)
+			s << "i2pd_outbound_queue_dropped_total{class=\"" << i2p::GetOutboundClassName (i) << "\"} " << outboundStats[i].numDropped << "\n";
+		auto& bandwidth = i2p::transports.GetBandwidthLimiter ();
+		i2p::util::TokenBucket * buckets[] = { &bandwidth.GetInbound (), &bandwidth.GetOutbound (), &bandwidth.GetTransit () };
+		const char * directions[] = { "inbound", "outbound", "transit" };
+		WriteMetricHeader (s, "i2pd_bandwidth_bytes_total", "counter", "Bytes passed through limiter");
+		for (int i = 0; i < 3; i++)
+			s << "i2pd_bandwidth_bytes_total{direction=\"" << directions[i] << "\"} " << buckets[i]->GetNumBytes () << "\n";
+		WriteMetricHeader (s, "i2pd_bandwidth_rejected_total", "counter", "Times limit has been exceeded");
+		for (int i = 0; i < 3; i++)
+			s << "i2pd_bandwidth_rejected_total{direction=\"" << directions[i] << "\"} " << buckets[i]->GetNumRejected () << "\n";
+		WriteMetricHeader (s, "i2pd_bandwidth_rate", "gauge", "Measured rate in bytes per second");
+		for (int i = 0; i < 3; i++)
+			s << "i2pd_bandwidth_rate{direction=\"" << directions[i] << "\"} " << buckets[i]->GetCurrentRate () << "\n";
+		WriteMetricHeader (s, "i2pd_bandwidth_limit", "gauge", "Limit in bytes per second, 0 means unlimited");
+		for (int i = 0; i < 3; i++)
+			s << "i2pd_bandwidth_limit{direction=\"" << directions[i] << "\"} " << buckets[i]->GetRate () << "\n";
+		auto& dhKeys = i2p::transports.GetDHKeysPairSupplier ();
+		WriteMetricHeader (s, "i2pd_dh_keys_hits_total", "counter", "DH keys taken from pool");
+		s << "i2pd_dh_keys_hits_total " << dhKeys.GetNumHits () << "\n";
+		WriteMetricHeader (s, "i2pd_dh_keys_misses_total", "counter", "DH key requests deferred because pool was empty");
+		s << "i2pd_dh_keys_misses_total " << dhKeys.GetNumMisses () << "\n";
+		WriteMetricHeader (s, "i2pd_dh_keys_generated_total", "counter", "DH keys generated for pool");
+		s << "i2pd_dh_keys_generated_total " << dhKeys.GetNumGenerated () << "\n";
+		WriteMetricHeader (s, "i2pd_dh_keys_generation_rate", "gauge", "DH keys generated per second");
+		s << "i2pd_dh_keys_generation_rate " << dhKeys.GetGenerationRate () << "\n";
+		WriteMetricHeader (s, "i2pd_dh_keys_acquire_rate", "gauge", "DH keys acquired per second");
+		s << "i2pd_dh_keys_acquire_rate " << dhKeys.GetAcquireRate () << "\n";
+		WriteMetricHeader (s, "i2pd_dh_keys_ready", "gauge", "DH keys waiting in pool");
+		s << "i2pd_dh_keys_ready " << dhKeys.GetNumReady () << "\n";
+		WriteMetricHeader (s, "i2pd_dh_keys_reserve_size", "gauge", "Number of DH keys pool keeps ready");
+		s << "i2pd_dh_keys_reserve_size " << dhKeys.GetReserveSize () << "\n";
+		SendReply (s.str (), 200, "text/plain; version=0.0.4");
+	}	
+
 	void HTTPConnection::FillContent (std::stringstream& s)
 	{
 		s << "Data path: " << i2p::util::filesystem::GetDataDir().string() << "<BR>" << "<BR>";
@@ -288,20 +422,62 @@ namespace util
 				s << "-->" << it.second->GetTunnelID ();
 			else
 				s << "-->" << it.second->GetTunnelID () << "-->";
-			s << " " << it.second->GetNumTransmittedBytes () << "<BR>";
+			s << " " << it.second->GetNumTransmittedBytes () << " " << it.second->GetCurrentRate ()/1024 << "K/s";
+			if (it.second->GetNumDroppedBytes () > 0)
+				s << " dropped " << it.second->GetNumDroppedBytes ();
+			s << "<BR>";
 		}	
 
 		s << "<P>Transports</P>";
+		auto& bandwidth = i2p::transports.GetBandwidthLimiter ();
+		i2p::util::TokenBucket * buckets[] = { &bandwidth.GetInbound (), &bandwidth.GetOutbound (), &bandwidth.GetTransit () };
+		const char * directions[] = { "in", "out", "transit" };
+		s << "Bandwidth";
+		for (int i = 0; i < 3; i++)
+		{
+			s << " " << directions[i] << " " << buckets[i]->GetCurrentRate ()/1024 << "K/s";
+			if (buckets[i]->GetRate ())
+				s << " of " << buckets[i]->GetRate ()/1024 << "K/s";
+		}
+		s << " (transit share " << bandwidth.GetTransitShare () << "%";
+		s << ", dropped in " << bandwidth.GetInbound ().GetNumRejected () << " transit " << bandwidth.GetTransit ().GetNumRejected () << ")<BR>";
+		auto& dhKeys = i2p::transports.GetDHKeysPairSupplier ();
+		s << "DH keys ready " << dhKeys.GetNumReady () << "/" << dhKeys.GetReserveSize () 
+			<< " hits " << dhKeys.GetNumHits () << " misses " << dhKeys.GetNumMisses ()
+			<< " generated " << dhKeys.GetNumGenerated () << " (" << dhKeys.GetGenerationRate () << "/s"
+			<< " with " << dhKeys.GetNumThreads () << " threads)<BR>";
+		auto& replayFilter = i2p::transports.GetReplayFilter ();
+		s << "Replay filter " << replayFilter.GetSize ()/1024 << "K keys " << replayFilter.GetNumKeys () << "/" << replayFilter.GetCapacity ()
+			<< " duplicates " << replayFilter.GetNumDuplicates () << " rotations " << replayFilter.GetNumRotations ()
+			<< " (" << replayFilter.GetNumEarlyRotations () << " early)<BR>";
+		s << "Outbound queues<BR>";
+		for (int i = 0; i < i2p::NUM_OUTBOUND_CLASSES; i++)
+		{
+			auto stats = i2p::GetOutboundQueueStats (i);
+			s << i2p::GetOutboundClassName (i) << ": queued " << stats.numQueued << " (" << stats.numQueuedBytes/1024 << "K)"
+				<< " sent " << stats.numSent << " (" << stats.numSentBytes/1024 << "K)"
+				<< " expired " << stats.numExpired << " dropped " << stats.numDropped << "<BR>";
+		}
 		s << "NTCP<BR>";
-		for (auto it: i2p::transports.GetNTCPSessions ())
+		uint64_t numNTCPWrites = i2p::transports.GetNumNTCPWrites ();
+		if (numNTCPWrites > 0)
+			s << "writes " << numNTCPWrites << " messages per write " << (double)i2p::transports.GetNumNTCPSentMessages ()/numNTCPWrites
+				<< " bytes per write " << i2p::transports.GetNumNTCPSentBytes ()/numNTCPWrites << "<BR>";
+		std::vector<std::shared_ptr<i2p::ntcp::NTCPSession> > ntcpSessions;
+		i2p::transports.GetNTCPSessions (ntcpSessions);
+		for (auto it: ntcpSessions)
 		{	
 			// RouterInfo of incoming connection doesn't have address
-			bool outgoing = it.second->GetRemoteRouterInfo ().GetNTCPAddress ();
-			if (it.second->IsEstablished ())
+			bool outgoing = it->GetRemoteRouterInfo ().GetNTCPAddress ();
+			if (it->IsEstablished ())
 			{
+				boost::system::error_code ec;
 				if (outgoing) s << "-->";
-				s << it.second->GetRemoteRouterInfo ().GetIdentHashAbbreviation () <<  ": " 
-					<< it.second->GetSocket ().remote_endpoint().address ().to_string ();
+				s << it->GetRemoteRouterInfo ().GetIdentHashAbbreviation () <<  ": " 
+					<< it->GetSocket ().remote_endpoint(ec).address ().to_string ();
+				uint64_t numWrites = it->GetNumWrites ();
+				if (numWrites > 0)
+					s << " writes " << numWrites << " bytes per write " << it->GetNumSentBytes ()/numWrites;
 				if (!outgoing) s << "-->";
 				s << "<BR>";
 			}	
@@ -310,17 +486,56 @@ namespace util
 		if (ssuServer)
 		{
 			s << "<BR>SSU<BR>";
-			for (auto it: ssuServer->GetSessions ())
+			s << "sessions " << ssuServer->GetNumSessions () << " relays " << ssuServer->GetNumRelays () << "<BR>";
+			uint64_t numDataPackets = ssuServer->GetNumSentDataPackets ();
+			uint64_t numAckPackets = ssuServer->GetNumSentAckPackets ();
+			s << "data packets " << numDataPackets << " ACK packets " << numAckPackets;
+			if (numDataPackets > 0)
+				s << " (" << (double)numAckPackets/numDataPackets << " ACK/data)";
+			s << " ACKs " << ssuServer->GetNumSentAcks () << "<BR>";
+			std::vector<i2p::ssu::SSUSessionInfo> ssuSessions;
+			ssuServer->GetSessions (ssuSessions);
+			for (auto it: ssuSessions)
 			{
-				// incoming connections don't have remote router
-				bool outgoing = it.second->GetRemoteRouter ();
-				auto endpoint = it.second->GetRemoteEndpoint ();
+				bool outgoing = it.isOutgoing;
+				auto endpoint = it.endpoint;
 				if (outgoing) s << "-->";
 				s << endpoint.address ().to_string () << ":" << endpoint.port ();
 				if (!outgoing) s << "-->";
+				s << " MTU " << it.mtu;
 				s << "<BR>";
+			}
+		}
+
+		s << "<P>CPU</P>";
+		s << "AES-NI " << (i2p::cpu::aesni ? "yes" : "no") << " PCLMUL " << (i2p::cpu::pclmul ? "yes" : "no")
+			<< " SHA-NI " << (i2p::cpu::shani ? "yes" : "no") << " AVX2 " << (i2p::cpu::avx2 ? "yes" : "no")
+			<< " VAES " << (i2p::cpu::vaes ? "yes" : "no") << "<BR>";
+		s << "AES: " << i2p::cpu::GetAESImplementation () << " SHA: " << i2p::cpu::GetSHAImplementation () << "<BR>";
+		s << "<P>I2NP messages pools</P>";
+		for (int i = 0; i < i2p::NUM_I2NP_MESSAGES_POOLS; i++)
+		{
+			auto stats = i2p::GetI2NPMessagesPoolStats (i);
+			s << stats.size << " bytes: " << "hits " << stats.numHits << " misses " << stats.numMisses
+				<< " live " << stats.numLive << " free " << stats.numFree << "<BR>";
+		}
+		s << "<P>Queues (<a href=/stats>stats</a>)</P>";
+		std::vector<QueueStats> queues;
+		QueueBase::GetAllQueuesStats (queues);
+		for (auto& it: queues)
+		{
+			s << it.name << ": depth " << it.depth << " max " << it.maxDepth << " processed " << it.numProcessed
+				<< " dropped local/transit " << it.numDropped[eQueueClassLocal] << "/" << it.numDropped[eQueueClassTransit];
+			if (it.numProcessed > 0)
+			{	
+				// median sojourn by histogram
+				uint64_t count = 0;
+				int median = 0;
+				while (median < QUEUE_SOJOURN_HISTOGRAM_SIZE - 1 && (count += it.sojournHistogram[median]) < it.numProcessed/2) median++;
+				s << " median sojourn " << (1ULL << median) << " us";
 			}	
-		}	
+			s << "<BR>";
+		}
 		s << "<p><a href=\"zmw2cyw2vj7f6obx3msmdvdepdhnw2ctc4okza2zjxlukkdfckhq\">Flibusta</a></p>";
 	}	
 
@@ -411,14 +626,14 @@ namespace util
 		}	
 	}
 
-	void HTTPConnection::SendReply (const std::string& content, int status)
+	void HTTPConnection::SendReply (const std::string& content, int status, const std::string& contentType)
 	{
 		m_Reply.content = content;
 		m_Reply.headers.resize(2);
 		m_Reply.headers[0].name = "Content-Length";
 		m_Reply.headers[0].value = boost::lexical_cast<std::string>(m_Reply.content.size());
 		m_Reply.headers[1].name = "Content-Type";
-		m_Reply.headers[1].value = "text/html";
+		m_Reply.headers[1].value = contentType;
 
 		boost::asio::async_write (*m_Socket, m_Reply.to_buffers(status),
         	boost::bind (&HTTPConnection::HandleWriteReply, this, 
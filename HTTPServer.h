@@ -53,9 +53,10 @@ namespace util
 			void HandleStreamReceive (const boost::system::error_code& ecode, std::size_t bytes_transferred);			
 			void HandleWriteReply(const boost::system::error_code& ecode);
 			void HandleWrite (const boost::system::error_code& ecode);
-			void SendReply (const std::string& content, int status = 200);
+			void SendReply (const std::string& content, int status = 200, const std::string& contentType = "text/html");
 
 			void HandleRequest ();
+			void HandleStatsRequest ();
 			void FillContent (std::stringstream& s);
 			std::string ExtractAddress ();
 			
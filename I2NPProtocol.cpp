@@ -1,5 +1,7 @@
 #include <string.h>
 #include <atomic>
+#include <mutex>
+#include <vector>
 #include "I2PEndian.h"
 #include <cryptopp/sha.h>
 #include <cryptopp/gzip.h>
@@ -13,22 +15,212 @@
 #include "Garlic.h"
 #include "I2NPProtocol.h"
 
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define thread_local __declspec(thread)
+#endif
+
 namespace i2p
 {
 
-	I2NPMessage * NewI2NPMessage ()
+	const int I2NP_MESSAGES_POOL_CACHE_SIZE = 32; // per thread and size class
+	const int I2NP_MESSAGES_POOL_FLUSH_INTERVAL = 64; // per-thread counters are flushed every 64 operations
+	struct I2NPMessagesPoolCache
+	{
+		I2NPMessage * msgs[I2NP_MESSAGES_POOL_CACHE_SIZE];
+		int num;
+		int numHits, numLive, numOps; // not flushed to pool's counters yet
+	};
+	// per-thread free lists. Our threads live as long as router does, so we don't return them back
+	static thread_local I2NPMessagesPoolCache poolCaches[NUM_I2NP_MESSAGES_POOLS];
+
+	class I2NPMessagesPool
+	{
+		public:
+
+			I2NPMessagesPool (int index, size_t size, size_t maxNumFree):
+				m_Index (index), m_Size (size), m_MaxNumFree (maxNumFree),
+				m_NumHits (0), m_NumMisses (0), m_NumLive (0) {};
+			virtual ~I2NPMessagesPool () {};
+
+			I2NPMessage * Acquire ()
+			{
+				auto& cache = poolCaches[m_Index];
+				if (!cache.num)
+				{
+					// refill per-thread list from shared one
+					std::unique_lock<std::mutex> l(m_FreeMutex);
+					while (!m_Free.empty () && cache.num < I2NP_MESSAGES_POOL_CACHE_SIZE/2)
+					{
+						cache.msgs[cache.num++] = m_Free.back ();
+						m_Free.pop_back ();
+					}
+				}
+				cache.numLive++;
+				I2NPMessage * msg = nullptr;
+				if (cache.num > 0)
+				{
+					cache.numHits++;
+					msg = cache.msgs[--cache.num];
+				}
+				else
+				{
+					m_NumMisses++;
+					msg = CreateMessage ();
+				}
+				UpdateCounters (cache);
+				return msg;
+			}
+
+			void Release (I2NPMessage * msg)
+			{
+				auto& cache = poolCaches[m_Index];
+				if (cache.num >= I2NP_MESSAGES_POOL_CACHE_SIZE)
+				{
+					// move half of per-thread list to shared one
+					std::unique_lock<std::mutex> l(m_FreeMutex);
+					while (cache.num > I2NP_MESSAGES_POOL_CACHE_SIZE/2)
+					{
+						I2NPMessage * m = cache.msgs[--cache.num];
+						if (m_Free.size () < m_MaxNumFree)
+							m_Free.push_back (m);
+						else
+							DestroyMessage (m);
+					}
+				}
+				cache.msgs[cache.num++] = msg;
+				cache.numLive--;
+				UpdateCounters (cache);
+			}
+
+			I2NPMessagesPoolStats GetStats ()
+			{
+				I2NPMessagesPoolStats stats;
+				stats.size = m_Size;
+				stats.numHits = m_NumHits;
+				stats.numMisses = m_NumMisses;
+				stats.numLive = m_NumLive;
+				std::unique_lock<std::mutex> l(m_FreeMutex);
+				stats.numFree = m_Free.size ();
+				return stats;
+			}
+
+		protected:
+
+			virtual I2NPMessage * CreateMessage () const = 0;
+			virtual void DestroyMessage (I2NPMessage * msg) const = 0;
+
+		private:
+
+			void UpdateCounters (I2NPMessagesPoolCache& cache)
+			{
+				cache.numOps++;
+				if (cache.numOps >= I2NP_MESSAGES_POOL_FLUSH_INTERVAL)
+				{
+					m_NumHits += cache.numHits;
+					m_NumLive += cache.numLive;
+					cache.numHits = 0;
+					cache.numLive = 0;
+					cache.numOps = 0;
+				}
+			}
+
+		private:
+
+			int m_Index;
+			size_t m_Size, m_MaxNumFree;
+			std::vector<I2NPMessage *> m_Free;
+			std::mutex m_FreeMutex;
+			std::atomic<uint64_t> m_NumHits, m_NumMisses;
+			std::atomic<int> m_NumLive;
+	};
+
+	template<size_t sz>
+	class I2NPMessagesPoolImpl: public I2NPMessagesPool
+	{
+		public:
+
+			I2NPMessagesPoolImpl (int index, size_t maxNumFree): I2NPMessagesPool (index, sz, maxNumFree) {};
+
+		protected:
+
+			I2NPMessage * CreateMessage () const { return new I2NPMessageBuffer<sz> (); };
+			void DestroyMessage (I2NPMessage * msg) const { delete static_cast<I2NPMessageBuffer<sz> *>(msg); };
+	};
+
+	static I2NPMessagesPool& GetI2NPMessagesPool (int pool)
+	{
+		// pools are never destroyed, because messages might be deleted during static destruction
+		static I2NPMessagesPool * pools[NUM_I2NP_MESSAGES_POOLS] =
+		{
+			new I2NPMessagesPoolImpl<I2NP_MAX_SHORT_MESSAGE_SIZE> (0, 4096), // 6M max
+			new I2NPMessagesPoolImpl<I2NP_MAX_MEDIUM_MESSAGE_SIZE> (1, 1024), // 4M max
+			new I2NPMessagesPoolImpl<I2NP_MAX_MESSAGE_SIZE> (2, 128) // 4M max
+		};
+		return *pools[pool];
+	}
+
+	static int GetI2NPMessagesPoolIndex (size_t size)
 	{
-		I2NPMessage * msg = new I2NPMessage;
-		msg->offset = 2; // reserve 2 bytes for NTCP header, should reserve more for SSU in future
-		msg->len = sizeof (I2NPHeader) + 2;
+		if (size <= I2NP_MAX_SHORT_MESSAGE_SIZE) return 0;
+		if (size <= I2NP_MAX_MEDIUM_MESSAGE_SIZE) return 1;
+		return NUM_I2NP_MESSAGES_POOLS - 1;
+	}
+
+	static I2NPMessage * NewI2NPMessageFromPool (int pool)
+	{
+		I2NPMessage * msg = GetI2NPMessagesPool (pool).Acquire ();
+		msg->offset = I2NP_MESSAGE_HEADROOM;
+		msg->len = msg->offset + sizeof (I2NPHeader);
 		msg->from = nullptr;
+		msg->isTransit = false;
+		msg->refCount = 1;
 		return msg;
 	}
-	
+
+	I2NPMessage * NewI2NPMessage ()
+	{
+		return NewI2NPMessageFromPool (NUM_I2NP_MESSAGES_POOLS - 1);
+	}
+
+	I2NPMessage * NewI2NPShortMessage ()
+	{
+		return NewI2NPMessageFromPool (0);
+	}
+
+	I2NPMessage * NewI2NPMessage (size_t len)
+	{
+		len += I2NP_MESSAGE_HEADROOM + sizeof (I2NPHeader) + I2NP_MESSAGE_TAILROOM;
+		return NewI2NPMessageFromPool (GetI2NPMessagesPoolIndex (len));
+	}
+
 	void DeleteI2NPMessage (I2NPMessage * msg)
 	{
-		delete msg;
-	}	
+		if (msg && msg->refCount.fetch_sub (1) == 1) // last reference
+			GetI2NPMessagesPool (GetI2NPMessagesPoolIndex (msg->maxLen)).Release (msg);
+	}
+
+	I2NPMessage * ShareI2NPMessage (I2NPMessage * msg)
+	{
+		if (msg) msg->refCount++;
+		return msg;
+	}
+
+	I2NPMessage * UnshareI2NPMessage (I2NPMessage * msg)
+	{
+		if (msg && msg->IsShared ())
+		{
+			I2NPMessage * copy = NewI2NPMessage (msg->GetLength ());
+			*copy = *msg;
+			DeleteI2NPMessage (msg);
+			return copy;
+		}
+		return msg;
+	}
+
+	I2NPMessagesPoolStats GetI2NPMessagesPoolStats (int pool)
+	{
+		return GetI2NPMessagesPool (pool).GetStats ();
+	}
 
 	static std::atomic<uint32_t> I2NPmsgID(0); // TODO: create class
 	void FillI2NPMessageHeader (I2NPMessage * msg, I2NPMessageType msgType, uint32_t replyMsgID)
@@ -63,7 +255,7 @@ namespace i2p
 
 	I2NPMessage * CreateI2NPMessage (I2NPMessageType msgType, const uint8_t * buf, int len, uint32_t replyMsgID)
 	{
-		I2NPMessage * msg = NewI2NPMessage ();
+		I2NPMessage * msg = NewI2NPMessage (len);
 		memcpy (msg->GetPayload (), buf, len);
 		msg->len += len;
 		FillI2NPMessageHeader (msg, msgType, replyMsgID);
@@ -72,7 +264,7 @@ namespace i2p
 
 	I2NPMessage * CreateI2NPMessage (const uint8_t * buf, int len)
 	{
-		I2NPMessage * msg = NewI2NPMessage ();
+		I2NPMessage * msg = NewI2NPMessage (len);
 		memcpy (msg->GetBuffer (), buf, len);
 		msg->len = msg->offset + len;
 		return msg;
@@ -98,7 +290,8 @@ namespace i2p
 		uint32_t replyTunnelID, bool exploratory, std::set<i2p::data::IdentHash> * excludedPeers,
 	    bool encryption)
 	{
-		I2NPMessage * m = NewI2NPMessage ();
+		I2NPMessage * m = (excludedPeers && !exploratory) ? 
+			NewI2NPMessage (136 + excludedPeers->size ()*32) : NewI2NPShortMessage (); // 136 = 32 + 32 + 5 + 2 + 65
 		uint8_t * buf = m->GetPayload ();
 		memcpy (buf, key, 32); // key
 		buf += 32;
@@ -180,7 +373,7 @@ namespace i2p
 
 	I2NPMessage * CreateDatabaseSearchReply (const i2p::data::IdentHash& ident)
 	{
-		I2NPMessage * m = NewI2NPMessage ();
+		I2NPMessage * m = NewI2NPShortMessage ();
 		uint8_t * buf = m->GetPayload ();
 		memcpy (buf, ident, 32);
 		buf[32] = 0; // TODO:
@@ -192,18 +385,19 @@ namespace i2p
 	
 	I2NPMessage * CreateDatabaseStoreMsg ()
 	{
-		I2NPMessage * m = NewI2NPMessage ();
+		CryptoPP::Gzip compressor;
+		compressor.Put (context.GetRouterInfo ().GetBuffer (), context.GetRouterInfo ().GetBufferLen ());
+		compressor.MessageEnd();
+		// WARNING!!! MaxRetrievable() return uint64_t.  ,  -  
+		int size = compressor.MaxRetrievable ();
+
+		I2NPMessage * m = NewI2NPMessage (sizeof (I2NPDatabaseStoreMsg) + 2 + size);
 		I2NPDatabaseStoreMsg * msg = (I2NPDatabaseStoreMsg *)m->GetPayload ();		
 
 		memcpy (msg->key, context.GetRouterInfo ().GetIdentHash (), 32);
 		msg->type = 0;
 		msg->replyToken = 0;
 		
-		CryptoPP::Gzip compressor;
-		compressor.Put (context.GetRouterInfo ().GetBuffer (), context.GetRouterInfo ().GetBufferLen ());
-		compressor.MessageEnd();
-		// WARNING!!! MaxRetrievable() return uint64_t.  ,  -  
-		int size = compressor.MaxRetrievable ();
 		uint8_t * buf = m->GetPayload () + sizeof (I2NPDatabaseStoreMsg);
 		*(uint16_t *)buf = htobe16 (size); // size
 		buf += 2;
@@ -369,7 +563,7 @@ namespace i2p
 
 	I2NPMessage * CreateTunnelDataMsg (const uint8_t * buf)
 	{
-		I2NPMessage * msg = NewI2NPMessage ();
+		I2NPMessage * msg = NewI2NPShortMessage ();
 		memcpy (msg->GetPayload (), buf, i2p::tunnel::TUNNEL_DATA_MSG_SIZE);
 		msg->len += i2p::tunnel::TUNNEL_DATA_MSG_SIZE; 
 		FillI2NPMessageHeader (msg, eI2NPTunnelData);
@@ -378,7 +572,7 @@ namespace i2p
 
 	I2NPMessage * CreateTunnelDataMsg (uint32_t tunnelID, const uint8_t * payload)	
 	{
-		I2NPMessage * msg = NewI2NPMessage ();
+		I2NPMessage * msg = NewI2NPShortMessage ();
 		memcpy (msg->GetPayload () + 4, payload, i2p::tunnel::TUNNEL_DATA_MSG_SIZE - 4);
 		*(uint32_t *)(msg->GetPayload ()) = htobe32 (tunnelID);
 		msg->len += i2p::tunnel::TUNNEL_DATA_MSG_SIZE; 
@@ -388,7 +582,7 @@ namespace i2p
 	
 	I2NPMessage * CreateTunnelGatewayMsg (uint32_t tunnelID, const uint8_t * buf, size_t len)
 	{
-		I2NPMessage * msg = NewI2NPMessage ();
+		I2NPMessage * msg = NewI2NPMessage (sizeof (TunnelGatewayHeader) + len);
 		TunnelGatewayHeader * header = (TunnelGatewayHeader *)msg->GetPayload ();
 		header->tunnelID = htobe32 (tunnelID);
 		header->length = htobe16 (len);
@@ -400,15 +594,14 @@ namespace i2p
 
 	I2NPMessage * CreateTunnelGatewayMsg (uint32_t tunnelID, I2NPMessage * msg)
 	{
-		if (msg->offset >= sizeof (I2NPHeader) + sizeof (TunnelGatewayHeader))
+		if (!msg->IsShared () && msg->GetHeadroom () >= sizeof (I2NPHeader) + sizeof (TunnelGatewayHeader))
 		{
 			// message is capable to be used without copying
-			TunnelGatewayHeader * header = (TunnelGatewayHeader *)(msg->GetBuffer () - sizeof (TunnelGatewayHeader));
-			header->tunnelID = htobe32 (tunnelID);
 			int len = msg->GetLength ();
+			msg->Prepend (sizeof (I2NPHeader) + sizeof (TunnelGatewayHeader));
+			TunnelGatewayHeader * header = (TunnelGatewayHeader *)msg->GetPayload ();
+			header->tunnelID = htobe32 (tunnelID);
 			header->length = htobe16 (len);
-			msg->offset -= (sizeof (I2NPHeader) + sizeof (TunnelGatewayHeader));
-			msg->len = msg->offset + sizeof (I2NPHeader) + sizeof (TunnelGatewayHeader) +len;
 			FillI2NPMessageHeader (msg, eI2NPTunnelGateway);
 			return msg;
 		}
@@ -423,8 +616,8 @@ namespace i2p
 	I2NPMessage * CreateTunnelGatewayMsg (uint32_t tunnelID, I2NPMessageType msgType, 
 		const uint8_t * buf, size_t len, uint32_t replyMsgID)
 	{
-		I2NPMessage * msg = NewI2NPMessage ();
 		size_t gatewayMsgOffset = sizeof (I2NPHeader) + sizeof (TunnelGatewayHeader);
+		I2NPMessage * msg = NewI2NPMessage (gatewayMsgOffset + len);
 		msg->offset += gatewayMsgOffset;
 		msg->len += gatewayMsgOffset;
 		memcpy (msg->GetPayload (), buf, len);
@@ -451,9 +644,9 @@ namespace i2p
 		if (msg->GetHeader()->typeID == eI2NPDatabaseStore)
 		{
 			// transit DatabaseStore my contain new/updated RI
-			auto ds = NewI2NPMessage ();
+			auto ds = NewI2NPMessage (msg->GetLength ());
 			*ds = *msg;
-			i2p::data::netdb.PostI2NPMsg (ds);
+			i2p::data::netdb.PostI2NPMsg (ds, true);
 		}	
 		i2p::tunnel::TransitTunnel * tunnel =  i2p::tunnel::tunnels.GetTransitTunnel (tunnelID);
 		if (tunnel)
@@ -3,6 +3,7 @@
 
 #include <inttypes.h>
 #include <set>
+#include <atomic>
 #include <string.h>
 #include "I2PEndian.h"
 #include "RouterInfo.h"
@@ -101,23 +102,36 @@ namespace tunnel
 }
 
 	const size_t I2NP_MAX_MESSAGE_SIZE = 32768; 
+	const size_t I2NP_MAX_MEDIUM_MESSAGE_SIZE = 4096; // fits SSU packet and TunnelGateway buffer
+	const size_t I2NP_MAX_SHORT_MESSAGE_SIZE = 1536; // fits TunnelData
+	const size_t I2NP_MESSAGE_HEADROOM = 64; // TunnelGateway header followed by SSU or NTCP framing
+	const size_t I2NP_MESSAGE_TAILROOM = 48; // SSU padding and MAC data or NTCP padding and checksum
 	struct I2NPMessage
 	{	
-		uint8_t buf[I2NP_MAX_MESSAGE_SIZE];	
-		size_t len, offset;
+		uint8_t * buf;	
+		size_t len, offset, maxLen;
 		i2p::tunnel::InboundTunnel * from;
+		bool isTransit; // sent on behalf of participating tunnel
+		std::atomic<int> refCount; // every holder calls DeleteI2NPMessage
 		
 		I2NPHeader * GetHeader () { return (I2NPHeader *)GetBuffer (); };
 		uint8_t * GetPayload () { return GetBuffer () + sizeof(I2NPHeader); };
 		uint8_t * GetBuffer () { return buf + offset; };
 		const uint8_t * GetBuffer () const { return buf + offset; };
 		size_t GetLength () const { return len - offset; };
+		bool IsShared () const { return refCount > 1; }; // shared message must not be modified
+		// room for tunnel and transport headers, callers check it before Prepend and Append
+		size_t GetHeadroom () const { return offset; };
+		size_t GetTailroom () const { return maxLen - len; };
+		uint8_t * Prepend (size_t l) { offset -= l; return GetBuffer (); };
+		uint8_t * Append (size_t l) { uint8_t * tail = buf + len; len += l; return tail; };
 
 		I2NPMessage& operator=(const I2NPMessage& other)
 		{
 			memcpy (buf + offset, other.buf + other.offset, other.GetLength ());
 			len = offset + other.GetLength ();
 			from = other.from;
+			isTransit = other.isTransit;
 			return *this;
 		}	
 
@@ -143,8 +157,29 @@ namespace tunnel
 			return be32toh (header.msgID);
 		}	
 	};	
+
+	template<size_t sz>
+	struct I2NPMessageBuffer: public I2NPMessage
+	{
+		I2NPMessageBuffer () { buf = m_Buffer; maxLen = sz; };
+		uint8_t m_Buffer[sz];
+	};
+
 	I2NPMessage * NewI2NPMessage ();
+	I2NPMessage * NewI2NPShortMessage ();
+	I2NPMessage * NewI2NPMessage (size_t len); // at least len bytes of payload
 	void DeleteI2NPMessage (I2NPMessage * msg);
+	I2NPMessage * ShareI2NPMessage (I2NPMessage * msg); // adds reference, returns same message
+	I2NPMessage * UnshareI2NPMessage (I2NPMessage * msg); // returns modifiable copy if message is shared
+
+	const int NUM_I2NP_MESSAGES_POOLS = 3; // short, medium, max
+	struct I2NPMessagesPoolStats
+	{
+		size_t size; // buffer size of the class
+		uint64_t numHits, numMisses;
+		int numLive, numFree;
+	};	
+	I2NPMessagesPoolStats GetI2NPMessagesPoolStats (int pool); // for HTTP only
 	void FillI2NPMessageHeader (I2NPMessage * msg, I2NPMessageType msgType, uint32_t replyMsgID = 0);
 	void RenewI2NPMessageHeader (I2NPMessage * msg);
 	I2NPMessage * CreateI2NPMessage (I2NPMessageType msgType, const uint8_t * buf, int len, uint32_t replyMsgID = 0);	
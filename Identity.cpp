@@ -2,7 +2,6 @@
 #include <stdio.h>
 #include <cryptopp/sha.h>
 #include <cryptopp/osrng.h>
-#include <cryptopp/dh.h>
 #include <cryptopp/dsa.h>
 #include "CryptoConst.h"
 #include "Identity.h"
@@ -47,8 +46,7 @@ namespace data
 		CryptoPP::AutoSeededRandomPool rnd;
 
 		// encryption
-		CryptoPP::DH dh (i2p::crypto::elgp, i2p::crypto::elgg);
-		dh.GenerateKeyPair(rnd, keys.privateKey, keys.publicKey);
+		i2p::crypto::GenerateElGamalKeyPair (rnd, keys.privateKey, keys.publicKey);
 
 		// signing
 		CryptoPP::DSA::PrivateKey privateKey;
@@ -65,8 +63,7 @@ namespace data
 	{
 		if (!keys) return;
 		CryptoPP::AutoSeededRandomPool rnd;
-		CryptoPP::DH dh (i2p::crypto::elgp, i2p::crypto::elgg);
-		dh.GenerateKeyPair(rnd, keys->privateKey, keys->publicKey);
+		i2p::crypto::GenerateElGamalKeyPair (rnd, keys->privateKey, keys->publicKey);
 	}
 
 	RoutingKey CreateRoutingKey (const IdentHash& ident)
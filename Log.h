@@ -22,7 +22,7 @@ class Log: public i2p::util::MsgQueue<LogMsg>
 {
 	public:
 
-		Log (): m_LogFile (nullptr) { SetOnEmpty (std::bind (&Log::Flush, this)); };
+		Log (): i2p::util::MsgQueue<LogMsg> ("log"), m_LogFile (nullptr) { SetOnEmpty (std::bind (&Log::Flush, this)); };
 		~Log () { delete m_LogFile; };
 
 		void SetLogFile (const std::string& fullFilePath);
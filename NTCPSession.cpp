@@ -20,27 +20,28 @@ namespace i2p
 namespace ntcp
 {
 	NTCPSession::NTCPSession (boost::asio::io_service& service, i2p::data::RouterInfo& in_RemoteRouterInfo): 
-		m_Socket (service), m_TerminationTimer (service), m_IsEstablished (false), 
-		m_RemoteRouterInfo (in_RemoteRouterInfo), m_ReceiveBufferOffset (0), m_NextMessage (nullptr)
+		m_Socket (service), m_Strand (service), m_TerminationTimer (service), m_ReceiveTimer (service), m_SendTimer (service), m_IsEstablished (false), 
+		m_IsTerminated (false), m_IsHandshaking (false), m_RemoteRouterInfo (in_RemoteRouterInfo), m_ReceiveBufferOffset (0), m_NextMessage (nullptr),
+		m_IsSending (false), m_IsTimeSyncPending (false), m_NumWrites (0), m_NumSentBytes (0)
 	{		
-		m_DHKeysPair = i2p::transports.GetNextDHKeysPair ();	
+		m_DHKeysPair = nullptr; // acquired when handshake starts
 	}
 	
 	NTCPSession::~NTCPSession ()
 	{
+		HandshakeFinished ();
 		delete m_DHKeysPair;
-		delete m_NextMessage;
+		i2p::DeleteI2NPMessage (m_NextMessage);
 	}
 
-	void NTCPSession::CreateAESKey (uint8_t * pubKey, uint8_t * aesKey)
+	bool NTCPSession::CreateAESKey (uint8_t * pubKey, uint8_t * aesKey)
 	{
 		CryptoPP::DH dh (elgp, elgg);
 		uint8_t sharedKey[256];
 		if (!dh.Agree (sharedKey, m_DHKeysPair->privateKey, pubKey))
 		{    
 		    LogPrint ("Couldn't create shared key");
-			Terminate ();
-			return;
+			return false;
 		};
 
 		if (sharedKey[0] & 0x80)
@@ -60,31 +61,36 @@ namespace ntcp
 				if (nonZero - sharedKey > 32)
 				{
 					LogPrint ("First 32 bytes of shared key is all zeros. Ignored");
-					return;
+					return false;
 				}	
 			}
 			memcpy (aesKey, nonZero, 32);
 		}
+		return true;
 	}	
 
 	void NTCPSession::Terminate ()
 	{
+		if (m_IsTerminated) return; // read and write might fail both
+		m_IsTerminated = true;
+		HandshakeFinished ();
 		m_IsEstablished = false;
 		m_Socket.close ();
-		i2p::transports.RemoveNTCPSession (this);
+		m_TerminationTimer.cancel ();
+		m_ReceiveTimer.cancel ();
+		m_SendTimer.cancel ();
+		i2p::transports.RemoveNTCPSession (shared_from_this ());
 		int numDelayed = 0;
-		for (auto it :m_DelayedMessages)
+		while (auto msg = m_SendQueue.Get ())
 		{	
 			// try to send them again
-			i2p::transports.SendMessage (m_RemoteRouterInfo.GetIdentHash (), it);
+			i2p::transports.SendMessage (m_RemoteRouterInfo.GetIdentHash (), msg);
 			numDelayed++;
 		}	
-		m_DelayedMessages.clear ();
 		if (numDelayed > 0)
 			LogPrint ("NTCP session ", numDelayed, " not sent");
 		// TODO: notify tunnels
 		
-		delete this;
 		LogPrint ("NTCP session terminated");
 	}	
 
@@ -93,19 +99,37 @@ namespace ntcp
 		LogPrint ("NTCP session connected");
 		m_IsEstablished = true;
 
-		SendTimeSyncMessage ();
+		SendTimeSyncMessage (); // delayed messages go out with it
 		SendI2NPMessage (CreateDatabaseStoreMsg ()); // we tell immediately who we are		
-
-		if (!m_DelayedMessages.empty ())
+	}	
+		
+	void NTCPSession::HandshakeFinished ()
+	{
+		if (m_IsHandshaking)
 		{
-			for (auto it :m_DelayedMessages)
-				SendI2NPMessage (it);
-			m_DelayedMessages.clear ();
+			m_IsHandshaking = false;
+			i2p::transports.ReleaseHandshake ();
 		}	
 	}	
-		
+
 	void NTCPSession::ClientLogin ()
 	{
+		if (!m_IsHandshaking)
+		{
+			m_IsHandshaking = i2p::transports.AcquireHandshake (false); // outgoing is always accepted
+			ScheduleEstablishTimeout ();
+		}
+		if (!m_DHKeysPair)
+		{
+			// don't generate keys here, continue once supplier has one
+			auto s = shared_from_this ();
+			i2p::transports.GetNextDHKeysPair ([s](i2p::data::DHKeysPair * keys)
+				{
+					s->m_DHKeysPair = keys;
+					s->m_Strand.post (boost::bind (&NTCPSession::ClientLogin, s));
+				});
+			return;
+		}	
 		// send Phase1
 		const uint8_t * x = m_DHKeysPair->publicKey;
 		memcpy (m_Phase1.pubKey, x, 256);
@@ -115,15 +139,17 @@ namespace ntcp
 			m_Phase1.HXxorHI[i] ^= ident[i];
 		
 		boost::asio::async_write (m_Socket, boost::asio::buffer (&m_Phase1, sizeof (m_Phase1)), boost::asio::transfer_all (),
-        	boost::bind(&NTCPSession::HandlePhase1Sent, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+        	m_Strand.wrap (boost::bind(&NTCPSession::HandlePhase1Sent, shared_from_this (), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
 	}	
 
 	void NTCPSession::ServerLogin ()
 	{
+		m_IsHandshaking = true; // acquired by acceptor
+		ScheduleEstablishTimeout ();
 		// receive Phase1
 		boost::asio::async_read (m_Socket, boost::asio::buffer(&m_Phase1, sizeof (m_Phase1)),                     
-			boost::bind(&NTCPSession::HandlePhase1Received, this, 
-				boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+			m_Strand.wrap (boost::bind(&NTCPSession::HandlePhase1Received, shared_from_this (), 
+				boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
 	}	
 		
 	void NTCPSession::HandlePhase1Sent (const boost::system::error_code& ecode, std::size_t bytes_transferred)
@@ -137,8 +163,8 @@ namespace ntcp
 		{	
 			LogPrint ("Phase 1 sent: ", bytes_transferred);
 			boost::asio::async_read (m_Socket, boost::asio::buffer(&m_Phase2, sizeof (m_Phase2)),                  
-				boost::bind(&NTCPSession::HandlePhase2Received, this, 
-					boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+				m_Strand.wrap (boost::bind(&NTCPSession::HandlePhase2Received, shared_from_this (), 
+					boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
 		}	
 	}	
 
@@ -166,11 +192,16 @@ namespace ntcp
 				}	
 			}	
 			
-			SendPhase2 ();
+			auto s = shared_from_this ();
+			i2p::transports.GetNextDHKeysPair ([s](i2p::data::DHKeysPair * keys)
+				{
+					s->m_DHKeysPair = keys;
+					i2p::transports.GetCryptoService ().post (boost::bind (&NTCPSession::CreatePhase2, s));
+				});
 		}	
 	}	
 
-	void NTCPSession::SendPhase2 ()
+	void NTCPSession::CreatePhase2 ()
 	{
 		const uint8_t * y = m_DHKeysPair->publicKey;
 		memcpy (m_Phase2.pubKey, y, 256);
@@ -183,15 +214,27 @@ namespace ntcp
 		// TODO: fill filler
 
 		uint8_t aesKey[32];
-		CreateAESKey (m_Phase1.pubKey, aesKey);
-		m_Encryption.SetKey (aesKey);
-		m_Encryption.SetIV (y + 240);
-		m_Decryption.SetKey (aesKey);
-		m_Decryption.SetIV (m_Phase1.HXxorHI + 16);
-		
-		m_Encryption.Encrypt ((uint8_t *)&m_Phase2.encrypted, sizeof(m_Phase2.encrypted), (uint8_t *)&m_Phase2.encrypted);
+		bool isCreated = CreateAESKey (m_Phase1.pubKey, aesKey);
+		if (isCreated)
+		{	
+			m_Encryption.SetKey (aesKey);
+			m_Encryption.SetIV (y + 240);
+			m_Decryption.SetKey (aesKey);
+			m_Decryption.SetIV (m_Phase1.HXxorHI + 16);
+			m_Encryption.Encrypt ((uint8_t *)&m_Phase2.encrypted, sizeof(m_Phase2.encrypted), (uint8_t *)&m_Phase2.encrypted);
+		}	
+		m_Strand.post (boost::bind (&NTCPSession::SendPhase2, shared_from_this (), isCreated, tsB));
+	}	
+
+	void NTCPSession::SendPhase2 (bool isCreated, uint32_t tsB)
+	{
+		if (!isCreated)
+		{
+			Terminate ();
+			return;
+		}	
 		boost::asio::async_write (m_Socket, boost::asio::buffer (&m_Phase2, sizeof (m_Phase2)), boost::asio::transfer_all (),
-        	boost::bind(&NTCPSession::HandlePhase2Sent, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, tsB));
+        	m_Strand.wrap (boost::bind(&NTCPSession::HandlePhase2Sent, shared_from_this (), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, tsB)));
 
 	}	
 		
@@ -206,8 +249,8 @@ namespace ntcp
 		{	
 			LogPrint ("Phase 2 sent: ", bytes_transferred);
 			boost::asio::async_read (m_Socket, boost::asio::buffer(&m_Phase3, sizeof (m_Phase3)),                   
-				boost::bind(&NTCPSession::HandlePhase3Received, this, 
-					boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, tsB));
+				m_Strand.wrap (boost::bind(&NTCPSession::HandlePhase3Received, shared_from_this (), 
+					boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, tsB)));
 		}	
 	}	
 		
@@ -222,31 +265,39 @@ namespace ntcp
 		else
 		{	
 			LogPrint ("Phase 2 received: ", bytes_transferred);
+			i2p::transports.GetCryptoService ().post (boost::bind (&NTCPSession::HandlePhase2, shared_from_this ()));
+		}	
+	}	
+
+	void NTCPSession::HandlePhase2 ()
+	{
+		uint8_t aesKey[32];
+		if (!CreateAESKey (m_Phase2.pubKey, aesKey))
+		{
+			m_Strand.post (boost::bind (&NTCPSession::SendPhase3, shared_from_this (), false, 0));
+			return;
+		}	
+		m_Decryption.SetKey (aesKey);
+		m_Decryption.SetIV (m_Phase2.pubKey + 240);
+		m_Encryption.SetKey (aesKey);
+		m_Encryption.SetIV (m_Phase1.HXxorHI + 16);
 		
-			uint8_t aesKey[32];
-			CreateAESKey (m_Phase2.pubKey, aesKey);
-			m_Decryption.SetKey (aesKey);
-			m_Decryption.SetIV (m_Phase2.pubKey + 240);
-			m_Encryption.SetKey (aesKey);
-			m_Encryption.SetIV (m_Phase1.HXxorHI + 16);
-			
-			m_Decryption.Decrypt((uint8_t *)&m_Phase2.encrypted, sizeof(m_Phase2.encrypted), (uint8_t *)&m_Phase2.encrypted);
-			// verify
-			uint8_t xy[512], hxy[32];
-			memcpy (xy, m_DHKeysPair->publicKey, 256);
-			memcpy (xy + 256, m_Phase2.pubKey, 256);
-			CryptoPP::SHA256().CalculateDigest(hxy, xy, 512); 
-			if (memcmp (hxy, m_Phase2.encrypted.hxy, 32))
-			{
-				LogPrint ("Incorrect hash");
-				Terminate ();
-				return ;
-			}	
-			SendPhase3 ();
+		m_Decryption.Decrypt((uint8_t *)&m_Phase2.encrypted, sizeof(m_Phase2.encrypted), (uint8_t *)&m_Phase2.encrypted);
+		// verify
+		uint8_t xy[512], hxy[32];
+		memcpy (xy, m_DHKeysPair->publicKey, 256);
+		memcpy (xy + 256, m_Phase2.pubKey, 256);
+		CryptoPP::SHA256().CalculateDigest(hxy, xy, 512); 
+		if (memcmp (hxy, m_Phase2.encrypted.hxy, 32))
+		{
+			LogPrint ("Incorrect hash");
+			m_Strand.post (boost::bind (&NTCPSession::SendPhase3, shared_from_this (), false, 0));
+			return ;
 		}	
+		CreatePhase3 ();
 	}	
 
-	void NTCPSession::SendPhase3 ()
+	void NTCPSession::CreatePhase3 ()
 	{
 		m_Phase3.size = htons (sizeof (m_Phase3.ident));
 		memcpy (&m_Phase3.ident, &i2p::context.GetRouterIdentity (), sizeof (m_Phase3.ident));		
@@ -262,9 +313,18 @@ namespace ntcp
 		i2p::context.Sign ((uint8_t *)&s, sizeof (s), m_Phase3.signature);
 
 		m_Encryption.Encrypt((uint8_t *)&m_Phase3, sizeof(m_Phase3), (uint8_t *)&m_Phase3);
-		        
+		m_Strand.post (boost::bind (&NTCPSession::SendPhase3, shared_from_this (), true, tsA));
+	}	
+
+	void NTCPSession::SendPhase3 (bool isCreated, uint32_t tsA)
+	{
+		if (!isCreated)
+		{
+			Terminate ();
+			return;
+		}	
 		boost::asio::async_write (m_Socket, boost::asio::buffer (&m_Phase3, sizeof (m_Phase3)), boost::asio::transfer_all (),
-        	boost::bind(&NTCPSession::HandlePhase3Sent, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, tsA));				
+        	m_Strand.wrap (boost::bind(&NTCPSession::HandlePhase3Sent, shared_from_this (), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, tsA)));				
 	}	
 		
 	void NTCPSession::HandlePhase3Sent (const boost::system::error_code& ecode, std::size_t bytes_transferred, uint32_t tsA)
@@ -278,8 +338,8 @@ namespace ntcp
 		{	
 			LogPrint ("Phase 3 sent: ", bytes_transferred);
 			boost::asio::async_read (m_Socket, boost::asio::buffer(&m_Phase4, sizeof (m_Phase4)),                  
-				boost::bind(&NTCPSession::HandlePhase4Received, this, 
-					boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, tsA));
+				m_Strand.wrap (boost::bind(&NTCPSession::HandlePhase4Received, shared_from_this (), 
+					boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, tsA)));
 		}	
 	}	
 
@@ -295,29 +355,32 @@ namespace ntcp
 			LogPrint ("Phase 3 received: ", bytes_transferred);
 			m_Decryption.Decrypt ((uint8_t *)&m_Phase3, sizeof(m_Phase3), (uint8_t *)&m_Phase3);
 			m_RemoteRouterInfo.SetRouterIdentity (m_Phase3.ident);
-
-			SignedData s;
-			memcpy (s.x, m_Phase1.pubKey, 256);
-			memcpy (s.y, m_Phase2.pubKey, 256);
-			memcpy (s.ident, i2p::context.GetRouterInfo ().GetIdentHash (), 32);
-			s.tsA = m_Phase3.timestamp;
-			s.tsB = tsB;
-			
-			CryptoPP::DSA::PublicKey pubKey;
-			pubKey.Initialize (dsap, dsaq, dsag, CryptoPP::Integer (m_RemoteRouterInfo.GetRouterIdentity ().signingKey, 128));
-			CryptoPP::DSA::Verifier verifier (pubKey);
-			if (!verifier.VerifyMessage ((uint8_t *)&s, sizeof(s), m_Phase3.signature, 40))
-			{	
-				LogPrint ("signature verification failed");
-				Terminate ();
-				return;
-			}	
-
-			SendPhase4 (tsB);
+			i2p::transports.GetCryptoService ().post (boost::bind (&NTCPSession::VerifyPhase3, shared_from_this (), tsB));
 		}	
 	}
 
-	void NTCPSession::SendPhase4 (uint32_t tsB)
+	void NTCPSession::VerifyPhase3 (uint32_t tsB)
+	{
+		SignedData s;
+		memcpy (s.x, m_Phase1.pubKey, 256);
+		memcpy (s.y, m_Phase2.pubKey, 256);
+		memcpy (s.ident, i2p::context.GetRouterInfo ().GetIdentHash (), 32);
+		s.tsA = m_Phase3.timestamp;
+		s.tsB = tsB;
+		
+		CryptoPP::DSA::PublicKey pubKey;
+		pubKey.Initialize (dsap, dsaq, dsag, CryptoPP::Integer (m_RemoteRouterInfo.GetRouterIdentity ().signingKey, 128));
+		CryptoPP::DSA::Verifier verifier (pubKey);
+		if (!verifier.VerifyMessage ((uint8_t *)&s, sizeof(s), m_Phase3.signature, 40))
+		{	
+			LogPrint ("signature verification failed");
+			m_Strand.post (boost::bind (&NTCPSession::SendPhase4, shared_from_this (), false));
+			return;
+		}	
+		CreatePhase4 (tsB);
+	}	
+
+	void NTCPSession::CreatePhase4 (uint32_t tsB)
 	{
 		SignedData s;
 		memcpy (s.x, m_Phase1.pubKey, 256);
@@ -327,9 +390,18 @@ namespace ntcp
 		s.tsB = tsB;
 		i2p::context.Sign ((uint8_t *)&s, sizeof (s), m_Phase4.signature);
 		m_Encryption.Encrypt ((uint8_t *)&m_Phase4, sizeof(m_Phase4), (uint8_t *)&m_Phase4);
+		m_Strand.post (boost::bind (&NTCPSession::SendPhase4, shared_from_this (), true));
+	}	
 
+	void NTCPSession::SendPhase4 (bool isVerified)
+	{
+		if (!isVerified)
+		{
+			Terminate ();
+			return;
+		}	
 		boost::asio::async_write (m_Socket, boost::asio::buffer (&m_Phase4, sizeof (m_Phase4)), boost::asio::transfer_all (),
-        	boost::bind(&NTCPSession::HandlePhase4Sent, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+        	m_Strand.wrap (boost::bind(&NTCPSession::HandlePhase4Sent, shared_from_this (), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
 	}	
 
 	void NTCPSession::HandlePhase4Sent (const boost::system::error_code& ecode,  std::size_t bytes_transferred)
@@ -342,6 +414,7 @@ namespace ntcp
 		else
 		{	
 			LogPrint ("Phase 4 sent: ", bytes_transferred);
+			HandshakeFinished ();
 			Connected ();
 			m_ReceiveBufferOffset = 0;
 			m_NextMessage = nullptr;
@@ -361,37 +434,49 @@ namespace ntcp
 		{	
 			LogPrint ("Phase 4 received: ", bytes_transferred);
 			m_Decryption.Decrypt((uint8_t *)&m_Phase4, sizeof(m_Phase4), (uint8_t *)&m_Phase4);
-
-			// verify signature
-			SignedData s;
-			memcpy (s.x, m_Phase1.pubKey, 256);
-			memcpy (s.y, m_Phase2.pubKey, 256);
-			memcpy (s.ident, i2p::context.GetRouterInfo ().GetIdentHash (), 32);
-			s.tsA = tsA;
-			s.tsB = m_Phase2.encrypted.timestamp;
-
-			CryptoPP::DSA::PublicKey pubKey;
-			pubKey.Initialize (dsap, dsaq, dsag, CryptoPP::Integer (m_RemoteRouterInfo.GetRouterIdentity ().signingKey, 128));
-			CryptoPP::DSA::Verifier verifier (pubKey);
-			if (!verifier.VerifyMessage ((uint8_t *)&s, sizeof(s), m_Phase4.signature, 40))
-			{	
-				LogPrint ("signature verification failed");
-				Terminate ();
-				return;
-			}	
-			Connected ();
-						
-			m_ReceiveBufferOffset = 0;
-			m_NextMessage = nullptr;
-			Receive ();
+			i2p::transports.GetCryptoService ().post (boost::bind (&NTCPSession::VerifyPhase4, shared_from_this (), tsA));
 		}
 	}
 
+	void NTCPSession::VerifyPhase4 (uint32_t tsA)
+	{
+		// verify signature
+		SignedData s;
+		memcpy (s.x, m_Phase1.pubKey, 256);
+		memcpy (s.y, m_Phase2.pubKey, 256);
+		memcpy (s.ident, i2p::context.GetRouterInfo ().GetIdentHash (), 32);
+		s.tsA = tsA;
+		s.tsB = m_Phase2.encrypted.timestamp;
+
+		CryptoPP::DSA::PublicKey pubKey;
+		pubKey.Initialize (dsap, dsaq, dsag, CryptoPP::Integer (m_RemoteRouterInfo.GetRouterIdentity ().signingKey, 128));
+		CryptoPP::DSA::Verifier verifier (pubKey);
+		bool isVerified = verifier.VerifyMessage ((uint8_t *)&s, sizeof(s), m_Phase4.signature, 40);
+		if (!isVerified)
+			LogPrint ("signature verification failed");
+		m_Strand.post (boost::bind (&NTCPSession::HandlePhase4Verified, shared_from_this (), isVerified));
+	}	
+
+	void NTCPSession::HandlePhase4Verified (bool isVerified)
+	{
+		if (!isVerified)
+		{	
+			Terminate ();
+			return;
+		}	
+		HandshakeFinished ();
+		Connected ();
+					
+		m_ReceiveBufferOffset = 0;
+		m_NextMessage = nullptr;
+		Receive ();
+	}
+
 	void NTCPSession::Receive ()
 	{
 		m_Socket.async_read_some (boost::asio::buffer(m_ReceiveBuffer + m_ReceiveBufferOffset, NTCP_MAX_MESSAGE_SIZE*2 -m_ReceiveBufferOffset),                
-			boost::bind(&NTCPSession::HandleReceived, this, 
-			boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+			m_Strand.wrap (boost::bind(&NTCPSession::HandleReceived, shared_from_this (), 
+			boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
 	}	
 		
 	void NTCPSession::HandleReceived (const boost::system::error_code& ecode, std::size_t bytes_transferred)
@@ -403,67 +488,175 @@ namespace ntcp
 		}
 		else
 		{
-			LogPrint ("Received: ", bytes_transferred);
+			i2p::transports.GetBandwidthLimiter ().GetInbound ().ForceConsume (bytes_transferred);
 			m_ReceiveBufferOffset += bytes_transferred;
-
-			if (m_ReceiveBufferOffset >= 16)
+			int numBlocks = m_ReceiveBufferOffset >> 4; // /16
+			if (numBlocks > 0)
 			{	
-				uint8_t * nextBlock = m_ReceiveBuffer;
-				while (m_ReceiveBufferOffset >= 16)
+				// decrypt everything we have in one call, then parse frames from plain text 
+				size_t len = numBlocks << 4;
+				m_Decryption.Decrypt (numBlocks, (const ChipherBlock *)m_ReceiveBuffer, (ChipherBlock *)m_ReceiveBuffer);
+				if (!HandleFrames (m_ReceiveBuffer, len))
 				{
-					DecryptNextBlock (nextBlock); // 16 bytes
-					nextBlock += 16;
-					m_ReceiveBufferOffset -= 16;
+					Terminate ();
+					return;
 				}	
-				if (m_ReceiveBufferOffset > 0)
-					memcpy (m_ReceiveBuffer, nextBlock, m_ReceiveBufferOffset);
+				m_ReceiveBufferOffset -= len;
+				if (m_ReceiveBufferOffset > 0) // incomplete block 
+					memmove (m_ReceiveBuffer, m_ReceiveBuffer + len, m_ReceiveBufferOffset);
 			}	
 			
 			ScheduleTermination (); // reset termination timer
-			Receive ();
+			ScheduleReceive ();
 		}	
 	}	
 
-	void NTCPSession::DecryptNextBlock (const uint8_t * encrypted) // 16 bytes
+	void NTCPSession::ScheduleReceive ()
+	{
+		int delay = i2p::transports.GetBandwidthLimiter ().GetInbound ().GetDelay ();
+		if (delay > 0)
+		{
+			// don't read from socket for a while, TCP slows the peer down
+			m_ReceiveTimer.expires_from_now (boost::posix_time::milliseconds (delay));
+			m_ReceiveTimer.async_wait (m_Strand.wrap (boost::bind (&NTCPSession::HandleReceiveTimer,
+				shared_from_this (), boost::asio::placeholders::error)));
+		}
+		else
+			Receive ();
+	}
+
+	void NTCPSession::HandleReceiveTimer (const boost::system::error_code& ecode)
 	{
-		if (!m_NextMessage) // new message, header expected
+		if (ecode != boost::asio::error::operation_aborted && !m_IsTerminated)
+			Receive ();
+	}
+
+	bool NTCPSession::HandleFrames (const uint8_t * buf, size_t len)
+	{
+		while (len > 0)
 		{	
-			m_NextMessage = i2p::NewI2NPMessage ();
-			m_NextMessageOffset = 0;
-			
-			m_Decryption.Decrypt (encrypted, m_NextMessage->buf);
-			uint16_t dataSize = be16toh (*(uint16_t *)m_NextMessage->buf);
-			if (dataSize)
-			{
-				// new message
-				m_NextMessageOffset += 16;
-				m_NextMessage->offset = 2; // size field
-				m_NextMessage->len = dataSize + 2; 
+			if (!m_NextMessage) // new frame, size expected
+			{	
+				uint16_t dataSize = be16toh (*(uint16_t *)buf);
+				if (!dataSize)
+				{
+					// timestamp, always one block 
+					if (!m_Adler.VerifyDigest (buf + 12, buf, 12))
+					{
+						LogPrint ("NTCP timestamp checksum mismatch");
+						return false;
+					}	
+					LogPrint ("Timestamp");	
+					buf += 16;
+					len -= 16;
+					continue;
+				}	
+				if (dataSize > NTCP_MAX_MESSAGE_SIZE)
+				{
+					LogPrint ("NTCP data size ", dataSize, " exceeds max size");
+					return false;
+				}	
+				m_NextMessage = i2p::NewI2NPMessage (dataSize); // from pool of right size
+				m_NextMessage->len = m_NextMessage->offset + dataSize; 
+				m_NextFrameSize = (dataSize + 6 + 15) & ~0x0F; // size, data, padding and checksum
+				m_NextMessageOffset = 0;
 			}	
-			else
+			// size field takes last 2 bytes of headroom, so whole frame is contiguous and message can be forwarded in place
+			uint8_t * frame = m_NextMessage->GetBuffer () - 2;
+			size_t l = m_NextFrameSize - m_NextMessageOffset;
+			if (l > len) l = len;
+			memcpy (frame + m_NextMessageOffset, buf, l);
+			m_NextMessageOffset += l;
+			buf += l;
+			len -= l;
+			
+			if (m_NextMessageOffset >= m_NextFrameSize)
 			{	
-				// timestamp
-				LogPrint ("Timestamp");	
-				i2p::DeleteI2NPMessage (m_NextMessage);
+				// we have a complete I2NP message
+				if (!m_Adler.VerifyDigest (frame + m_NextFrameSize - 4, frame, m_NextFrameSize - 4))
+				{
+					LogPrint ("NTCP frame checksum mismatch");
+					return false;
+				}	
+				if (!i2p::transports.IsReplayedMessage (m_NextMessage))
+					i2p::HandleI2NPMessage (m_NextMessage);	
+				else
+				{
+					LogPrint ("NTCP duplicate message ", be32toh (m_NextMessage->GetHeader ()->msgID), " dropped");
+					DeleteI2NPMessage (m_NextMessage);
+				}
 				m_NextMessage = nullptr;
-				return;
 			}	
-		}	
-		else // message continues
-		{	
-			m_Decryption.Decrypt (encrypted, m_NextMessage->buf + m_NextMessageOffset);
-			m_NextMessageOffset += 16;
-		}		
-		
-		if (m_NextMessageOffset >= m_NextMessage->len + 4) // +checksum
-		{	
-			// we have a complete I2NP message
-			i2p::HandleI2NPMessage (m_NextMessage);	
-			m_NextMessage = nullptr;
-		}	
+		}
+		return true;
  	}	
 
 	void NTCPSession::Send (i2p::I2NPMessage * msg)
+	{
+		if (msg)
+			m_SendQueue.Put (msg);
+		else
+			m_IsTimeSyncPending = true;
+		if (!m_IsSending)
+			SendQueue ();
+	}
+
+	void NTCPSession::SendQueue ()
+	{
+		auto& outbound = i2p::transports.GetBandwidthLimiter ().GetOutbound ();
+		int delay = outbound.GetDelay ();
+		if (delay > 0)
+		{
+			// wait for outbound bandwidth, messages are prioritized in queue meanwhile
+			m_IsSending = true;
+			m_SendTimer.expires_from_now (boost::posix_time::milliseconds (delay));
+			m_SendTimer.async_wait (m_Strand.wrap (boost::bind (&NTCPSession::HandleSendTimer,
+				shared_from_this (), boost::asio::placeholders::error)));
+			return;
+		}
+		// messages accumulated while previous write was in progress go to one gathered write
+		size_t maxBatchSize = i2p::transports.GetNTCPMaxBatchSize ();
+		std::vector<boost::asio::const_buffer> buffers;
+		std::vector<i2p::I2NPMessage *> msgs;
+		size_t numBytes = 0;
+		uint8_t * frame;
+		size_t len;
+		if (m_IsTimeSyncPending)
+		{
+			msgs.push_back (EncryptFrame (nullptr, frame, len));
+			buffers.push_back (boost::asio::buffer (frame, len));
+			numBytes += len;
+			m_IsTimeSyncPending = false;
+		}
+		while (msgs.empty () || numBytes < maxBatchSize)
+		{
+			auto msg = m_SendQueue.Get (); // next by priority
+			if (!msg) break;
+			msgs.push_back (EncryptFrame (msg, frame, len)); // CBC state continues from previous frame
+			buffers.push_back (boost::asio::buffer (frame, len));
+			numBytes += len;
+		}
+		if (msgs.empty ()) return;
+
+		m_IsSending = true;
+		m_NumWrites++;
+		m_NumSentBytes += numBytes;
+		outbound.ForceConsume (numBytes);
+		i2p::transports.UpdateNTCPSentStats (msgs.size (), numBytes);
+		boost::asio::async_write (m_Socket, buffers, boost::asio::transfer_all (),                      
+        	m_Strand.wrap (boost::bind(&NTCPSession::HandleSent, shared_from_this (), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, msgs)));	
+	}
+
+	void NTCPSession::HandleSendTimer (const boost::system::error_code& ecode)
+	{
+		if (ecode != boost::asio::error::operation_aborted && !m_IsTerminated)
+		{
+			m_IsSending = false;
+			SendQueue ();
+		}
+	}
+
+	i2p::I2NPMessage * NTCPSession::EncryptFrame (i2p::I2NPMessage * msg, uint8_t *& frame, size_t& frameLen)
 	{
 		uint8_t * sendBuffer;
 		int len;
@@ -471,11 +664,9 @@ namespace ntcp
 		if (msg)
 		{	
 			// regular I2NP
-			if (msg->offset < 2)
-			{
-				LogPrint ("Malformed I2NP message");
-				i2p::DeleteI2NPMessage (msg);
-			}	
+			if (msg->IsShared () || msg->GetHeadroom () < 2 || msg->GetTailroom () < 15 + 4) // size, padding and checksum
+				// the same buffer is sent by other sessions or it has no room for framing, encrypt it to our own one
+				return EncryptFrameCopy (msg, frame, frameLen);
 			sendBuffer = msg->GetBuffer () - 2; 
 			len = msg->GetLength ();
 			*((uint16_t *)sendBuffer) = htobe16 (len);
@@ -483,7 +674,8 @@ namespace ntcp
 		else
 		{
 			// prepare timestamp
-			sendBuffer = m_TimeSyncBuffer;
+			msg = i2p::NewI2NPShortMessage ();
+			sendBuffer = msg->buf;
 			len = 4;
 			*((uint16_t *)sendBuffer) = 0;
 			*((uint32_t *)(sendBuffer + 2)) = htobe32 (time (0));
@@ -497,25 +689,63 @@ namespace ntcp
 		int l = len + padding + 6;
 		m_Encryption.Encrypt(sendBuffer, l, sendBuffer);	
 
-		boost::asio::async_write (m_Socket, boost::asio::buffer (sendBuffer, l), boost::asio::transfer_all (),                      
-        	boost::bind(&NTCPSession::HandleSent, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred, msg));	
+		frame = sendBuffer;
+		frameLen = l;
+		return msg;
 	}
 		
-	void NTCPSession::HandleSent (const boost::system::error_code& ecode, std::size_t bytes_transferred, i2p::I2NPMessage * msg)
+	i2p::I2NPMessage * NTCPSession::EncryptFrameCopy (i2p::I2NPMessage * msg, uint8_t *& frame, size_t& frameLen)
+	{
+		const uint8_t * data = msg->GetBuffer ();
+		int len = msg->GetLength (); // always >= 16 
+		int rem = (len + 6) & 0x0F; // %16
+		int padding = 0;
+		if (rem > 0) padding = 16 - rem;
+		int l = len + padding + 6;
+		// first block contains size, last blocks contain padding and checksum,
+		// blocks in between are encrypted directly from message's buffer
+		uint8_t firstBlock[16], lastBlocks[48];
+		*((uint16_t *)firstBlock) = htobe16 (len);
+		memcpy (firstBlock + 2, data, 14);
+		int middleLen = ((len - 14) >> 4) << 4;
+		int lastLen = l - 16 - middleLen;
+		int rest = len - 14 - middleLen;
+		memcpy (lastBlocks, data + 14 + middleLen, rest);
+		memset (lastBlocks + rest, 0, padding);
+		m_Adler.Update (firstBlock, 16);
+		m_Adler.Update (data + 14, middleLen);
+		m_Adler.Update (lastBlocks, rest + padding);
+		m_Adler.Final (lastBlocks + rest + padding);
+
+		i2p::I2NPMessage * encrypted = i2p::NewI2NPMessage (len);
+		uint8_t * sendBuffer = encrypted->buf;
+		m_Encryption.Encrypt (firstBlock, 16, sendBuffer);
+		if (middleLen > 0)
+			m_Encryption.Encrypt (data + 14, middleLen, sendBuffer + 16);
+		m_Encryption.Encrypt (lastBlocks, lastLen, sendBuffer + 16 + middleLen);
+		i2p::DeleteI2NPMessage (msg); // original message is not needed anymore
+
+		frame = sendBuffer;
+		frameLen = l;
+		return encrypted;
+	}
+
+	void NTCPSession::HandleSent (const boost::system::error_code& ecode, std::size_t bytes_transferred, std::vector<i2p::I2NPMessage *> msgs)
 	{		
-		if (msg)
-			i2p::DeleteI2NPMessage (msg);
+		m_IsSending = false;
+		for (auto it: msgs)
+			i2p::DeleteI2NPMessage (it);
 		if (ecode)
         {
-			LogPrint ("Couldn't send msg: ", ecode.message ());
-			// we shouldn't call Terminate () here, because HandleReceive takes care
-			// TODO: 'delete this' statement in Terminate () must be eliminated later
-			// Terminate ();
+			LogPrint ("Couldn't send msgs: ", ecode.message ());
+			Terminate ();
 		}
 		else
 		{	
-			LogPrint ("Msg sent: ", bytes_transferred);
+			LogPrint ("Msgs sent: ", msgs.size (), " ", bytes_transferred, " bytes");
 			ScheduleTermination (); // reset termination timer
+			if (!m_SendQueue.IsEmpty ())
+				SendQueue ();
 		}	
 	}
 
@@ -527,11 +757,19 @@ namespace ntcp
 	void NTCPSession::SendI2NPMessage (I2NPMessage * msg)
 	{
 		if (msg)
+			m_Strand.post (boost::bind (&NTCPSession::PostI2NPMessage, shared_from_this (), msg));
+	}	
+
+	void NTCPSession::PostI2NPMessage (I2NPMessage * msg)
+	{
+		if (m_IsTerminated)
+			i2p::transports.SendMessage (m_RemoteRouterInfo.GetIdentHash (), msg); // try another session
+		else
 		{
 			if (m_IsEstablished)
 				Send (msg);
 			else
-				m_DelayedMessages.push_back (msg);	
+				m_SendQueue.Put (msg); // sent when connected
 		}	
 	}	
 
@@ -539,8 +777,8 @@ namespace ntcp
 	{
 		m_TerminationTimer.cancel ();
 		m_TerminationTimer.expires_from_now (boost::posix_time::seconds(NTCP_TERMINATION_TIMEOUT));
-		m_TerminationTimer.async_wait (boost::bind (&NTCPSession::HandleTerminationTimer,
-			this, boost::asio::placeholders::error));
+		m_TerminationTimer.async_wait (m_Strand.wrap (boost::bind (&NTCPSession::HandleTerminationTimer,
+			shared_from_this (), boost::asio::placeholders::error)));
 	}
 
 	void NTCPSession::HandleTerminationTimer (const boost::system::error_code& ecode)
@@ -551,6 +789,22 @@ namespace ntcp
 			m_Socket.close ();
 		}	
 	}	
+
+	void NTCPSession::ScheduleEstablishTimeout ()
+	{
+		m_TerminationTimer.expires_from_now (boost::posix_time::seconds(NTCP_ESTABLISH_TIMEOUT));
+		m_TerminationTimer.async_wait (m_Strand.wrap (boost::bind (&NTCPSession::HandleEstablishTimer,
+			shared_from_this (), boost::asio::placeholders::error)));
+	}
+
+	void NTCPSession::HandleEstablishTimer (const boost::system::error_code& ecode)
+	{
+		if (ecode != boost::asio::error::operation_aborted && m_IsHandshaking)
+		{
+			LogPrint ("NTCP handshake was not finished after ", NTCP_ESTABLISH_TIMEOUT, " seconds");
+			Terminate (); // releases handshake
+		}	
+	}	
 		
 		
 	NTCPClient::NTCPClient (boost::asio::io_service& service, const boost::asio::ip::address& address, 
@@ -558,14 +812,13 @@ namespace ntcp
 		NTCPSession (service, in_RouterInfo),
 		m_Endpoint (address, port)	
 	{
-		Connect ();
 	}
 
 	void NTCPClient::Connect ()
 	{
 		LogPrint ("Connecting to ", m_Endpoint.address ().to_string (),":",  m_Endpoint.port ());
-		 GetSocket ().async_connect (m_Endpoint, boost::bind (&NTCPClient::HandleConnect,
-			this, boost::asio::placeholders::error));
+		 GetSocket ().async_connect (m_Endpoint, GetStrand ().wrap (boost::bind (&NTCPClient::HandleConnect,
+			std::static_pointer_cast<NTCPClient>(shared_from_this ()), boost::asio::placeholders::error)));
 	}	
 
 	void NTCPClient::HandleConnect (const boost::system::error_code& ecode)
@@ -587,7 +840,7 @@ namespace ntcp
 	{
 		LogPrint ("NTCP server session connected");
 		SetIsEstablished (true);
-		i2p::transports.AddNTCPSession (this);
+		i2p::transports.AddNTCPSession (shared_from_this ());
 
 		SendTimeSyncMessage ();
 		SendI2NPMessage (CreateDatabaseStoreMsg ()); // we tell immediately who we are		
@@ -3,6 +3,9 @@
 
 #include <inttypes.h>
 #include <list>
+#include <vector>
+#include <memory>
+#include <atomic>
 #include <boost/asio.hpp>
 #include <cryptopp/modes.h>
 #include <cryptopp/aes.h>
@@ -11,6 +14,7 @@
 #include "Identity.h"
 #include "RouterInfo.h"
 #include "I2NPProtocol.h"
+#include "OutboundQueue.h"
 
 namespace i2p
 {
@@ -64,7 +68,11 @@ namespace ntcp
 
 	const size_t NTCP_MAX_MESSAGE_SIZE = 16384; 
 	const int NTCP_TERMINATION_TIMEOUT = 120; // 2 minutes
-	class NTCPSession
+	const int NTCP_ESTABLISH_TIMEOUT = 10; // 10 seconds, handshake holds a slot till then
+	const size_t NTCP_MAX_BATCH_SIZE = 65536; // bytes in one gathered write, first message always goes
+	// all handlers of a session are invoked through its strand, 
+	// so session's state is accessed by one thread at the time
+	class NTCPSession: public std::enable_shared_from_this<NTCPSession>
 	{
 		public:
 
@@ -75,9 +83,12 @@ namespace ntcp
 			bool IsEstablished () const { return m_IsEstablished; };
 			i2p::data::RouterInfo& GetRemoteRouterInfo () { return m_RemoteRouterInfo; };
 			
+			uint64_t GetNumWrites () const { return m_NumWrites; };
+			uint64_t GetNumSentBytes () const { return m_NumSentBytes; };
+
 			void ClientLogin ();
 			void ServerLogin ();
-			void SendI2NPMessage (I2NPMessage * msg);
+			void SendI2NPMessage (I2NPMessage * msg); // can be called from any thread
 			
 		protected:
 
@@ -85,21 +96,32 @@ namespace ntcp
 			virtual void Connected ();
 			void SendTimeSyncMessage ();
 			void SetIsEstablished (bool isEstablished) { m_IsEstablished = isEstablished; }
+			boost::asio::io_service::strand& GetStrand () { return m_Strand; };
 			
 		private:
 
-			void CreateAESKey (uint8_t * pubKey, uint8_t * aesKey);
+			bool CreateAESKey (uint8_t * pubKey, uint8_t * aesKey);
+			void HandshakeFinished ();
 				
+			// DH and DSA run in transports' crypto threads, then continue in strand
+
 			// client
-			void SendPhase3 ();
+			void HandlePhase2 (); // crypto
+			void CreatePhase3 (); // crypto
+			void SendPhase3 (bool isCreated, uint32_t tsA);
+			void VerifyPhase4 (uint32_t tsA); // crypto
+			void HandlePhase4Verified (bool isVerified);
 			void HandlePhase1Sent (const boost::system::error_code& ecode,  std::size_t bytes_transferred);
 			void HandlePhase2Received (const boost::system::error_code& ecode, std::size_t bytes_transferred);
 			void HandlePhase3Sent (const boost::system::error_code& ecode, std::size_t bytes_transferred, uint32_t tsA);
 			void HandlePhase4Received (const boost::system::error_code& ecode, std::size_t bytes_transferred, uint32_t tsA);
 
 			//server
-			void SendPhase2 ();
-			void SendPhase4 (uint32_t tsB);
+			void CreatePhase2 (); // crypto
+			void SendPhase2 (bool isCreated, uint32_t tsB);
+			void VerifyPhase3 (uint32_t tsB); // crypto
+			void CreatePhase4 (uint32_t tsB); // crypto
+			void SendPhase4 (bool isVerified);
 			void HandlePhase1Received (const boost::system::error_code& ecode, std::size_t bytes_transferred);
 			void HandlePhase2Sent (const boost::system::error_code& ecode, std::size_t bytes_transferred, uint32_t tsB);
 			void HandlePhase3Received (const boost::system::error_code& ecode, std::size_t bytes_transferred, uint32_t tsB);
@@ -108,21 +130,33 @@ namespace ntcp
 			// common
 			void Receive ();
 			void HandleReceived (const boost::system::error_code& ecode, std::size_t bytes_transferred);
-			void DecryptNextBlock (const uint8_t * encrypted);	
+			void ScheduleReceive (); // when inbound bandwidth is available
+			void HandleReceiveTimer (const boost::system::error_code& ecode);
+			bool HandleFrames (const uint8_t * buf, size_t len); // decrypted blocks, false if corrupted
 		
-			void Send (i2p::I2NPMessage * msg);
-			void HandleSent (const boost::system::error_code& ecode, std::size_t bytes_transferred, i2p::I2NPMessage * msg);
+			void PostI2NPMessage (I2NPMessage * msg);
+			void Send (i2p::I2NPMessage * msg); // nullptr means timestamp
+			void SendQueue ();
+			void HandleSendTimer (const boost::system::error_code& ecode);
+			// return message holding encrypted frame
+			i2p::I2NPMessage * EncryptFrame (i2p::I2NPMessage * msg, uint8_t *& frame, size_t& frameLen);
+			i2p::I2NPMessage * EncryptFrameCopy (i2p::I2NPMessage * msg, uint8_t *& frame, size_t& frameLen); // for shared messages or without room for framing
+			void HandleSent (const boost::system::error_code& ecode, std::size_t bytes_transferred, std::vector<i2p::I2NPMessage *> msgs);
 
 
 			// timer
 			void ScheduleTermination ();
 			void HandleTerminationTimer (const boost::system::error_code& ecode);
+			void ScheduleEstablishTimeout ();
+			void HandleEstablishTimer (const boost::system::error_code& ecode);
 			
 		private:
 
 			boost::asio::ip::tcp::socket m_Socket;
-			boost::asio::deadline_timer m_TerminationTimer;
-			bool m_IsEstablished;
+			boost::asio::io_service::strand m_Strand;
+			boost::asio::deadline_timer m_TerminationTimer, m_ReceiveTimer, m_SendTimer;
+			std::atomic<bool> m_IsEstablished;
+			bool m_IsTerminated, m_IsHandshaking;
 			i2p::data::DHKeysPair * m_DHKeysPair; // X - for client and Y - for server
 			
 			i2p::crypto::CBCDecryption m_Decryption;
@@ -136,12 +170,15 @@ namespace ntcp
 			NTCPPhase3 m_Phase3;
 			NTCPPhase4 m_Phase4;
 			
-			uint8_t m_ReceiveBuffer[NTCP_MAX_MESSAGE_SIZE*2], m_TimeSyncBuffer[16];
+			uint8_t m_ReceiveBuffer[NTCP_MAX_MESSAGE_SIZE*2];
 			int m_ReceiveBufferOffset; 
 
 			i2p::I2NPMessage * m_NextMessage;
-			std::list<i2p::I2NPMessage *> m_DelayedMessages;
-			size_t m_NextMessageOffset;
+			size_t m_NextMessageOffset, m_NextFrameSize; // bytes of frame received and expected
+
+			i2p::OutboundQueue m_SendQueue; // waiting for connection or current write to complete
+			bool m_IsSending, m_IsTimeSyncPending; // sending includes waiting for bandwidth
+			std::atomic<uint64_t> m_NumWrites, m_NumSentBytes;
 	};	
 
 	class NTCPClient: public NTCPSession
@@ -149,10 +186,10 @@ namespace ntcp
 		public:
 
 			NTCPClient (boost::asio::io_service& service, const boost::asio::ip::address& address, int port, i2p::data::RouterInfo& in_RouterInfo);
+			void Connect (); // must be owned by shared_ptr
 
 		private:
 
-			void Connect ();
 			void HandleConnect (const boost::system::error_code& ecode);
 			
 		private:
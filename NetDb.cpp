@@ -54,8 +54,10 @@ namespace data
 #endif			
 	NetDb netdb;
 
-	NetDb::NetDb (): m_IsRunning (false), m_ReseedRetries (0), m_Thread (0)
+	NetDb::NetDb (): m_IsRunning (false), m_ReseedRetries (0), m_Thread (0), m_Queue ("netdb")
 	{
+		m_Queue.SetCapacity (NETDB_QUEUE_CAPACITY);
+		m_Queue.SetDropper (i2p::DeleteI2NPMessage);
 	}
 	
 	NetDb::~NetDb ()
@@ -96,15 +98,16 @@ namespace data
 	void NetDb::Run ()
 	{
 		uint32_t lastSave = 0, lastPublish = 0, lastKeyspaceRotation = 0;
+		std::vector<I2NPMessage *> msgs;
 		m_IsRunning = true;
 		while (m_IsRunning)
 		{	
 			try
 			{	
-				I2NPMessage * msg = m_Queue.GetNextWithTimeout (10000); // 10 sec
-				if (msg)
+				msgs.clear ();
+				if (m_Queue.GetAllWithTimeout (msgs, 10000)) // 10 sec
 				{	
-					while (msg)
+					for (auto msg: msgs)
 					{
 						if (msg->GetHeader ()->typeID == eI2NPDatabaseStore)
 						{	
@@ -118,7 +121,6 @@ namespace data
 							LogPrint ("NetDb: unexpected message type ", msg->GetHeader ()->typeID);
 							i2p::HandleI2NPMessage (msg);
 						}	
-						msg = m_Queue.Get ();
 					}	
 				}
 				else // if no new DatabaseStore coming, explore it
@@ -608,16 +610,18 @@ namespace data
 	void NetDb::Publish ()
 	{
 		std::set<IdentHash> excluded; // TODO: fill up later
+		I2NPMessage * msg = CreateDatabaseStoreMsg (); // the same message for all floodfills
 		for (int i = 0; i < 3; i++)
 		{	
 			auto floodfill = GetClosestFloodfill (i2p::context.GetRouterInfo ().GetIdentHash (), excluded);
 			if (floodfill)
 			{
 				LogPrint ("Publishing our RouterInfo to ", floodfill->GetIdentHashAbbreviation ());
-				transports.SendMessage (floodfill->GetIdentHash (), CreateDatabaseStoreMsg ());	
+				transports.SendMessage (floodfill->GetIdentHash (), ShareI2NPMessage (msg));	
 				excluded.insert (floodfill->GetIdentHash ());
 			}
 		}	
+		DeleteI2NPMessage (msg);
 	}	
 	
 	RequestedDestination * NetDb::CreateRequestedDestination (const IdentHash& dest,
@@ -677,9 +681,9 @@ namespace data
 		return nullptr; // seems we have too few routers
 	}	
 
-	void NetDb::PostI2NPMsg (I2NPMessage * msg)
+	void NetDb::PostI2NPMsg (I2NPMessage * msg, bool isTransit)
 	{
-		if (msg) m_Queue.Put (msg);	
+		if (msg) m_Queue.Put (msg, isTransit ? i2p::util::eQueueClassTransit : i2p::util::eQueueClassLocal);	
 	}	
 
 	const RouterInfo * NetDb::GetClosestFloodfill (const IdentHash& destination, 
@@ -19,6 +19,8 @@ namespace i2p
 {
 namespace data
 {		
+	const int NETDB_QUEUE_CAPACITY = 4096; // messages
+
 	class RequestedDestination
 	{
 		public:
@@ -73,7 +75,8 @@ namespace data
 			
 			const RouterInfo * GetRandomRouter (const RouterInfo * compatibleWith = nullptr) const;
 
-			void PostI2NPMsg (I2NPMessage * msg);
+			void PostI2NPMsg (I2NPMessage * msg, bool isTransit = false);
+			void SetQueueCapacity (size_t capacity) { m_Queue.SetCapacity (capacity); };
 
 			// for web interface
 			int GetNumRouters () const { return m_RouterInfos.size (); };
@@ -0,0 +1,174 @@
+#include <atomic>
+#include "I2PEndian.h"
+#include "Log.h"
+#include "Timestamp.h"
+#include "OutboundQueue.h"
+
+namespace i2p
+{
+	struct OutboundQueueCounters
+	{
+		std::atomic<uint64_t> numSent, numSentBytes, numExpired, numDropped;
+		std::atomic<int64_t> numQueued, numQueuedBytes;
+	};
+	static OutboundQueueCounters outboundQueueCounters[NUM_OUTBOUND_CLASSES];
+
+	OutboundClass GetOutboundClass (const I2NPMessage * msg)
+	{
+		switch (((const I2NPHeader *)msg->GetBuffer ())->typeID)
+		{
+			case eI2NPTunnelBuild:
+			case eI2NPTunnelBuildReply:
+			case eI2NPVariableTunnelBuild:
+			case eI2NPVariableTunnelBuildReply:
+				return eOutboundClassTunnelBuild;
+			case eI2NPDatabaseStore:
+			case eI2NPDatabaseLookup:
+			case eI2NPDatabaseSearchReply:
+				return eOutboundClassNetDb;
+			default:
+				return msg->isTransit ? eOutboundClassTransit : eOutboundClassClient;
+		}
+	}
+
+	const char * GetOutboundClassName (int cls)
+	{
+		static const char * names[NUM_OUTBOUND_CLASSES] = { "tunnelbuild", "client", "transit", "netdb" };
+		return names[cls];
+	}
+
+	OutboundQueueStats GetOutboundQueueStats (int cls)
+	{
+		auto& counters = outboundQueueCounters[cls];
+		OutboundQueueStats stats;
+		stats.numSent = counters.numSent;
+		stats.numSentBytes = counters.numSentBytes;
+		stats.numExpired = counters.numExpired;
+		stats.numDropped = counters.numDropped;
+		stats.numQueued = counters.numQueued;
+		stats.numQueuedBytes = counters.numQueuedBytes;
+		return stats;
+	}
+
+	OutboundQueue::OutboundQueue (size_t maxSize):
+		m_MaxSize (maxSize), m_Size (0), m_NumMessages (0), m_CurrentClass (0)
+	{
+		for (int i = 0; i < NUM_OUTBOUND_CLASSES; i++)
+			m_Deficits[i] = 0;
+		m_Deficits[m_CurrentClass] = OUTBOUND_QUEUE_QUANTUMS[m_CurrentClass];
+	}
+
+	OutboundQueue::~OutboundQueue ()
+	{
+		Clear ();
+	}
+
+	bool OutboundQueue::Put (I2NPMessage * msg)
+	{
+		int cls = GetOutboundClass (msg);
+		auto& counters = outboundQueueCounters[cls];
+		size_t len = msg->GetLength ();
+		if (be64toh (msg->GetHeader ()->expiration) < i2p::util::GetMillisecondsSinceEpoch ())
+		{
+			LogPrint ("Outbound message ", be32toh (msg->GetHeader ()->msgID), " expired");
+			counters.numExpired++;
+			DeleteI2NPMessage (msg);
+			return false;
+		}
+		if (m_Size + len > m_MaxSize && !MakeRoom (len, cls))
+		{
+			LogPrint ("Outbound queue is full. Message ", be32toh (msg->GetHeader ()->msgID), " dropped");
+			counters.numDropped++;
+			DeleteI2NPMessage (msg);
+			return false;
+		}
+		m_Queues[cls].push_back (msg);
+		m_Size += len;
+		m_NumMessages++;
+		counters.numQueued++;
+		counters.numQueuedBytes += len;
+		return true;
+	}
+
+	I2NPMessage * OutboundQueue::Get ()
+	{
+		uint64_t ts = i2p::util::GetMillisecondsSinceEpoch ();
+		while (m_NumMessages > 0)
+		{
+			auto& queue = m_Queues[m_CurrentClass];
+			DropExpired (m_CurrentClass, ts);
+			if (!queue.empty ())
+			{
+				auto msg = queue.front ();
+				size_t len = msg->GetLength ();
+				if (m_Deficits[m_CurrentClass] >= len)
+				{
+					m_Deficits[m_CurrentClass] -= len;
+					Pop (m_CurrentClass);
+					auto& counters = outboundQueueCounters[m_CurrentClass];
+					counters.numSent++;
+					counters.numSentBytes += len;
+					return msg;
+				}
+			}
+			else
+				m_Deficits[m_CurrentClass] = 0; // idle class doesn't save credit
+			// next class' turn
+			m_CurrentClass = (m_CurrentClass + 1) % NUM_OUTBOUND_CLASSES;
+			m_Deficits[m_CurrentClass] += OUTBOUND_QUEUE_QUANTUMS[m_CurrentClass];
+		}
+		return nullptr;
+	}
+
+	void OutboundQueue::Clear ()
+	{
+		for (int i = 0; i < NUM_OUTBOUND_CLASSES; i++)
+			while (!m_Queues[i].empty ())
+				Drop (i, false);
+	}
+
+	void OutboundQueue::Pop (int cls)
+	{
+		size_t len = m_Queues[cls].front ()->GetLength ();
+		m_Queues[cls].pop_front ();
+		m_Size -= len;
+		m_NumMessages--;
+		auto& counters = outboundQueueCounters[cls];
+		counters.numQueued--;
+		counters.numQueuedBytes -= len;
+	}
+
+	void OutboundQueue::Drop (int cls, bool isExpired)
+	{
+		auto msg = m_Queues[cls].front ();
+		Pop (cls);
+		if (isExpired)
+			outboundQueueCounters[cls].numExpired++;
+		else
+			outboundQueueCounters[cls].numDropped++;
+		DeleteI2NPMessage (msg);
+	}
+
+	void OutboundQueue::DropExpired (int cls, uint64_t ts)
+	{
+		auto& queue = m_Queues[cls];
+		while (!queue.empty () && be64toh (queue.front ()->GetHeader ()->expiration) < ts)
+		{
+			LogPrint ("Outbound message ", be32toh (queue.front ()->GetHeader ()->msgID), " expired in queue");
+			Drop (cls, true);
+		}
+	}
+
+	bool OutboundQueue::MakeRoom (size_t len, int cls)
+	{
+		if (len > m_MaxSize) return false;
+		uint64_t ts = i2p::util::GetMillisecondsSinceEpoch ();
+		for (int i = 0; i < NUM_OUTBOUND_CLASSES; i++)
+			DropExpired (i, ts);
+		// oldest messages of lowest priority go first
+		for (int i = NUM_OUTBOUND_CLASSES - 1; i >= cls && m_Size + len > m_MaxSize; i--)
+			while (!m_Queues[i].empty () && m_Size + len > m_MaxSize)
+				Drop (i, false);
+		return m_Size + len <= m_MaxSize;
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef OUTBOUND_QUEUE_H__
+#define OUTBOUND_QUEUE_H__
+
+#include <inttypes.h>
+#include <deque>
+#include "I2NPProtocol.h"
+
+namespace i2p
+{
+	// classes of outbound messages in order of priority
+	enum OutboundClass
+	{
+		eOutboundClassTunnelBuild = 0, // tunnel build requests and replies
+		eOutboundClassClient, // our own tunnels and router
+		eOutboundClassTransit, // participating tunnels
+		eOutboundClassNetDb, // database stores, lookups and replies
+		NUM_OUTBOUND_CLASSES
+	};
+
+	const size_t OUTBOUND_QUEUE_QUANTUMS[NUM_OUTBOUND_CLASSES] = { 8192, 8192, 4096, 2048 }; // bytes per round
+	const size_t OUTBOUND_QUEUE_MAX_SIZE = 256*1024; // in bytes per peer
+
+	struct OutboundQueueStats
+	{
+		uint64_t numSent, numSentBytes;
+		uint64_t numExpired, numDropped; // expired in queue and dropped over limit
+		int64_t numQueued, numQueuedBytes; // currently waiting in all peers' queues
+	};
+
+	OutboundClass GetOutboundClass (const I2NPMessage * msg);
+	const char * GetOutboundClassName (int cls);
+	OutboundQueueStats GetOutboundQueueStats (int cls); // router-wide
+
+	// Per-peer queue of messages waiting for transport. Classes share the link by deficit round robin,
+	// expired messages are dropped. Not thread-safe, owned by session
+	class OutboundQueue
+	{
+		public:
+
+			OutboundQueue (size_t maxSize = OUTBOUND_QUEUE_MAX_SIZE);
+			~OutboundQueue (); // deletes messages left
+
+			bool Put (I2NPMessage * msg); // false if message has been dropped
+			I2NPMessage * Get (); // nullptr if empty
+			void Clear (); // drops all
+
+			bool IsEmpty () const { return !m_NumMessages; };
+			size_t GetNumMessages () const { return m_NumMessages; };
+			size_t GetSize () const { return m_Size; }; // in bytes
+
+		private:
+
+			void Pop (int cls);
+			void Drop (int cls, bool isExpired); // front message
+			void DropExpired (int cls, uint64_t ts);
+			bool MakeRoom (size_t len, int cls); // drops messages of same or lower priority
+
+		private:
+
+			size_t m_MaxSize, m_Size, m_NumMessages;
+			std::deque<I2NPMessage *> m_Queues[NUM_OUTBOUND_CLASSES];
+			size_t m_Deficits[NUM_OUTBOUND_CLASSES];
+			int m_CurrentClass;
+	};
+}
+
+#endif
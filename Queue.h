@@ -1,103 +1,403 @@
 #ifndef QUEUE_H__
 #define QUEUE_H__
 
-#include <queue>
+#include <vector>
+#include <list>
+#include <string>
+#include <atomic>
 #include <mutex>
 #include <thread>
 #include <condition_variable>
 #include <functional>
+#include <chrono>
 
 namespace i2p
 {
 namespace util
 {
+	enum QueueClass
+	{
+		eQueueClassLocal = 0, // never dropped while congested
+		eQueueClassTransit,
+		eNumQueueClasses
+	};	
+	
+	// CoDel-like congestion detection, in microseconds
+	const uint64_t QUEUE_CODEL_TARGET = 20000; // 20 ms
+	const uint64_t QUEUE_CODEL_INTERVAL = 200000; // 200 ms
+	
+	const int QUEUE_SOJOURN_HISTOGRAM_SIZE = 24; // bucket i counts sojourns up to 2^i microseconds
+
+	struct QueueStats
+	{
+		std::string name;
+		size_t depth, maxDepth;
+		uint64_t numProcessed;
+		uint64_t numDropped[eNumQueueClasses];
+		uint64_t sojournHistogram[QUEUE_SOJOURN_HISTOGRAM_SIZE]; // last bucket counts everything above
+		uint64_t totalSojourn; // in microseconds
+	};	
+
+	// counters of a queue, named queues are listed by GetAllQueuesStats
+	class QueueBase
+	{
+		public:
+
+			QueueBase (const std::string& name): m_Name (name), m_Size (0), m_MaxSize (0), m_NumProcessed (0),
+				m_TotalSojourn (0)
+			{
+				for (int i = 0; i < eNumQueueClasses; i++)
+					m_NumDropped[i] = 0;
+				for (int i = 0; i < QUEUE_SOJOURN_HISTOGRAM_SIZE; i++)
+					m_SojournHistogram[i] = 0;
+				if (!m_Name.empty ())
+				{
+					std::unique_lock<std::mutex> l(GetRegistryMutex ());
+					GetRegistry ().push_back (this);
+				}	
+			}
+			virtual ~QueueBase ()
+			{
+				if (!m_Name.empty ())
+				{
+					std::unique_lock<std::mutex> l(GetRegistryMutex ());
+					GetRegistry ().remove (this);
+				}	
+			}
+
+			const std::string& GetName () const { return m_Name; };
+			size_t GetSize () const { return m_Size; };
+			uint64_t GetNumDropped (QueueClass cls) const { return m_NumDropped[cls]; };
+			
+			void GetStats (QueueStats& stats) const
+			{
+				stats.name = m_Name;
+				stats.depth = m_Size;
+				stats.maxDepth = m_MaxSize;
+				stats.numProcessed = m_NumProcessed;
+				for (int i = 0; i < eNumQueueClasses; i++)
+					stats.numDropped[i] = m_NumDropped[i];
+				for (int i = 0; i < QUEUE_SOJOURN_HISTOGRAM_SIZE; i++)
+					stats.sojournHistogram[i] = m_SojournHistogram[i];
+				stats.totalSojourn = m_TotalSojourn;
+			}	
+
+			static void GetAllQueuesStats (std::vector<QueueStats>& stats)
+			{
+				std::unique_lock<std::mutex> l(GetRegistryMutex ());
+				for (auto it: GetRegistry ())
+				{
+					stats.push_back (QueueStats ());
+					it->GetStats (stats.back ());
+				}	
+			}	
+
+		protected:
+
+			void Enqueued ()
+			{
+				size_t size = ++m_Size;
+				size_t maxSize = m_MaxSize.load (std::memory_order_relaxed);
+				while (size > maxSize && !m_MaxSize.compare_exchange_weak (maxSize, size))
+					;
+			}	
+
+			// called from consumer's thread only
+			void Processed (uint64_t sojourn)
+			{
+				m_Size--;
+				int i = 0;
+				while (i < QUEUE_SOJOURN_HISTOGRAM_SIZE - 1 && (1ULL << i) < sojourn) i++;
+				m_SojournHistogram[i].store (m_SojournHistogram[i].load (std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				m_TotalSojourn.store (m_TotalSojourn.load (std::memory_order_relaxed) + sojourn, std::memory_order_relaxed);
+				m_NumProcessed.store (m_NumProcessed.load (std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			}	
+
+			void Dropped (QueueClass cls, bool isQueued)
+			{
+				if (isQueued) m_Size--;
+				m_NumDropped[cls]++;
+			}	
+
+		private:
+
+			// never destroyed, because queues might be deleted during static destruction
+			static std::list<QueueBase *>& GetRegistry ()
+			{
+				static std::list<QueueBase *> * registry = new std::list<QueueBase *>;
+				return *registry;
+			}	
+
+			static std::mutex& GetRegistryMutex ()
+			{
+				static std::mutex * registryMutex = new std::mutex;
+				return *registryMutex;
+			}	
+			
+		private:
+
+			std::string m_Name;
+			std::atomic<size_t> m_Size, m_MaxSize;
+			std::atomic<uint64_t> m_NumProcessed;
+			std::atomic<uint64_t> m_NumDropped[eNumQueueClasses];
+			std::atomic<uint64_t> m_SojournHistogram[QUEUE_SOJOURN_HISTOGRAM_SIZE];
+			std::atomic<uint64_t> m_TotalSojourn;
+	};	
+	
+	// lock-free multiple producers, single consumer
+	// producers push to a stack, consumer takes the whole stack at once and reverses it
+	// methods other than Put and WakeUp must be called from consumer's thread only
+	// if sojourn time stays above target for an interval, transit elements are dropped at dequeue
 	template<typename Element>
-	class Queue
+	class Queue: public QueueBase
 	{	
+		struct Node
+		{
+			Element * el;
+			Node * next;
+			uint64_t ts; // enqueue time
+			QueueClass cls;
+		};
+
 		public:
 
-			void Put (Element * e)
+			typedef std::function<bool (Element *)> Classifier; // true for transit, called by consumer and by Put at capacity
+			typedef std::function<void (Element *)> Dropper;
+			
+			Queue (const std::string& name = ""): QueueBase (name), 
+				m_Head (nullptr), m_Pending (nullptr), m_IsWaiting (false), m_IsWoken (false), 
+				m_Capacity (0), m_FirstAboveTime (0), m_IsCongested (false) {};
+			~Queue ()
 			{
-				std::unique_lock<std::mutex>  l(m_QueueMutex);
-				m_Queue.push (e);	
-				m_NonEmpty.notify_one ();
+				DeleteNodes (m_Head.exchange (nullptr));
+				DeleteNodes (m_Pending);
+			}
+
+			// capacity is enforced only if dropper is set, local elements may take twice as much
+			void SetCapacity (size_t capacity) { m_Capacity = capacity; };
+			void SetDropper (Dropper dropper) { m_Dropper = dropper; };
+			void SetClassifier (Classifier classifier) { m_Classifier = classifier; };
+			
+			bool Put (Element * e, QueueClass cls = eQueueClassLocal)
+			{
+				if (m_Capacity && m_Dropper && GetSize () >= m_Capacity)
+				{
+					// producer might not know the class, classifier decides before anything is dropped
+					if (cls != eQueueClassLocal && m_Classifier && !m_Classifier (e))
+						cls = eQueueClassLocal;
+					if (cls != eQueueClassLocal || GetSize () >= 2*m_Capacity)
+					{	
+						// last resort
+						Dropped (cls, false);
+						m_Dropper (e);
+						return false;
+					}
+				}	
+				Enqueued ();
+				Node * node = new Node;
+				node->el = e;
+				node->ts = GetTimestamp ();
+				node->cls = cls;
+				node->next = m_Head.load (std::memory_order_relaxed);
+				while (!m_Head.compare_exchange_weak (node->next, node))
+					;
+				if (m_IsWaiting.load ()) // signal consumer only if it sleeps
+				{
+					std::unique_lock<std::mutex> l(m_WaitMutex);
+					m_NonEmpty.notify_one ();
+				}
+				return true;
 			}
 
 			Element * GetNext ()
 			{
-				std::unique_lock<std::mutex> l(m_QueueMutex);
-				Element * el = GetNonThreadSafe ();
+				Element * el = Get ();
 				if (!el)
 				{
-					m_NonEmpty.wait (l);
-					el = GetNonThreadSafe ();
+					Wait ();
+					el = Get ();
 				}	
 				return el;
 			}
 
 			Element * GetNextWithTimeout (int usec)
 			{
-				std::unique_lock<std::mutex> l(m_QueueMutex);
-				Element * el = GetNonThreadSafe ();
+				Element * el = Get ();
 				if (!el)
 				{
-					m_NonEmpty.wait_for (l, std::chrono::milliseconds (usec));
-					el = GetNonThreadSafe ();
+					Wait (0, usec);
+					el = Get ();
 				}	
 				return el;
 			}
 
+			// appends all available elements in order of arrival, returns number of them
+			size_t GetAll (std::vector<Element *>& elements)
+			{
+				size_t num = 0;
+				uint64_t ts = GetTimestamp ();
+				for (int i = 0; i < 2; i++) // pending elements first, then newly arrived
+				{
+					if (!m_Pending) m_Pending = TakeAll ();
+					while (Element * el = Pop (ts))
+					{
+						elements.push_back (el);
+						num++;
+					}	
+				}	
+				return num;
+			}
+
+			size_t GetAllWithTimeout (std::vector<Element *>& elements, int usec)
+			{
+				size_t num = GetAll (elements);
+				if (!num)
+				{
+					Wait (0, usec);
+					num = GetAll (elements);
+				}
+				return num;
+			}
+
 			void Wait ()
 			{
-				std::unique_lock<std::mutex> l(m_QueueMutex);
-				m_NonEmpty.wait (l);
+				std::unique_lock<std::mutex> l(m_WaitMutex);
+				m_IsWaiting = true;
+				m_NonEmpty.wait (l, [this]{ return !IsEmpty () || m_IsWoken; });
+				m_IsWaiting = false;
+				m_IsWoken = false;
 			}
 
 			bool Wait (int sec, int usec)
 			{
-				std::unique_lock<std::mutex> l(m_QueueMutex);
-				return m_NonEmpty.wait_for (l, std::chrono::seconds (sec) + std::chrono::milliseconds (usec)) != std::cv_status::timeout;
+				std::unique_lock<std::mutex> l(m_WaitMutex);
+				m_IsWaiting = true;
+				bool ret = m_NonEmpty.wait_for (l, std::chrono::seconds (sec) + std::chrono::milliseconds (usec), 
+					[this]{ return !IsEmpty () || m_IsWoken; });
+				m_IsWaiting = false;
+				m_IsWoken = false;
+				return ret;
 			}
 
 			bool IsEmpty () 
 			{	
-				std::unique_lock<std::mutex> l(m_QueueMutex);
-				return m_Queue.empty ();
+				return !m_Pending && !m_Head.load ();
 			}
 			
-			void WakeUp () { m_NonEmpty.notify_all (); };
+			void WakeUp () 
+			{ 
+				std::unique_lock<std::mutex> l(m_WaitMutex);
+				m_IsWoken = true;
+				m_NonEmpty.notify_all (); 
+			};
 
 			Element * Get ()
 			{
-				std::unique_lock<std::mutex> l(m_QueueMutex);
-				return GetNonThreadSafe ();
+				uint64_t ts = GetTimestamp ();
+				for (;;)
+				{
+					if (!m_Pending) 
+					{	
+						m_Pending = TakeAll ();
+						if (!m_Pending) return nullptr;
+					}	
+					Element * el = Pop (ts);
+					if (el) return el;
+				}
 			}	
 
 			Element * Peek ()
 			{
-				std::unique_lock<std::mutex> l(m_QueueMutex);
-				return GetNonThreadSafe (true);
+				if (!m_Pending) m_Pending = TakeAll ();
+				return m_Pending ? m_Pending->el : nullptr;
 			}	
 			
+			bool IsCongested () const { return m_IsCongested; };
+			
 		private:
 
-			Element * GetNonThreadSafe (bool peek = false)
+			// next pending element, which is not dropped
+			Element * Pop (uint64_t ts)
 			{
-				if (!m_Queue.empty ())
+				while (m_Pending)
 				{
-					Element * el = m_Queue.front ();
-					if (!peek)
-						m_Queue.pop ();
+					Node * node = m_Pending;
+					m_Pending = node->next;
+					Element * el = node->el;
+					QueueClass cls = node->cls;
+					uint64_t sojourn = ts > node->ts ? ts - node->ts : 0;
+					delete node;
+					
+					if (sojourn < QUEUE_CODEL_TARGET)
+					{
+						m_FirstAboveTime = 0;
+						m_IsCongested = false;
+					}	
+					else if (!m_FirstAboveTime)
+						m_FirstAboveTime = ts + QUEUE_CODEL_INTERVAL;
+					else if (ts >= m_FirstAboveTime)
+						m_IsCongested = true;
+
+					if (m_IsCongested && sojourn >= QUEUE_CODEL_TARGET && m_Dropper)
+					{
+						if (m_Classifier) 
+							cls = m_Classifier (el) ? eQueueClassTransit : eQueueClassLocal;
+						if (cls != eQueueClassLocal)
+						{
+							Dropped (cls, true);
+							m_Dropper (el);
+							continue;
+						}	
+					}	
+					Processed (sojourn);
 					return el;
-				}				
+				}
 				return nullptr;
 			}	
+
+			static uint64_t GetTimestamp ()
+			{
+				return std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+			}	
+			
+			Node * TakeAll ()
+			{
+				Node * node = m_Head.exchange (nullptr), * prev = nullptr;
+				while (node) // reverse to arrival order
+				{
+					Node * next = node->next;
+					node->next = prev;
+					prev = node;
+					node = next;
+				}
+				return prev;
+			}	
+
+			void DeleteNodes (Node * node)
+			{
+				while (node)
+				{
+					Node * next = node->next;
+					delete node;
+					node = next;
+				}
+			}
 			
 		private:
 
-			std::queue<Element *> m_Queue;
-			std::mutex m_QueueMutex;
+			std::atomic<Node *> m_Head; // most recent first
+			Node * m_Pending; // consumer's only, oldest first
+			std::atomic<bool> m_IsWaiting;
+			bool m_IsWoken;
+			std::mutex m_WaitMutex;
 			std::condition_variable m_NonEmpty;
+			// overload
+			size_t m_Capacity;
+			Classifier m_Classifier;
+			Dropper m_Dropper;
+			uint64_t m_FirstAboveTime;
+			std::atomic<bool> m_IsCongested;
 	};	
 
 	template<class Msg>
@@ -107,7 +407,8 @@ namespace util
 
 			typedef std::function<void()> OnEmpty;
 
-			MsgQueue (): m_IsRunning (true), m_Thread (std::bind (&MsgQueue<Msg>::Run, this))  {};
+			MsgQueue (const std::string& name = ""): Queue<Msg> (name), 
+				m_IsRunning (true), m_Thread (std::bind (&MsgQueue<Msg>::Run, this))  {};
 			~MsgQueue () { Stop (); };
 			void Stop()
 			{
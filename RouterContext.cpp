@@ -66,8 +66,9 @@ namespace i2p
 	
 	void RouterContext::Sign (uint8_t * buf, int len, uint8_t * signature)
 	{
+		static thread_local CryptoPP::AutoSeededRandomPool rnd; // called from several threads
 		CryptoPP::DSA::Signer signer (m_SigningPrivateKey);
-		signer.SignMessage (m_Rnd, buf, len, signature);
+		signer.SignMessage (rnd, buf, len, signature);
 	}
 
 	bool RouterContext::Load ()
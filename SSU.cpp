@@ -1,4 +1,8 @@
 #include <string.h>
+#ifdef __linux__
+#include <errno.h>
+#include <sys/socket.h>
+#endif
 #include <boost/bind.hpp>
 #include <cryptopp/dh.h>
 #include <cryptopp/sha.h>
@@ -19,36 +23,38 @@ namespace ssu
 		const i2p::data::RouterInfo * router, bool peerTest ): 
 		m_Server (server), m_RemoteEndpoint (remoteEndpoint), m_RemoteRouter (router), 
 		m_Timer (m_Server.GetService ()), m_PeerTest (peerTest), m_State (eSessionStateUnknown),
-		m_IsSessionKey (false), m_RelayTag (0), m_Data (*this)
+		m_IsSessionKey (false), m_RelayTag (0), m_SentRelayTag (0), m_IsHandshaking (false), m_Data (*this)
 	{
-		m_DHKeysPair = i2p::transports.GetNextDHKeysPair ();
+		m_DHKeysPair = nullptr; // acquired when handshake starts
 	}
 
 	SSUSession::~SSUSession ()
 	{
+		HandshakeFinished ();
 		delete m_DHKeysPair;		
 	}	
 	
-	void SSUSession::CreateAESandMacKey (const uint8_t * pubKey)
+	bool SSUSession::CreateAESandMacKey (const uint8_t * privateKey, const uint8_t * pubKey, 
+		uint8_t * sessionKey, uint8_t * macKey)
 	{
 		CryptoPP::DH dh (i2p::crypto::elgp, i2p::crypto::elgg);
 		uint8_t sharedKey[256];
-		if (!dh.Agree (sharedKey, m_DHKeysPair->privateKey, pubKey))
+		if (!dh.Agree (sharedKey, privateKey, pubKey))
 		{    
 		    LogPrint ("Couldn't create shared key");
-			return;
+			return false;
 		};
 
 		if (sharedKey[0] & 0x80)
 		{
-			m_SessionKey[0] = 0;
-			memcpy (m_SessionKey + 1, sharedKey, 31);
-			memcpy (m_MacKey, sharedKey + 31, 32);
+			sessionKey[0] = 0;
+			memcpy (sessionKey + 1, sharedKey, 31);
+			memcpy (macKey, sharedKey + 31, 32);
 		}	
 		else if (sharedKey[0])
 		{
-			memcpy (m_SessionKey, sharedKey, 32);
-			memcpy (m_MacKey, sharedKey + 32, 32);
+			memcpy (sessionKey, sharedKey, 32);
+			memcpy (macKey, sharedKey + 32, 32);
 		}	
 		else
 		{	
@@ -60,17 +66,77 @@ namespace ssu
 				if (nonZero - sharedKey > 32)
 				{
 					LogPrint ("First 32 bytes of shared key is all zeros. Ignored");
-					return;
+					return false;
 				}	
 			}
 			
-			memcpy (m_SessionKey, nonZero, 32);
-			CryptoPP::SHA256().CalculateDigest(m_MacKey, nonZero, 64 - (nonZero - sharedKey));
+			memcpy (sessionKey, nonZero, 32);
+			CryptoPP::SHA256().CalculateDigest(macKey, nonZero, 64 - (nonZero - sharedKey));
 		}
+		return true;
+	}		
+
+	void SSUSession::CreateAESandMacKey (const uint8_t * buf, size_t len)
+	{
+		// DH agreement goes to crypto threads, message is processed further once keys are ready
+		auto keys = std::make_shared<SSUSessionKeys> ();
+		keys->endpoint = m_RemoteEndpoint;
+		memcpy (keys->pubKey, buf + sizeof (SSUHeader), 256); // x or y
+		keys->msg.assign (buf, buf + len);
+		m_SessionKeys = keys;
+		SSUServer * server = &m_Server;
+		auto createKeys = [keys, server]()
+			{
+				keys->isCreated = CreateAESandMacKey (keys->privateKey, keys->pubKey, keys->sessionKey, keys->macKey);
+				server->GetService ().post (boost::bind (&SSUServer::HandleSessionKeysCreated, server, keys));
+			};
+		if (m_DHKeysPair)
+		{
+			memcpy (keys->privateKey, m_DHKeysPair->privateKey, 256);
+			i2p::transports.GetCryptoService ().post (createKeys);
+		}
+		else
+			// our y is not generated yet
+			i2p::transports.GetNextDHKeysPair ([keys, createKeys](i2p::data::DHKeysPair * dhKeys)
+				{
+					keys->dhKeysPair = dhKeys;
+					memcpy (keys->privateKey, dhKeys->privateKey, 256);
+					i2p::transports.GetCryptoService ().post (createKeys);
+				});
+	}	
+
+	void SSUSession::HandleSessionKeysCreated (std::shared_ptr<SSUSessionKeys> keys)
+	{
+		if (keys != m_SessionKeys) return; // not ours anymore
+		m_SessionKeys = nullptr;
+		if (!keys->isCreated) return;
+		if (keys->dhKeysPair && !m_DHKeysPair)
+		{
+			m_DHKeysPair = keys->dhKeysPair;
+			keys->dhKeysPair = nullptr;
+		}	
+		memcpy (m_SessionKey, keys->sessionKey, 32);
+		memcpy (m_MacKey, keys->macKey, 32);
 		m_IsSessionKey = true;
 		m_SessionKeyEncryption.SetKey (m_SessionKey);
 		m_SessionKeyDecryption.SetKey (m_SessionKey);
-	}		
+		m_SessionMac.SetKey (m_MacKey);
+
+		uint8_t * buf = keys->msg.data ();
+		if (((SSUHeader *)buf)->GetPayloadType () == PAYLOAD_TYPE_SESSION_REQUEST)
+			SendSessionCreated (buf + sizeof (SSUHeader)); // x
+		else
+			ProcessSessionCreatedWithKeys (buf, keys->msg.size ());
+	}	
+
+	void SSUSession::HandshakeFinished ()
+	{
+		if (m_IsHandshaking)
+		{
+			m_IsHandshaking = false;
+			i2p::transports.ReleaseHandshake ();
+		}	
+	}	
 
 	void SSUSession::ProcessNextMessage (uint8_t * buf, size_t len, const boost::asio::ip::udp::endpoint& senderEndpoint)
 	{
@@ -83,39 +149,47 @@ namespace ssu
 		}
 		else
 		{
-			ScheduleTermination ();
-			// check for duplicate
-			const uint8_t * iv = ((SSUHeader *)buf)->iv;
-			if (m_ReceivedIVs.count (iv)) return; // duplicate detected
-			m_ReceivedIVs.insert (iv);
-
-			if (m_IsSessionKey && Validate (buf, len, m_MacKey)) // try session key first
-				DecryptSessionKey (buf, len);	
-			else 
+			if (!m_IsHandshaking) // handshake is limited by connect timer
+				ScheduleTermination ();
+			uint8_t decrypted[2*SSU_MTU];
+			if (len > sizeof (decrypted))
+			{
+				LogPrint ("Unexpected SSU packet length ", len);
+				return;
+			}
+			bool isValid = false;
+			if (m_IsSessionKey) // try session key first
+				isValid = ValidateAndDecrypt (buf, len, m_SessionMac, m_SessionKeyDecryption, decrypted);
+			if (!isValid)
 			{
 				// try intro key depending on side
 				auto introKey = GetIntroKey ();
-				if (introKey && Validate (buf, len, introKey))
-					Decrypt (buf, len, introKey);
-				else
-				{    
+				if (introKey)
+					isValid = ValidateAndDecrypt (buf, len, introKey, decrypted);
+				if (!isValid)
+				{
 					// try own intro key
 					auto address = i2p::context.GetRouterInfo ().GetSSUAddress ();
 					if (!address)
 					{
 						LogPrint ("SSU is not supported");
 						return;
-					}	
-					if (Validate (buf, len, address->key))
-						Decrypt (buf, len, address->key);
-					else
+					}
+					if (!ValidateAndDecrypt (buf, len, address->key, decrypted))
 					{
 						LogPrint ("MAC verifcation failed");
 						m_Server.DeleteSession (this); 
 						return;
-					}	
-				}	
-			}	
+					}
+				}
+			}
+			buf = decrypted;
+			// check for duplicate after MAC is verified, so forged packets don't fill the filter
+			if (i2p::transports.IsReplayedIV (((SSUHeader *)buf)->iv))
+			{
+				LogPrint ("SSU duplicate packet dropped");
+				return;
+			}
 			// successfully decrypted
 			ProcessMessage (buf, len, senderEndpoint);
 		}	
@@ -170,9 +244,21 @@ namespace ssu
 	void SSUSession::ProcessSessionRequest (uint8_t * buf, size_t len, const boost::asio::ip::udp::endpoint& senderEndpoint)
 	{
 		LogPrint ("Session request received");	
+		if (!m_IsHandshaking)
+		{
+			if (!i2p::transports.AcquireHandshake (true))
+			{
+				LogPrint ("Too many handshakes in progress. Session request ignored");
+				return;
+			}	
+			m_IsHandshaking = true;
+			// release handshake if session is not confirmed in time
+			m_Timer.expires_from_now (boost::posix_time::seconds(SSU_CONNECT_TIMEOUT));
+			m_Timer.async_wait (boost::bind (&SSUSession::HandleConnectTimer,
+				this, boost::asio::placeholders::error));
+		}	
 		m_RemoteEndpoint = senderEndpoint;
-		CreateAESandMacKey (buf + sizeof (SSUHeader));
-		SendSessionCreated (buf + sizeof (SSUHeader));
+		CreateAESandMacKey (buf, len); // SessionCreated is sent after
 	}
 
 	void SSUSession::ProcessSessionCreated (uint8_t * buf, size_t len)
@@ -184,11 +270,18 @@ namespace ssu
 		}
 
 		LogPrint ("Session created received");	
-		m_Timer.cancel (); // connect timer
+		// restart connect timer for the rest of handshake
+		m_Timer.expires_from_now (boost::posix_time::seconds(SSU_CONNECT_TIMEOUT));
+		m_Timer.async_wait (boost::bind (&SSUSession::HandleConnectTimer,
+			this, boost::asio::placeholders::error));
+		CreateAESandMacKey (buf, len); // continue when keys are ready
+	}	
+
+	void SSUSession::ProcessSessionCreatedWithKeys (uint8_t * buf, size_t len)
+	{
 		uint8_t signedData[532]; // x,y, our IP, our port, remote IP, remote port, relayTag, signed on time 
 		uint8_t * payload = buf + sizeof (SSUHeader);	
 		uint8_t * y = payload;
-		CreateAESandMacKey (y);
 		memcpy (signedData, m_DHKeysPair->publicKey, 256); // x
 		memcpy (signedData + 256, y, 256); // y
 		payload += 256;
@@ -313,7 +406,10 @@ namespace ssu
 		if (i2p::context.GetRouterInfo ().IsIntroducer ())
 		{
 			rnd.GenerateWord32 (relayTag);
-			m_Server.AddRelay (relayTag, m_RemoteEndpoint);
+			if (m_SentRelayTag) // SessionRequest was resent
+				m_Server.RemoveRelay (m_SentRelayTag);
+			m_SentRelayTag = relayTag;
+			m_Server.AddRelay (relayTag, this);
 		}
 		*(uint32_t *)(payload) = relayTag; 
 		payload += 4; // relay tag 
@@ -520,76 +616,98 @@ namespace ssu
 		header->time = htobe32 (i2p::util::GetSecondsSinceEpoch ());
 		uint8_t * encrypted = &header->flag;
 		uint16_t encryptedLen = len - (encrypted - buf);
-		m_SessionKeyEncryption.Encrypt (encrypted, encryptedLen, encrypted);
-		// assume actual buffer size is 18 (16 + 2) bytes more
-		memcpy (buf + len, header->iv, 16);
-		*(uint16_t *)(buf + len + 16) = htobe16 (encryptedLen);
-		i2p::crypto::HMACMD5Digest (encrypted, encryptedLen + 18, m_MacKey, header->mac);
+		// single pass, each chunk is added to MAC right after encryption
+		m_SessionMac.Start ();
+		for (size_t offset = 0; offset < encryptedLen; offset += SSU_CRYPTO_CHUNK_SIZE)
+		{
+			size_t l = encryptedLen - offset;
+			if (l > SSU_CRYPTO_CHUNK_SIZE) l = SSU_CRYPTO_CHUNK_SIZE;
+			m_SessionKeyEncryption.Encrypt (encrypted + offset, l, encrypted + offset);
+			m_SessionMac.Update (encrypted + offset, l);
+		}
+		m_SessionMac.Update (header->iv, 16);
+		uint16_t size = htobe16 (encryptedLen);
+		m_SessionMac.Update ((const uint8_t *)&size, 2);
+		m_SessionMac.Final (header->mac);
 	}	
 		
-	void SSUSession::Decrypt (uint8_t * buf, size_t len, const uint8_t * aesKey)
+	bool SSUSession::ValidateAndDecrypt (const uint8_t * buf, size_t len, const uint8_t * key, uint8_t * out)
 	{
-		if (len < sizeof (SSUHeader))
-		{
-			LogPrint ("Unexpected SSU packet length ", len);
-			return;
-		}
-		SSUHeader * header = (SSUHeader *)buf;
-		uint8_t * encrypted = &header->flag;
-		uint16_t encryptedLen = len - (encrypted - buf);	
+		i2p::crypto::HMACMD5 mac (key);
 		i2p::crypto::CBCDecryption decryption;
-		decryption.SetKey (aesKey);
-		decryption.SetIV (header->iv);
-		decryption.Decrypt (encrypted, encryptedLen, encrypted);
+		decryption.SetKey (key);
+		return ValidateAndDecrypt (buf, len, mac, decryption, out);
 	}
 
-	void SSUSession::DecryptSessionKey (uint8_t * buf, size_t len)
-	{
-		if (len < sizeof (SSUHeader))
-		{
-			LogPrint ("Unexpected SSU packet length ", len);
-			return;
-		}
-		SSUHeader * header = (SSUHeader *)buf;
-		uint8_t * encrypted = &header->flag;
-		uint16_t encryptedLen = len - (encrypted - buf);	
-		if (encryptedLen > 0)
-		{	
-			m_SessionKeyDecryption.SetIV (header->iv);
-			m_SessionKeyDecryption.Decrypt (encrypted, encryptedLen, encrypted);
-		}	
-	}	
-		
-	bool SSUSession::Validate (uint8_t * buf, size_t len, const uint8_t * macKey)
+	bool SSUSession::ValidateAndDecrypt (const uint8_t * buf, size_t len, i2p::crypto::HMACMD5& mac,
+		i2p::crypto::CBCDecryption& decryption, uint8_t * out)
 	{
 		if (len < sizeof (SSUHeader))
 		{
 			LogPrint ("Unexpected SSU packet length ", len);
 			return false;
 		}
-		SSUHeader * header = (SSUHeader *)buf;
-		uint8_t * encrypted = &header->flag;
+		const SSUHeader * header = (const SSUHeader *)buf;
+		const uint8_t * encrypted = &header->flag;
 		uint16_t encryptedLen = len - (encrypted - buf);
-		// assume actual buffer size is 18 (16 + 2) bytes more
-		memcpy (buf + len, header->iv, 16);
-		*(uint16_t *)(buf + len + 16) = htobe16 (encryptedLen);
+		uint8_t * decrypted = out + (encrypted - buf);
+		// single pass, each chunk is decrypted right after MAC has been updated with it
+		mac.Start ();
+		decryption.SetIV (header->iv);
+		for (size_t offset = 0; offset < encryptedLen; offset += SSU_CRYPTO_CHUNK_SIZE)
+		{
+			size_t l = encryptedLen - offset;
+			if (l > SSU_CRYPTO_CHUNK_SIZE) l = SSU_CRYPTO_CHUNK_SIZE;
+			mac.Update (encrypted + offset, l);
+			decryption.Decrypt (encrypted + offset, l, decrypted + offset);
+		}
+		// MAC covers IV and size after encrypted data
+		mac.Update (header->iv, 16);
+		uint16_t size = htobe16 (encryptedLen);
+		mac.Update ((const uint8_t *)&size, 2);
 		uint8_t digest[16];
-		i2p::crypto::HMACMD5Digest (encrypted, encryptedLen + 18, macKey, digest);
-		return !memcmp (header->mac, digest, 16);
+		mac.Final (digest);
+		if (memcmp (header->mac, digest, 16)) return false;
+		memcpy (out, buf, encrypted - buf); // MAC and IV
+		return true;
 	}
 
 	void SSUSession::Connect ()
 	{
 		if (m_State == eSessionStateUnknown)
 		{	
+			if (!m_IsHandshaking)
+				m_IsHandshaking = i2p::transports.AcquireHandshake (false); // outgoing is always accepted
 			// set connect timer
 			m_Timer.expires_from_now (boost::posix_time::seconds(SSU_CONNECT_TIMEOUT));
 			m_Timer.async_wait (boost::bind (&SSUSession::HandleConnectTimer,
 				this, boost::asio::placeholders::error));	
-			SendSessionRequest ();
+			if (m_DHKeysPair)
+				SendSessionRequest ();
+			else
+			{
+				// our x is not generated yet, session might be deleted before it comes
+				SSUServer * server = &m_Server;
+				auto endpoint = m_RemoteEndpoint;
+				i2p::transports.GetNextDHKeysPair ([server, endpoint](i2p::data::DHKeysPair * keys)
+					{
+						server->GetService ().post (boost::bind (&SSUServer::HandleDHKeysPair, server, endpoint, keys));
+					});
+			}	
 		}	
 	}
 
+	void SSUSession::HandleDHKeysPair (i2p::data::DHKeysPair * keys)
+	{
+		if (!m_DHKeysPair && m_State == eSessionStateUnknown)
+		{
+			m_DHKeysPair = keys;
+			SendSessionRequest ();
+		}	
+		else
+			delete keys;
+	}	
+
 	void SSUSession::HandleConnectTimer (const boost::system::error_code& ecode)
 	{
 		if (!ecode)
@@ -624,24 +742,16 @@ namespace ssu
 	void SSUSession::Close ()
 	{
 		SendSesionDestroyed ();
-		if (!m_DelayedMessages.empty ())
-		{
-			for (auto it :m_DelayedMessages)
-				DeleteI2NPMessage (it);
-			m_DelayedMessages.clear ();
-		}	
+		m_DelayedMessages.Clear ();
 	}	
 
 	void SSUSession::Established ()
 	{
+		HandshakeFinished ();
 		m_State = eSessionStateEstablished;
 		SendI2NPMessage (CreateDatabaseStoreMsg ());
-		if (!m_DelayedMessages.empty ())
-		{
-			for (auto it :m_DelayedMessages)
-				m_Data.Send (it);
-			m_DelayedMessages.clear ();
-		}
+		while (auto msg = m_DelayedMessages.Get ())
+			m_Data.Send (msg);
 		if (m_PeerTest && (m_RemoteRouter && m_RemoteRouter->IsPeerTesting ()))
 			SendPeerTest ();
 		ScheduleTermination ();
@@ -697,7 +807,7 @@ namespace ssu
 			if (m_State == eSessionStateEstablished)
 				m_Data.Send (msg);
 			else
-				m_DelayedMessages.push_back (msg);
+				m_DelayedMessages.Put (msg);
 		}	
 	}	
 	
@@ -846,7 +956,8 @@ namespace ssu
 	}	
 
 	SSUServer::SSUServer (int port): m_Thread (nullptr), m_Work (m_Service),
-		m_Endpoint (boost::asio::ip::udp::v4 (), port), m_Socket (m_Service, m_Endpoint)
+		m_Endpoint (boost::asio::ip::udp::v4 (), port), m_Socket (m_Service, m_Endpoint),
+		m_NumPacketsToSend (0), m_NumSentDataPackets (0), m_NumSentAckPackets (0), m_NumSentAcks (0)
 	{
 		m_Socket.set_option (boost::asio::socket_base::receive_buffer_size (65535));
 		m_Socket.set_option (boost::asio::socket_base::send_buffer_size (65535));
@@ -867,16 +978,17 @@ namespace ssu
 
 	void SSUServer::Stop ()
 	{
-		DeleteAllSessions ();
 		m_IsRunning = false;
 		m_Service.stop ();
-		m_Socket.close ();
 		if (m_Thread)
 		{	
 			m_Thread->join (); 
 			delete m_Thread;
 			m_Thread = 0;
 		}	
+		DeleteAllSessions (); // SSU thread is not running anymore
+		FlushSendQueue (); // SessionDestroyed
+		m_Socket.close ();
 	}
 
 	void SSUServer::Run () 
@@ -894,56 +1006,165 @@ namespace ssu
 		}	
 	}
 		
-	void SSUServer::AddRelay (uint32_t tag, const boost::asio::ip::udp::endpoint& relay)
+	void SSUServer::AddRelay (uint32_t tag, SSUSession * relay)
 	{
+		std::unique_lock<std::mutex> l(m_SessionsMutex);
 		m_Relays[tag] = relay;
 	}	
 
+	void SSUServer::RemoveRelay (uint32_t tag)
+	{
+		std::unique_lock<std::mutex> l(m_SessionsMutex);
+		m_Relays.erase (tag);
+	}	
+
 	SSUSession * SSUServer::FindRelaySession (uint32_t tag)
 	{
 		auto it = m_Relays.find (tag);
 		if (it != m_Relays.end ())
-			return FindSession (it->second);
+			return it->second;
 		return nullptr;
 	}
 
 	void SSUServer::Send (const uint8_t * buf, size_t len, const boost::asio::ip::udp::endpoint& to)
 	{
+		i2p::transports.GetBandwidthLimiter ().GetOutbound ().ForceConsume (len); // new messages wait in SSUData
+#ifdef __linux__
+		if (len > sizeof (m_PacketsToSend[0].buf))
+		{
+			m_Socket.send_to (boost::asio::buffer (buf, len), to);
+			return;
+		}	
+		// packets sent by current handler go out in one sendmmsg
+		if (m_NumPacketsToSend >= SSU_MAX_NUM_PACKETS)
+			FlushSendQueue ();
+		auto& packet = m_PacketsToSend[m_NumPacketsToSend];
+		memcpy (packet.buf, buf, len);
+		packet.len = len;
+		packet.endpoint = to;
+		if (!m_NumPacketsToSend++)
+			m_Service.post (boost::bind (&SSUServer::FlushSendQueue, this));
+#else
 		m_Socket.send_to (boost::asio::buffer (buf, len), to);
-		LogPrint ("SSU sent ", len, " bytes");
+#endif
+	}	
+
+	void SSUServer::FlushSendQueue ()
+	{
+#ifdef __linux__
+		if (!m_NumPacketsToSend) return;
+		mmsghdr msgs[SSU_MAX_NUM_PACKETS];
+		iovec iovs[SSU_MAX_NUM_PACKETS];
+		for (int i = 0; i < m_NumPacketsToSend; i++)
+		{
+			auto& packet = m_PacketsToSend[i];
+			iovs[i].iov_base = packet.buf;
+			iovs[i].iov_len = packet.len;
+			memset (&msgs[i], 0, sizeof (mmsghdr));
+			msgs[i].msg_hdr.msg_name = packet.endpoint.data ();
+			msgs[i].msg_hdr.msg_namelen = packet.endpoint.size ();
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}	
+		int numSent = sendmmsg (m_Socket.native_handle (), msgs, m_NumPacketsToSend, MSG_DONTWAIT);
+		if (numSent < 0) numSent = 0;
+		// send buffer is full or error, send rest one by one
+		for (int i = numSent; i < m_NumPacketsToSend; i++)
+		{
+			boost::system::error_code ec;
+			m_Socket.send_to (boost::asio::buffer (m_PacketsToSend[i].buf, m_PacketsToSend[i].len), 
+				m_PacketsToSend[i].endpoint, 0, ec);
+			if (ec)
+				LogPrint ("SSU send error: ", ec.message ());
+		}	
+		m_NumPacketsToSend = 0;
+#endif
 	}	
 
 	void SSUServer::Receive ()
 	{
-		m_Socket.async_receive_from (boost::asio::buffer (m_ReceiveBuffer, SSU_MTU), m_SenderEndpoint,
+#ifdef __linux__
+		// asio tells when socket is readable, datagrams are read by recvmmsg
+		m_Socket.async_receive (boost::asio::null_buffers (),
+			boost::bind (&SSUServer::HandleReceivedPackets, this, boost::asio::placeholders::error));
+#else
+		m_Socket.async_receive_from (boost::asio::buffer (m_ReceivedPackets[0].buf, SSU_MTU), m_ReceivedPackets[0].endpoint,
 			boost::bind (&SSUServer::HandleReceivedFrom, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)); 
+#endif
 	}
 
 	void SSUServer::HandleReceivedFrom (const boost::system::error_code& ecode, std::size_t bytes_transferred)
 	{
 		if (!ecode)
 		{
-			LogPrint ("SSU received ", bytes_transferred, " bytes");
-			SSUSession * session = nullptr;
-			auto it = m_Sessions.find (m_SenderEndpoint);
-			if (it != m_Sessions.end ())
-				session = it->second;
-			if (!session)
-			{
-				session = new SSUSession (*this, m_SenderEndpoint);
-				m_Sessions[m_SenderEndpoint] = session;
-				LogPrint ("New SSU session from ", m_SenderEndpoint.address ().to_string (), ":", m_SenderEndpoint.port (), " created");
-			}
-			session->ProcessNextMessage (m_ReceiveBuffer, bytes_transferred, m_SenderEndpoint);
+			m_ReceivedPackets[0].len = bytes_transferred;
+			ProcessReceivedPacket (m_ReceivedPackets[0]);
 			Receive ();
 		}
 		else
 			LogPrint ("SSU receive error: ", ecode.message ());
 	}
 
+	void SSUServer::HandleReceivedPackets (const boost::system::error_code& ecode)
+	{
+#ifdef __linux__
+		if (ecode)
+		{
+			LogPrint ("SSU receive error: ", ecode.message ());
+			return;
+		}	
+		mmsghdr msgs[SSU_MAX_NUM_PACKETS];
+		iovec iovs[SSU_MAX_NUM_PACKETS];
+		for (int i = 0; i < SSU_MAX_NUM_PACKETS; i++)
+		{
+			auto& packet = m_ReceivedPackets[i];
+			iovs[i].iov_base = packet.buf;
+			iovs[i].iov_len = SSU_MTU;
+			memset (&msgs[i], 0, sizeof (mmsghdr));
+			msgs[i].msg_hdr.msg_name = packet.endpoint.data ();
+			msgs[i].msg_hdr.msg_namelen = packet.endpoint.capacity ();
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}	
+		int numReceived = recvmmsg (m_Socket.native_handle (), msgs, SSU_MAX_NUM_PACKETS, MSG_DONTWAIT, nullptr);
+		if (numReceived < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			LogPrint ("SSU recvmmsg error: ", strerror (errno));
+		for (int i = 0; i < numReceived; i++)
+		{
+			auto& packet = m_ReceivedPackets[i];
+			packet.len = msgs[i].msg_len;
+			packet.endpoint.resize (msgs[i].msg_hdr.msg_namelen);
+			ProcessReceivedPacket (packet);
+		}	
+		Receive (); // fires immediately if more datagrams are waiting
+#endif
+	}
+
+	void SSUServer::ProcessReceivedPacket (SSUPacket& packet)
+	{
+		if (!i2p::transports.GetBandwidthLimiter ().GetInbound ().Consume (packet.len))
+			return; // over inbound limit, peer will resend
+		SSUSession * session = nullptr;
+		auto it = m_Sessions.find (packet.endpoint);
+		if (it != m_Sessions.end ())
+			session = it->second;
+		if (!session)
+		{
+			session = new SSUSession (*this, packet.endpoint);
+			std::unique_lock<std::mutex> l(m_SessionsMutex);
+			m_Sessions[packet.endpoint] = session;
+			LogPrint ("New SSU session from ", packet.endpoint.address ().to_string (), ":", packet.endpoint.port (), " created");
+		}
+		session->ProcessNextMessage (packet.buf, packet.len, packet.endpoint);
+	}	
+
 	SSUSession * SSUServer::FindSession (const i2p::data::RouterInfo * router)
 	{
 		if (!router) return nullptr;
+		auto it = m_SessionsByIdentHash.find (router->GetIdentHash ());
+		if (it != m_SessionsByIdentHash.end ())
+			return it->second;
+		// might be incoming
 		auto address = router->GetSSUAddress ();
 		if (!address) return nullptr;
 		return FindSession (boost::asio::ip::udp::endpoint (address->host, address->port));
@@ -974,7 +1195,11 @@ namespace ssu
 				{
 					// otherwise create new session					
 					session = new SSUSession (*this, remoteEndpoint, router, peerTest);
-					m_Sessions[remoteEndpoint] = session;
+					{
+						std::unique_lock<std::mutex> l(m_SessionsMutex);
+						m_Sessions[remoteEndpoint] = session;
+						m_SessionsByIdentHash[router->GetIdentHash ()] = session;
+					}
 					
 					if (!router->UsesIntroducer ())
 					{
@@ -1011,6 +1236,7 @@ namespace ssu
 								introducer = &(address->introducers[0]); // TODO:
 								boost::asio::ip::udp::endpoint introducerEndpoint (introducer->iHost, introducer->iPort);
 								introducerSession = new SSUSession (*this, introducerEndpoint, router);
+								std::unique_lock<std::mutex> l(m_SessionsMutex);
 								m_Sessions[introducerEndpoint] = introducerSession;													
 							}	
 							// introduce
@@ -1035,19 +1261,75 @@ namespace ssu
 		if (session)
 		{
 			session->Close ();
-			m_Sessions.erase (session->GetRemoteEndpoint ());
+			{
+				std::unique_lock<std::mutex> l(m_SessionsMutex);
+				m_Sessions.erase (session->GetRemoteEndpoint ());
+				auto router = session->GetRemoteRouter ();
+				if (router)
+				{
+					auto it = m_SessionsByIdentHash.find (router->GetIdentHash ());
+					if (it != m_SessionsByIdentHash.end () && it->second == session)
+						m_SessionsByIdentHash.erase (it);
+				}	
+			}
+			if (session->GetSentRelayTag ())
+				RemoveRelay (session->GetSentRelayTag ());
 			delete session;
 		}	
 	}	
 
 	void SSUServer::DeleteAllSessions ()
 	{
+		std::unique_lock<std::mutex> l(m_SessionsMutex);
 		for (auto it: m_Sessions)
 		{
 			it.second->Close ();
 			delete it.second;			
 		}	
 		m_Sessions.clear ();
+		m_SessionsByIdentHash.clear ();
+		m_Relays.clear ();
+	}
+
+	void SSUServer::HandleDHKeysPair (boost::asio::ip::udp::endpoint endpoint, i2p::data::DHKeysPair * keys)
+	{
+		auto session = FindSession (endpoint);
+		if (session)
+			session->HandleDHKeysPair (keys);
+		else
+			delete keys;
+	}	
+
+	void SSUServer::HandleSessionKeysCreated (std::shared_ptr<SSUSessionKeys> keys)
+	{
+		auto session = FindSession (keys->endpoint); // might be deleted already
+		if (session)
+			session->HandleSessionKeysCreated (keys);
+	}	
+
+	size_t SSUServer::GetNumSessions () const
+	{
+		std::unique_lock<std::mutex> l(m_SessionsMutex);
+		return m_Sessions.size ();
+	}	
+
+	size_t SSUServer::GetNumRelays () const
+	{
+		std::unique_lock<std::mutex> l(m_SessionsMutex);
+		return m_Relays.size ();
+	}	
+
+	void SSUServer::GetSessions (std::vector<SSUSessionInfo>& sessions) const
+	{
+		std::unique_lock<std::mutex> l(m_SessionsMutex);
+		for (auto it: m_Sessions)
+		{
+			SSUSessionInfo info;
+			info.endpoint = it.first;
+			info.isOutgoing = it.second->GetRemoteRouter () != nullptr; // incoming connections don't have remote router
+			info.mtu = it.second->GetMTU ();
+			sessions.push_back (info);
+		}
 	}
 }
 }
@@ -4,11 +4,17 @@
 #include <inttypes.h>
 #include <string.h>
 #include <map>
+#include <unordered_map>
 #include <list>
 #include <set>
+#include <vector>
+#include <memory>
 #include <thread>
+#include <mutex>
+#include <atomic>
 #include <boost/asio.hpp>
 #include "aes.h"
+#include "hmac.h"
 #include "I2PEndian.h"
 #include "Identity.h"
 #include "RouterInfo.h"
@@ -31,9 +37,10 @@ namespace ssu
 	};
 #pragma pack()
 
-	const size_t SSU_MTU = 1484;
+	const int SSU_MAX_NUM_PACKETS = 64; // per recvmmsg/sendmmsg call
 	const int SSU_CONNECT_TIMEOUT = 5; // 5 seconds
 	const int SSU_TERMINATION_TIMEOUT = 330; // 5.5 minutes
+	const size_t SSU_CRYPTO_CHUNK_SIZE = 256; // MAC and AES pass over the same bytes in L1 cache
 
 	// payload types (4 bits)
 	const uint8_t PAYLOAD_TYPE_SESSION_REQUEST = 0;
@@ -54,6 +61,20 @@ namespace ssu
 		eSessionStateFailed
 	};	
 
+	// DH agreement runs in transports' crypto threads
+	struct SSUSessionKeys
+	{
+		boost::asio::ip::udp::endpoint endpoint;
+		uint8_t privateKey[256], pubKey[256];
+		uint8_t sessionKey[32], macKey[32];
+		bool isCreated;
+		std::vector<uint8_t> msg; // decrypted SessionRequest or SessionCreated
+		i2p::data::DHKeysPair * dhKeysPair; // acquired for this message, passed to session
+
+		SSUSessionKeys (): isCreated (false), dhKeysPair (nullptr) {};
+		~SSUSessionKeys () { delete dhKeysPair; };
+	};	
+
 	class SSUServer;
 	class SSUSession
 	{
@@ -70,20 +91,27 @@ namespace ssu
 			void Close ();
 			boost::asio::ip::udp::endpoint& GetRemoteEndpoint () { return m_RemoteEndpoint; };
 			const i2p::data::RouterInfo * GetRemoteRouter () const  { return m_RemoteRouter; };
+			uint32_t GetSentRelayTag () const { return m_SentRelayTag; };
 			void SendI2NPMessage (I2NPMessage * msg);
 			void SendPeerTest (); // Alice			
 
 			SessionState GetState () const  { return m_State; };
+			void HandleSessionKeysCreated (std::shared_ptr<SSUSessionKeys> keys);
+			void HandleDHKeysPair (i2p::data::DHKeysPair * keys);
 
 		private:
 
-			void CreateAESandMacKey (const uint8_t * pubKey); 
+			static bool CreateAESandMacKey (const uint8_t * privateKey, const uint8_t * pubKey, 
+				uint8_t * sessionKey, uint8_t * macKey); // thread safe
+			void CreateAESandMacKey (const uint8_t * buf, size_t len); // async, buf is decrypted message
+			void HandshakeFinished ();
 
 			void ProcessMessage (uint8_t * buf, size_t len, const boost::asio::ip::udp::endpoint& senderEndpoint); // call for established session
 			void ProcessSessionRequest (uint8_t * buf, size_t len, const boost::asio::ip::udp::endpoint& senderEndpoint);
 			void SendSessionRequest ();
 			void SendRelayRequest (uint32_t iTag, const uint8_t * iKey);
 			void ProcessSessionCreated (uint8_t * buf, size_t len);
+			void ProcessSessionCreatedWithKeys (uint8_t * buf, size_t len);
 			void SendSessionCreated (const uint8_t * x);
 			void ProcessSessionConfirmed (uint8_t * buf, size_t len);
 			void SendSessionConfirmed (const uint8_t * y, const uint8_t * ourAddress);
@@ -104,9 +132,10 @@ namespace ssu
 			
 			void FillHeaderAndEncrypt (uint8_t payloadType, uint8_t * buf, size_t len, const uint8_t * aesKey, const uint8_t * iv, const uint8_t * macKey);
 			void FillHeaderAndEncrypt (uint8_t payloadType, uint8_t * buf, size_t len); // with session key 
-			void Decrypt (uint8_t * buf, size_t len, const uint8_t * aesKey);
-			void DecryptSessionKey (uint8_t * buf, size_t len);
-			bool Validate (uint8_t * buf, size_t len, const uint8_t * macKey);			
+			// decrypted packet goes to out, buf is not changed if MAC doesn't match
+			bool ValidateAndDecrypt (const uint8_t * buf, size_t len, const uint8_t * key, uint8_t * out); // intro key
+			bool ValidateAndDecrypt (const uint8_t * buf, size_t len, i2p::crypto::HMACMD5& mac,
+				i2p::crypto::CBCDecryption& decryption, uint8_t * out);
 			const uint8_t * GetIntroKey () const; 
 
 			void ScheduleTermination ();
@@ -114,7 +143,6 @@ namespace ssu
 			
 		private:
 
-			typedef i2p::data::Tag<16> IV;			
 			friend class SSUData; // TODO: change in later
 			SSUServer& m_Server;
 			boost::asio::ip::udp::endpoint m_RemoteEndpoint;
@@ -124,16 +152,62 @@ namespace ssu
 			bool m_PeerTest;
 			SessionState m_State;
 			bool m_IsSessionKey;
-			uint32_t m_RelayTag;	
+			uint32_t m_RelayTag, m_SentRelayTag; // received as Alice, sent as introducer
+			bool m_IsHandshaking;
+			std::shared_ptr<SSUSessionKeys> m_SessionKeys; // being created
 			std::set<uint32_t> m_PeerTestNonces;
 			i2p::crypto::CBCEncryption m_SessionKeyEncryption;
 			i2p::crypto::CBCDecryption m_SessionKeyDecryption;
 			uint8_t m_SessionKey[32], m_MacKey[32];
-			std::list<i2p::I2NPMessage *> m_DelayedMessages;
-			std::set<IV> m_ReceivedIVs;	
+			i2p::crypto::HMACMD5 m_SessionMac; // of m_MacKey
+			i2p::OutboundQueue m_DelayedMessages;
 			SSUData m_Data;
+
+		public:
+			// for HTTP only
+			size_t GetMTU () const { return m_Data.GetMTU (); };
+	};
+
+	struct SSUEndpointHash
+	{
+		size_t operator() (const boost::asio::ip::udp::endpoint& e) const
+		{
+			uint64_t h = 0;
+			auto address = e.address ();
+			if (address.is_v4 ())
+				h = address.to_v4 ().to_ulong ();
+			else
+				for (auto b: address.to_v6 ().to_bytes ())
+					h = h*31 + b;
+			return std::hash<uint64_t>()((h << 16) ^ e.port ());
+		}
 	};
 
+	struct SSUIdentHashHash
+	{
+		size_t operator() (const i2p::data::IdentHash& ident) const
+		{
+			size_t h; // ident is SHA256 already
+			memcpy (&h, (const uint8_t *)ident, sizeof (h));
+			return h;
+		}
+	};
+
+	struct SSUSessionInfo // for HTTP only
+	{
+		boost::asio::ip::udp::endpoint endpoint;
+		bool isOutgoing;
+		size_t mtu;
+	};
+
+	struct SSUPacket
+	{
+		uint8_t buf[2*SSU_MTU];
+		size_t len;
+		boost::asio::ip::udp::endpoint endpoint; // from or to
+	};	
+
+	// all sessions are processed in SSU thread, other threads post to GetService ()
 	class SSUServer
 	{
 		public:
@@ -151,14 +225,30 @@ namespace ssu
 			boost::asio::io_service& GetService () { return m_Socket.get_io_service(); };
 			const boost::asio::ip::udp::endpoint& GetEndpoint () const { return m_Endpoint; };			
 			void Send (const uint8_t * buf, size_t len, const boost::asio::ip::udp::endpoint& to);
-			void AddRelay (uint32_t tag, const boost::asio::ip::udp::endpoint& relay);
+			void AddRelay (uint32_t tag, SSUSession * relay);
+			void RemoveRelay (uint32_t tag);
 			SSUSession * FindRelaySession (uint32_t tag);
+			size_t GetNumSessions () const;
+			size_t GetNumRelays () const;
+			void UpdateSentPacketsStats (bool isData, int numAcks)
+			{
+				if (isData) m_NumSentDataPackets++; else m_NumSentAckPackets++;
+				m_NumSentAcks += numAcks;
+			};
+			uint64_t GetNumSentDataPackets () const { return m_NumSentDataPackets; };
+			uint64_t GetNumSentAckPackets () const { return m_NumSentAckPackets; }; // without data
+			uint64_t GetNumSentAcks () const { return m_NumSentAcks; }; // explicit and bitfields
+			void HandleSessionKeysCreated (std::shared_ptr<SSUSessionKeys> keys);
+			void HandleDHKeysPair (boost::asio::ip::udp::endpoint endpoint, i2p::data::DHKeysPair * keys);
 
 		private:
 
 			void Run ();
 			void Receive ();
 			void HandleReceivedFrom (const boost::system::error_code& ecode, std::size_t bytes_transferred);
+			void HandleReceivedPackets (const boost::system::error_code& ecode);
+			void ProcessReceivedPacket (SSUPacket& packet);
+			void FlushSendQueue ();
 
 		private:
 
@@ -168,14 +258,17 @@ namespace ssu
 			boost::asio::io_service::work m_Work;
 			boost::asio::ip::udp::endpoint m_Endpoint;
 			boost::asio::ip::udp::socket m_Socket;
-			boost::asio::ip::udp::endpoint m_SenderEndpoint;
-			uint8_t m_ReceiveBuffer[2*SSU_MTU];
-			std::map<boost::asio::ip::udp::endpoint, SSUSession *> m_Sessions;
-			std::map<uint32_t, boost::asio::ip::udp::endpoint> m_Relays; // we are introducer
+			SSUPacket m_ReceivedPackets[SSU_MAX_NUM_PACKETS], m_PacketsToSend[SSU_MAX_NUM_PACKETS];
+			int m_NumPacketsToSend;
+			std::unordered_map<boost::asio::ip::udp::endpoint, SSUSession *, SSUEndpointHash> m_Sessions;
+			std::unordered_map<i2p::data::IdentHash, SSUSession *, SSUIdentHashHash> m_SessionsByIdentHash; // outgoing only
+			mutable std::mutex m_SessionsMutex; // for modifications and access from other threads
+			std::unordered_map<uint32_t, SSUSession *> m_Relays; // we are introducer
+			std::atomic<uint64_t> m_NumSentDataPackets, m_NumSentAckPackets, m_NumSentAcks;
 
 		public:
 			// for HTTP only
-			const decltype(m_Sessions)& GetSessions () const { return m_Sessions; };
+			void GetSessions (std::vector<SSUSessionInfo>& sessions) const;
 	};
 }
 }
@@ -1,4 +1,8 @@
+#include <math.h>
+#include <boost/bind.hpp>
 #include "Log.h"
+#include "Timestamp.h"
+#include "Transports.h"
 #include "SSU.h"
 #include "SSUData.h"
 
@@ -7,23 +11,37 @@ namespace i2p
 namespace ssu
 {
 	SSUData::SSUData (SSUSession& session):
-		m_Session (session)
+		m_Session (session), m_LastCleanupTime (0),
+		m_BandwidthTimer (session.m_Server.GetService ()), m_IsBandwidthTimerScheduled (false),
+		m_ResendTimer (session.m_Server.GetService ()),
+		m_RTT (0), m_RTTVar (0), m_RTO (SSU_INITIAL_RTO), m_CongestionWindow (SSU_INITIAL_CONGESTION_WINDOW),
+		m_SlowStartThreshold (SSU_MAX_CONGESTION_WINDOW), m_NumFragmentsInFlight (0), m_NumResentFragments (0),
+		m_AckTimer (session.m_Server.GetService ()), m_IsAckTimerScheduled (false),
+		m_ProbeMTU (0), m_ProbeMsgID (0), m_NextProbeTime (0)
 	{
+		if (session.GetRemoteEndpoint ().address ().is_v6 ())
+		{
+			m_MTU = SSU_V6_INITIAL_MTU;
+			m_MinMTU = SSU_V6_MIN_MTU;
+			m_MaxMTU = SSU_V6_MAX_MTU;
+			m_HeadersSize = SSU_V6_HEADERS_SIZE;
+		}
+		else
+		{
+			m_MTU = SSU_V4_INITIAL_MTU;
+			m_MinMTU = SSU_V4_MIN_MTU;
+			m_MaxMTU = SSU_V4_MAX_MTU;
+			m_HeadersSize = SSU_V4_HEADERS_SIZE;
+		}
+		m_ProbeMaxMTU = m_MaxMTU + 1; // max is not probed yet
 	}
 
 	SSUData::~SSUData ()
 	{
 		for (auto it: m_IncomleteMessages)
-			if (it.second)
-			{
-				DeleteI2NPMessage (it.second->msg);
-				delete it.second;
-			}	
+			delete it.second;
 		for (auto it: m_SentMessages)
-		{
-			for (auto f: it.second)
-			delete[] f;
-		}	
+			delete it.second;
 	}
 
 	void SSUData::ProcessSentMessageAck (uint32_t msgID)
@@ -31,16 +49,147 @@ namespace ssu
 		auto it = m_SentMessages.find (msgID);
 		if (it != m_SentMessages.end ())
 		{
+			auto sentMessage = it->second;
+			uint64_t ts = i2p::util::GetMillisecondsSinceEpoch ();
+			if (!sentMessage->numResends) // Karn's algorithm, don't measure resent
+				UpdateRTT (ts - sentMessage->sendTime);
+			UpdateCongestionWindow (sentMessage->numUnackedFragments);
+			if (m_ProbeMTU && msgID == m_ProbeMsgID)
+				ProcessMTUProbe (true, ts);
 			// delete all ack-ed message's fragments
-			for (auto f: it->second)
-				delete[] f;
+			delete sentMessage;
 			m_SentMessages.erase (it);	
 		}
 	}		
 
+	void SSUData::ProcessFragmentsAck (uint32_t msgID, const uint8_t * bitfield, size_t len)
+	{
+		auto it = m_SentMessages.find (msgID);
+		if (it == m_SentMessages.end ()) return;
+		auto sentMessage = it->second;
+		int numAcked = 0, numFragments = sentMessage->fragments.size ();
+		for (size_t i = 0; i < len; i++)
+			for (int j = 0; j < 7; j++)
+				if (bitfield[i] & (1 << j))
+				{
+					int fragmentNum = i*7 + j;
+					if (fragmentNum < numFragments && sentMessage->fragments[fragmentNum])
+					{
+						delete sentMessage->fragments[fragmentNum];
+						sentMessage->fragments[fragmentNum] = nullptr;
+						sentMessage->numUnackedFragments--;
+						numAcked++;
+					}
+				}
+		UpdateCongestionWindow (numAcked);
+		if (!sentMessage->numUnackedFragments)
+		{
+			if (m_ProbeMTU && msgID == m_ProbeMsgID)
+				ProcessMTUProbe (true, i2p::util::GetMillisecondsSinceEpoch ());
+			delete sentMessage;
+			m_SentMessages.erase (it);
+		}
+	}
+
+	void SSUData::UpdateRTT (uint64_t rtt)
+	{
+		// RFC 6298
+		if (!m_RTT)
+		{
+			m_RTT = rtt;
+			m_RTTVar = rtt/2.0;
+		}
+		else
+		{
+			m_RTTVar = 0.75*m_RTTVar + 0.25*fabs (m_RTT - rtt);
+			m_RTT = 0.875*m_RTT + 0.125*rtt;
+		}
+		m_RTO = m_RTT + 4*m_RTTVar;
+		if (m_RTO < SSU_MIN_RTO) m_RTO = SSU_MIN_RTO;
+		if (m_RTO > SSU_MAX_RTO) m_RTO = SSU_MAX_RTO;
+	}
+
+	void SSUData::UpdateCongestionWindow (int numAckedFragments)
+	{
+		m_NumFragmentsInFlight -= numAckedFragments;
+		for (int i = 0; i < numAckedFragments; i++)
+		{
+			if (m_CongestionWindow < m_SlowStartThreshold)
+				m_CongestionWindow += 1; // slow start
+			else
+				m_CongestionWindow += 1/m_CongestionWindow; // congestion avoidance
+		}
+		if (m_CongestionWindow > SSU_MAX_CONGESTION_WINDOW)
+			m_CongestionWindow = SSU_MAX_CONGESTION_WINDOW;
+	}
+
+	size_t SSUData::GetPacketSize (size_t mtu) const
+	{
+		return (mtu - m_HeadersSize) & ~0x0F; // multiple of 16, so padding doesn't exceed it
+	}
+
+	void SSUData::SendMTUProbe (uint64_t ts)
+	{
+		if (m_ProbeMaxMTU < m_MTU + SSU_MTU_PROBE_STEP)
+			m_ProbeMaxMTU = m_MaxMTU + 1; // search again after raise interval
+		// try max first, bisect between current and lost size after that
+		m_ProbeMTU = m_ProbeMaxMTU > m_MaxMTU ? m_MaxMTU : (m_MTU + m_ProbeMaxMTU)/2;
+		// Data message filling whole packet, receiver ACKs and drops it
+		size_t len = GetPacketSize (m_ProbeMTU) - sizeof (SSUHeader) - 9 - sizeof (I2NPHeaderShort);
+		uint8_t payload[SSU_MTU];
+		memset (payload, 0, len);
+		*(uint32_t *)payload = htobe32 (len - 4); // size of data
+		I2NPMessage * msg = CreateI2NPMessage (eI2NPData, payload, len);
+		m_ProbeMsgID = be32toh (msg->GetHeader ()->msgID);
+		LogPrint ("SSU MTU probe of ", m_ProbeMTU, " bytes sent");
+		SendMessage (msg);
+	}
+
+	void SSUData::ProcessMTUProbe (bool isAcked, uint64_t ts)
+	{
+		if (isAcked)
+		{
+			m_MTU = m_ProbeMTU;
+			LogPrint ("SSU MTU increased to ", m_MTU);
+		}
+		else
+		{
+			LogPrint ("SSU MTU probe of ", m_ProbeMTU, " bytes lost");
+			m_ProbeMaxMTU = m_ProbeMTU; // binary search
+		}
+		m_ProbeMTU = 0;
+		m_ProbeMsgID = 0;
+		if (m_MTU >= m_MaxMTU || m_ProbeMaxMTU < m_MTU + SSU_MTU_PROBE_STEP)
+			m_NextProbeTime = ts + SSU_MTU_RAISE_INTERVAL; // search is over
+		else
+			m_NextProbeTime = ts + SSU_MTU_PROBE_INTERVAL;
+	}
+
+	void SSUData::DecreaseMTU (uint64_t ts)
+	{
+		// full size fragments don't get through, search between minimal and current
+		m_ProbeMaxMTU = m_MTU;
+		m_MTU = (m_MTU + m_MinMTU)/2;
+		if (m_ProbeMaxMTU < m_MTU + SSU_MTU_PROBE_STEP)
+			m_NextProbeTime = ts + SSU_MTU_RAISE_INTERVAL; // nothing to search
+		else
+			m_NextProbeTime = ts + SSU_MTU_PROBE_INTERVAL;
+		LogPrint ("SSU MTU decreased to ", m_MTU);
+	}
+
 	void SSUData::ProcessMessage (uint8_t * buf, size_t len)
 	{
+		uint64_t ts = i2p::util::GetMillisecondsSinceEpoch ();
+		if (ts > m_LastCleanupTime + SSU_CLEANUP_INTERVAL)
+			Cleanup (ts);
 		//uint8_t * start = buf;
+		// every field is checked against end, packet is dropped if something crosses it
+		const uint8_t * end = buf + len;
+		if (len < 2) // flag and number of fragments
+		{
+			LogPrint ("SSU data packet is too short");
+			return;
+		}
 		uint8_t flag = *buf;
 		buf++;
 		LogPrint ("Process SSU data flags=", (int)flag);
@@ -49,6 +198,11 @@ namespace ssu
 			// explicit ACKs
 			uint8_t numAcks =*buf;
 			buf++;
+			if (end - buf < numAcks*4)
+			{
+				LogPrint ("SSU explicit ACKs exceed packet");
+				return;
+			}
 			for (int i = 0; i < numAcks; i++)
 				ProcessSentMessageAck (be32toh (((uint32_t *)buf)[i]));
 			buf += numAcks*4;
@@ -56,21 +210,50 @@ namespace ssu
 		if (flag & DATA_FLAG_ACK_BITFIELDS_INCLUDED)
 		{
 			// explicit ACK bitfields
+			if (buf >= end)
+			{
+				LogPrint ("SSU number of ACK bitfields exceeds packet");
+				return;
+			}
 			uint8_t numBitfields =*buf;
 			buf++;
 			for (int i = 0; i < numBitfields; i++)
 			{
+				if (end - buf < 5) // msgID and at least one byte of bitfield
+				{
+					LogPrint ("SSU ACK bitfields exceed packet");
+					return;
+				}
+				uint32_t msgID = be32toh (*(uint32_t *)buf);
 				buf += 4; // msgID
-				// TODO: process individual Ack bitfields
-				while (*buf & 0x80) // not last
+				const uint8_t * bitfield = buf;
+				while (buf < end && (*buf & 0x80)) // not last
 					buf++;
+				if (buf >= end)
+				{
+					LogPrint ("SSU ACK bitfield of message ", msgID, " exceeds packet");
+					return;
+				}
 				buf++; // last byte
+				ProcessFragmentsAck (msgID, bitfield, buf - bitfield);
 			}	
 		}	
+		if (flag & (DATA_FLAG_EXPLICIT_ACKS_INCLUDED | DATA_FLAG_ACK_BITFIELDS_INCLUDED))
+			ProcessSendQueue (); // window might be open now
+		if (buf >= end)
+		{
+			LogPrint ("SSU number of fragments exceeds packet");
+			return;
+		}
 		uint8_t numFragments = *buf; // number of fragments
 		buf++;
 		for (int i = 0; i < numFragments; i++)
 		{	
+			if (end - buf < 7) // message ID and fragment info
+			{
+				LogPrint ("SSU fragment header exceeds packet");
+				return;
+			}
 			uint32_t msgID = be32toh (*(uint32_t *)buf); // message ID
 			buf += 4;
 			uint8_t frag[4];
@@ -82,151 +265,520 @@ namespace ssu
 			bool isLast = fragmentInfo & 0x010000; // bit 16	
 			uint8_t fragmentNum = fragmentInfo >> 17; // bits 23 - 17
 			LogPrint ("SSU data fragment ", (int)fragmentNum, " of message ", msgID, " size=", (int)fragmentSize, isLast ? " last" : " non-last"); 		
-			I2NPMessage * msg = nullptr;
-			if (fragmentNum > 0) // follow-up fragment
+			if (end - buf < fragmentSize)
+			{
+				LogPrint ("SSU fragment ", (int)fragmentNum, " of message ", msgID, " exceeds packet");
+				return;
+			}
+			if (m_ReceivedMessages.count (msgID))
+			{
+				// our ACK was lost
+				LogPrint ("SSU message ", msgID, " already received");
+				SendMsgAck (msgID);
+			}
+			else if (!fragmentNum && isLast)
 			{
+				// single fragment message
+				if (fragmentSize < sizeof (I2NPHeaderShort))
+				{
+					LogPrint ("SSU message ", msgID, " is too short");
+					return;
+				}
+				I2NPMessage * msg = NewI2NPMessage (fragmentSize);
+				memcpy (msg->GetSSUHeader (), buf, fragmentSize);
+				msg->len += fragmentSize - sizeof (I2NPHeaderShort);
+				HandleCompleteMessage (msgID, msg);
+			}
+			else
+			{
+				IncompleteMessage * incompleteMessage = nullptr;
 				auto it = m_IncomleteMessages.find (msgID);
 				if (it != m_IncomleteMessages.end ())
+					incompleteMessage = it->second;
+				else
 				{
-					if (fragmentNum == it->second->nextFragmentNum)
-					{
-						// expected fragment
-						msg = it->second->msg;
-						memcpy (msg->buf + msg->len, buf, fragmentSize);
-						msg->len += fragmentSize;
-						it->second->nextFragmentNum++;
-					}	
-					else if (fragmentNum < it->second->nextFragmentNum)
-						// duplicate fragment
-						LogPrint ("Duplicate fragment ", (int)fragmentNum, " of message ", msgID, ". Ignored");	
-					else
-					{
-						// missing fragment
-						LogPrint ("Missing fragments from ", it->second->nextFragmentNum, " to ", fragmentNum - 1, " of message ", msgID);	
-						//TODO
-					}	
- 						
-					if (isLast)
+					incompleteMessage = new IncompleteMessage (ts);
+					it = m_IncomleteMessages.insert (std::make_pair (msgID, incompleteMessage)).first;
+				}
+				bool sendAck = isLast;
+				if (fragmentNum == incompleteMessage->nextFragmentNum)
+				{
+					// expected fragment
+					if (!AppendFragment (incompleteMessage, fragmentNum, buf, fragmentSize))
+						incompleteMessage->isBroken = true;
+					incompleteMessage->nextFragmentNum++;
+					// fragments received before
+					auto& saved = incompleteMessage->savedFragments;
+					while (!saved.empty () && saved.begin ()->first == incompleteMessage->nextFragmentNum)
 					{
-						if (!msg)	
-							DeleteI2NPMessage (it->second->msg);
-						delete it->second;
-						m_IncomleteMessages.erase (it);
+						auto& fragment = saved.begin ()->second;
+						if (!AppendFragment (incompleteMessage, incompleteMessage->nextFragmentNum, fragment.data (), fragment.size ()))
+							incompleteMessage->isBroken = true;
+						saved.erase (saved.begin ());
+						incompleteMessage->nextFragmentNum++;
 					}	
 				}
+				else if (fragmentNum > incompleteMessage->nextFragmentNum)
+				{
+					// missing fragments, keep this one till they come
+					if (!incompleteMessage->savedFragments.count (fragmentNum))
+						incompleteMessage->savedFragments[fragmentNum].assign (buf, buf + fragmentSize);
+					sendAck = true;
+				}
 				else
-					// TODO:
-					LogPrint ("Unexpected follow-on fragment ", (int)fragmentNum, " of message ", msgID);	
-			}
-			else // first fragment
-			{
-				msg = NewI2NPMessage ();
-				memcpy (msg->GetSSUHeader (), buf, fragmentSize);
-				msg->len += fragmentSize - sizeof (I2NPHeaderShort);
-			}
-
-			if (msg)
-			{					
-				if (!fragmentNum && !isLast)
-					m_IncomleteMessages[msgID] = new IncompleteMessage (msg);
+				{
+					LogPrint ("Duplicate fragment ", (int)fragmentNum, " of message ", msgID);
+					sendAck = true;
+				}
 				if (isLast)
+					incompleteMessage->lastFragmentNum = fragmentNum;
+
+				if (incompleteMessage->lastFragmentNum >= 0 &&
+					incompleteMessage->nextFragmentNum > incompleteMessage->lastFragmentNum)
 				{
-					SendMsgAck (msgID);
-					msg->FromSSU (msgID);
-					if (m_Session.GetState () == eSessionStateEstablished)
-						i2p::HandleI2NPMessage (msg);
-					else
+					// all fragments received
+					I2NPMessage * msg = incompleteMessage->msg;
+					incompleteMessage->msg = nullptr;
+					bool isBroken = incompleteMessage->isBroken;
+					delete incompleteMessage;
+					m_IncomleteMessages.erase (it);
+					if (isBroken)
 					{
-						// we expect DeliveryStatus
-						if (msg->GetHeader ()->typeID == eI2NPDeliveryStatus)
-						{
-							LogPrint ("SSU session established");
-							m_Session.Established ();
-						}	
-						else
-							LogPrint ("SSU unexpected message ", (int)msg->GetHeader ()->typeID);
+						LogPrint ("SSU message ", msgID, " exceeds max I2NP message size. Dropped");
 						DeleteI2NPMessage (msg);
+						msg = nullptr;
 					}	
+					HandleCompleteMessage (msgID, msg);
 				}
+				else if (sendAck)
+					// tell which fragments we have
+					SendFragmentsAck (msgID);
 			}
 			buf += fragmentSize;
 		}	
 	}
 
+	bool SSUData::AppendFragment (IncompleteMessage * incompleteMessage, int fragmentNum, const uint8_t * buf, size_t len)
+	{
+		if (!fragmentNum)
+		{
+			incompleteMessage->msg = NewI2NPMessage ();
+			memcpy (incompleteMessage->msg->GetSSUHeader (), buf, len);
+			incompleteMessage->msg->len += len - sizeof (I2NPHeaderShort);
+			return true;
+		}
+		I2NPMessage * msg = incompleteMessage->msg;
+		if (!msg || msg->len + len > msg->maxLen)
+			return false;
+		memcpy (msg->buf + msg->len, buf, len);
+		msg->len += len;
+		return true;
+	}
+
+	void SSUData::HandleCompleteMessage (uint32_t msgID, I2NPMessage * msg)
+	{
+		m_ReceivedMessages.insert (msgID);
+		m_ReceivedMessagesTimes.push_back (std::make_pair (i2p::util::GetMillisecondsSinceEpoch (), msgID));
+		SendMsgAck (msgID);
+		if (!msg) return;
+		msg->FromSSU (msgID);
+		if (i2p::transports.IsReplayedMessage (msg))
+		{
+			LogPrint ("SSU duplicate message ", msgID, " dropped");
+			DeleteI2NPMessage (msg);
+		}
+		else if (m_Session.GetState () == eSessionStateEstablished)
+			i2p::HandleI2NPMessage (msg);
+		else
+		{
+			// we expect DeliveryStatus
+			if (msg->GetHeader ()->typeID == eI2NPDeliveryStatus)
+			{
+				LogPrint ("SSU session established");
+				m_Session.Established ();
+			}
+			else
+				LogPrint ("SSU unexpected message ", (int)msg->GetHeader ()->typeID);
+			DeleteI2NPMessage (msg);
+		}
+	}
+
+	void SSUData::Cleanup (uint64_t ts)
+	{
+		for (auto it = m_IncomleteMessages.begin (); it != m_IncomleteMessages.end ();)
+		{
+			if (ts > it->second->receivedTime + SSU_INCOMPLETE_MESSAGE_TIMEOUT)
+			{
+				LogPrint ("SSU message ", it->first, " was not completed in ", SSU_INCOMPLETE_MESSAGE_TIMEOUT/1000, " seconds. Deleted");
+				delete it->second;
+				it = m_IncomleteMessages.erase (it);
+			}
+			else
+				it++;
+		}
+		while (!m_ReceivedMessagesTimes.empty () &&
+			ts > m_ReceivedMessagesTimes.front ().first + SSU_RECEIVED_MESSAGE_TIMEOUT)
+		{
+			m_ReceivedMessages.erase (m_ReceivedMessagesTimes.front ().second);
+			m_ReceivedMessagesTimes.pop_front ();
+		}
+		m_LastCleanupTime = ts;
+	}
+
 	void SSUData::Send (i2p::I2NPMessage * msg)
 	{
-		uint32_t msgID = msg->ToSSU ();
+		uint32_t msgID = be32toh (msg->GetHeader ()->msgID);
 		if (m_SentMessages.count (msgID) > 0)
 		{
 			LogPrint ("SSU message ", msgID, " already sent");
 			DeleteI2NPMessage (msg);
 			return;
 		}		
-		auto fragments = m_SentMessages[msgID];
-		msgID = htobe32 (msgID);	
-		size_t payloadSize = SSU_MTU - sizeof (SSUHeader) - 9; // 9  =  flag + #frg(1) + messageID(4) + frag info (3) 
-		size_t len = msg->GetLength ();
-		uint8_t * msgBuf = msg->GetSSUHeader ();
+		uint64_t ts = i2p::util::GetMillisecondsSinceEpoch ();
+		if (!m_ProbeMTU && m_MTU < m_MaxMTU && ts >= m_NextProbeTime && m_Session.GetState () == eSessionStateEstablished)
+			SendMTUProbe (ts);
+		if (!m_SendQueue.IsEmpty () || m_NumFragmentsInFlight >= (int)m_CongestionWindow)
+		{
+			// wait for ACKs
+			m_SendQueue.Put (msg);
+			return;
+		}
+		int delay = i2p::transports.GetBandwidthLimiter ().GetOutbound ().GetDelay ();
+		if (delay > 0)
+		{
+			m_SendQueue.Put (msg);
+			ScheduleSendQueue (delay);
+			return;
+		}
+		SendMessage (msg);
+	}
+
+	void SSUData::ProcessSendQueue ()
+	{
+		auto& outbound = i2p::transports.GetBandwidthLimiter ().GetOutbound ();
+		while (!m_SendQueue.IsEmpty () && m_NumFragmentsInFlight < (int)m_CongestionWindow)
+		{
+			int delay = outbound.GetDelay ();
+			if (delay > 0)
+			{
+				ScheduleSendQueue (delay);
+				break;
+			}
+			I2NPMessage * msg = m_SendQueue.Get (); // next by priority, expired are dropped
+			if (!msg) break;
+			SendMessage (msg);
+		}
+	}
+
+	void SSUData::ScheduleSendQueue (int delay)
+	{
+		if (!m_IsBandwidthTimerScheduled)
+		{
+			m_IsBandwidthTimerScheduled = true;
+			m_BandwidthTimer.expires_from_now (boost::posix_time::milliseconds (delay));
+			m_BandwidthTimer.async_wait (boost::bind (&SSUData::HandleBandwidthTimer,
+				this, boost::asio::placeholders::error));
+		}
+	}
 
+	void SSUData::HandleBandwidthTimer (const boost::system::error_code& ecode)
+	{
+		if (ecode == boost::asio::error::operation_aborted) return;
+		m_IsBandwidthTimerScheduled = false;
+		ProcessSendQueue ();
+	}
+
+	void SSUData::SendMessage (i2p::I2NPMessage * msg)
+	{
+		I2NPHeader * header = msg->GetHeader ();
+		uint32_t msgID = be32toh (header->msgID);
+		uint64_t ts = i2p::util::GetMillisecondsSinceEpoch ();
+		auto sentMessage = new SentMessage (ts);
+		sentMessage->nextResendTime = ts + m_RTO;
+		m_SentMessages[msgID] = sentMessage;
+		size_t packetSize = GetPacketSize (m_ProbeMTU && msgID == m_ProbeMsgID ? m_ProbeMTU : m_MTU);
+		size_t payloadSize = packetSize - sizeof (SSUHeader) - 9; // 9  =  flag + #frg(1) + messageID(4) + frag info (3) 
+		size_t len = sizeof (I2NPHeaderShort) + be16toh (header->size);
+		// fragments are copied for resend anyway, so message is not converted to SSU in place
+		I2NPHeaderShort ssuHeader;
+		ssuHeader.typeID = header->typeID;
+		ssuHeader.shortExpiration = htobe32 (be64toh (header->expiration)/1000LL);
+		const uint8_t * msgBuf = msg->GetSSUHeader ();
 		uint32_t fragmentNum = 0;
 		while (len > 0)
-		{	
-			uint8_t * buf = new uint8_t[SSU_MTU + 18];
-			fragments.push_back (buf);
-			uint8_t	* payload = buf + sizeof (SSUHeader);
-			*payload = DATA_FLAG_WANT_REPLY; // for compatibility
-			payload++;
-			*payload = 1; // always 1 message fragment per message
-			payload++;
-			*(uint32_t *)payload = msgID;
-			payload += 4;
+		{
+			auto fragment = new Fragment;
+			uint8_t * buf = fragment->buf;
 			bool isLast = (len <= payloadSize);
 			size_t size = isLast ? len : payloadSize;
-			uint32_t fragmentInfo = (fragmentNum << 17);
-			if (isLast)
-				fragmentInfo |= 0x010000;
-			
-			fragmentInfo |= size;
-			fragmentInfo = htobe32 (fragmentInfo);
-			memcpy (payload, (uint8_t *)(&fragmentInfo) + 1, 3);
-			payload += 3;
+			uint8_t	* payload = buf + sizeof (SSUHeader);
+			payload += FillFragmentHeader (payload, msgID, fragmentNum, isLast, size);
 			memcpy (payload, msgBuf, size);
-			
-			size += payload - buf;
-			if (size & 0x0F) // make sure 16 bytes boundary
-				size = ((size >> 4) + 1) << 4; // (/16 + 1)*16
-			
-			// encrypt message with session key
-			m_Session.FillHeaderAndEncrypt (PAYLOAD_TYPE_DATA, buf, size);
-			m_Session.Send (buf, size);
+			if (!fragmentNum)
+				memcpy (payload, &ssuHeader, sizeof (I2NPHeaderShort));
+			fragment->len = size + (payload - buf);
+			sentMessage->fragments.push_back (fragment);
+			SendFragment (fragment);
 
 			if (!isLast)
-			{	
+			{
 				len -= payloadSize;
 				msgBuf += payloadSize;
-			}	
+			}
 			else
 				len = 0;
 			fragmentNum++;
-		}	
+		}
+		sentMessage->numUnackedFragments = sentMessage->fragments.size ();
+		m_NumFragmentsInFlight += sentMessage->numUnackedFragments;
 		DeleteI2NPMessage (msg);
-	}		
-
-	void SSUData::SendMsgAck (uint32_t msgID)
+		if (m_SentMessages.size () == 1) // timer is not running
+			ScheduleResend ();
+	}
+			
+	void SSUData::SendFragment (const Fragment * fragment)
 	{
-		uint8_t buf[48 + 18]; // actual length is 44 = 37 + 7 but pad it to multiple of 16
+		uint8_t buf[SSU_MTU + 18];
 		uint8_t * payload = buf + sizeof (SSUHeader);
-		*payload = DATA_FLAG_EXPLICIT_ACKS_INCLUDED; // flag
+		const uint8_t * fragmentPayload = fragment->buf + sizeof (SSUHeader);
+		uint8_t flag = *fragmentPayload;
+		payload++; fragmentPayload++; // flag
+		// piggyback pending ACKs if there is room
+		int numAcks = m_PendingAcks.size () + m_PendingFragmentsAcks.size ();
+		size_t packetSize = GetPacketSize (m_MTU); // fragment might be bigger if MTU has been decreased
+		payload += FillAcks (payload, packetSize > fragment->len ? packetSize - fragment->len : 0, flag);
+		numAcks -= m_PendingAcks.size () + m_PendingFragmentsAcks.size ();
+		buf[sizeof (SSUHeader)] = flag;
+		size_t fragmentLen = fragment->len - (fragmentPayload - fragment->buf);
+		memcpy (payload, fragmentPayload, fragmentLen);
+		size_t size = payload + fragmentLen - buf;
+		if (size & 0x0F) // make sure 16 bytes boundary
+			size = ((size >> 4) + 1) << 4; // (/16 + 1)*16
+		// encrypt copy with session key
+		m_Session.FillHeaderAndEncrypt (PAYLOAD_TYPE_DATA, buf, size);
+		m_Session.Send (buf, size);
+		m_Session.m_Server.UpdateSentPacketsStats (true, numAcks);
+	}
+
+	size_t SSUData::FillFragmentHeader (uint8_t * payload, uint32_t msgID, uint32_t fragmentNum, bool isLast, size_t size)
+	{
+		*payload = DATA_FLAG_WANT_REPLY; // for compatibility
 		payload++;
-		*payload = 1; // number of ACKs
+		*payload = 1; // always 1 message fragment per message
 		payload++;
-		*(uint32_t *)(payload) = htobe32 (msgID); // msgID	
+		*(uint32_t *)payload = htobe32 (msgID);
 		payload += 4;
-		*payload = 0; // number of fragments
+		uint32_t fragmentInfo = (fragmentNum << 17);
+		if (isLast)
+			fragmentInfo |= 0x010000;
+		fragmentInfo |= size;
+		fragmentInfo = htobe32 (fragmentInfo);
+		memcpy (payload, (uint8_t *)(&fragmentInfo) + 1, 3);
+		return 9;
+	}	
+
+	void SSUData::SendMsgAck (uint32_t msgID)
+	{
+		m_PendingAcks.push_back (msgID);
+		if (m_PendingAcks.size () >= SSU_MAX_NUM_PENDING_ACKS)
+			SendAcks ();
+		else
+			ScheduleAcks ();
+	}
+
+	void SSUData::SendFragmentsAck (uint32_t msgID)
+	{
+		// bitfield is built when sent
+		m_PendingFragmentsAcks.insert (msgID);
+		ScheduleAcks ();
+	}
 
-		// encrypt message with session key
-		m_Session.FillHeaderAndEncrypt (PAYLOAD_TYPE_DATA, buf, 48);
-		m_Session.Send (buf, 48);
+	void SSUData::ScheduleAcks ()
+	{
+		if (!m_IsAckTimerScheduled)
+		{
+			m_IsAckTimerScheduled = true;
+			m_AckTimer.expires_from_now (boost::posix_time::milliseconds (SSU_DELAYED_ACK_INTERVAL));
+			m_AckTimer.async_wait (boost::bind (&SSUData::HandleAckTimer,
+				this, boost::asio::placeholders::error));
+		}
+	}
+
+	void SSUData::HandleAckTimer (const boost::system::error_code& ecode)
+	{
+		if (ecode == boost::asio::error::operation_aborted) return;
+		m_IsAckTimerScheduled = false;
+		SendAcks ();
+	}
+
+	void SSUData::SendAcks ()
+	{
+		// ACKs were not piggybacked, pack them into as few packets as possible
+		while (!m_PendingAcks.empty () || !m_PendingFragmentsAcks.empty ())
+		{
+			uint8_t buf[SSU_MTU + 18];
+			uint8_t * payload = buf + sizeof (SSUHeader);
+			uint8_t flag = 0;
+			int numAcks = m_PendingAcks.size () + m_PendingFragmentsAcks.size ();
+			payload += 1 + FillAcks (payload + 1, GetPacketSize (m_MTU) - sizeof (SSUHeader) - 2, flag); // flag and number of fragments
+			numAcks -= m_PendingAcks.size () + m_PendingFragmentsAcks.size ();
+			if (!flag) continue; // pending bitfields of completed messages only
+			buf[sizeof (SSUHeader)] = flag;
+			*payload = 0; // number of fragments
+			payload++;
+			size_t size = payload - buf;
+			if (size & 0x0F) // make sure 16 bytes boundary
+				size = ((size >> 4) + 1) << 4; // (/16 + 1)*16
+
+			// encrypt message with session key
+			m_Session.FillHeaderAndEncrypt (PAYLOAD_TYPE_DATA, buf, size);
+			m_Session.Send (buf, size);
+			m_Session.m_Server.UpdateSentPacketsStats (false, numAcks);
+		}
+	}
+
+	size_t SSUData::FillAcks (uint8_t * buf, size_t len, uint8_t& flag)
+	{
+		uint8_t * start = buf;
+		if (!m_PendingAcks.empty () && len >= 5) // number of ACKs and one ACK
+		{
+			size_t numAcks = (len - 1)/4;
+			if (numAcks > m_PendingAcks.size ()) numAcks = m_PendingAcks.size ();
+			if (numAcks > 255) numAcks = 255;
+			*buf = numAcks;
+			buf++;
+			for (size_t i = 0; i < numAcks; i++)
+			{
+				*(uint32_t *)buf = htobe32 (m_PendingAcks[i]);
+				buf += 4;
+			}
+			m_PendingAcks.erase (m_PendingAcks.begin (), m_PendingAcks.begin () + numAcks);
+			flag |= DATA_FLAG_EXPLICIT_ACKS_INCLUDED;
+		}
+		if (!m_PendingFragmentsAcks.empty () && len >= (size_t)(buf - start) + 6) // number of bitfields, msgID and one byte
+		{
+			uint8_t * numBitfields = buf;
+			*numBitfields = 0;
+			buf++;
+			for (auto it = m_PendingFragmentsAcks.begin (); it != m_PendingFragmentsAcks.end ();)
+			{
+				auto incompleteMessage = m_IncomleteMessages.find (*it);
+				if (incompleteMessage == m_IncomleteMessages.end ())
+				{
+					// completed or deleted already
+					it = m_PendingFragmentsAcks.erase (it);
+					continue;
+				}
+				uint8_t bitfield[19]; // 128 fragments max
+				size_t bitfieldLen = FillBitfield (incompleteMessage->second, bitfield);
+				if (len < (size_t)(buf - start) + 4 + bitfieldLen || *numBitfields == 255) break;
+				*(uint32_t *)buf = htobe32 (*it);
+				buf += 4;
+				memcpy (buf, bitfield, bitfieldLen);
+				buf += bitfieldLen;
+				(*numBitfields)++;
+				it = m_PendingFragmentsAcks.erase (it);
+			}
+			if (*numBitfields)
+				flag |= DATA_FLAG_ACK_BITFIELDS_INCLUDED;
+			else
+				buf--;
+		}
+		return buf - start;
+	}
+
+	size_t SSUData::FillBitfield (const IncompleteMessage * incompleteMessage, uint8_t * bitfield) const
+	{
+		// 7 fragments per byte, high bit means next byte follows
+		int maxFragmentNum = incompleteMessage->nextFragmentNum - 1;
+		if (!incompleteMessage->savedFragments.empty ())
+			maxFragmentNum = incompleteMessage->savedFragments.rbegin ()->first;
+		int numBytes = maxFragmentNum/7 + 1;
+		memset (bitfield, 0, numBytes);
+		for (int i = 0; i < incompleteMessage->nextFragmentNum; i++)
+			bitfield[i/7] |= 1 << (i % 7);
+		for (auto& it: incompleteMessage->savedFragments)
+			bitfield[it.first/7] |= 1 << (it.first % 7);
+		for (int i = 0; i < numBytes - 1; i++)
+			bitfield[i] |= 0x80;
+		return numBytes;
+	}
+
+	void SSUData::ScheduleResend ()
+	{
+		if (m_SentMessages.empty ()) return;
+		uint64_t nextResendTime = m_SentMessages.begin ()->second->nextResendTime;
+		for (auto it: m_SentMessages)
+			if (it.second->nextResendTime < nextResendTime)
+				nextResendTime = it.second->nextResendTime;
+		uint64_t ts = i2p::util::GetMillisecondsSinceEpoch ();
+		m_ResendTimer.expires_from_now (boost::posix_time::milliseconds (nextResendTime > ts ? nextResendTime - ts : 0));
+		m_ResendTimer.async_wait (boost::bind (&SSUData::HandleResendTimer,
+			this, boost::asio::placeholders::error));
+	}
+
+	void SSUData::HandleResendTimer (const boost::system::error_code& ecode)
+	{
+		if (ecode == boost::asio::error::operation_aborted) return;
+		uint64_t ts = i2p::util::GetMillisecondsSinceEpoch ();
+		bool isLost = false;
+		for (auto it = m_SentMessages.begin (); it != m_SentMessages.end ();)
+		{
+			auto sentMessage = it->second;
+			if (ts >= sentMessage->nextResendTime)
+			{
+				if (m_ProbeMTU && it->first == m_ProbeMsgID)
+				{
+					// probe is not resent, it's too big for the path most likely
+					m_NumFragmentsInFlight -= sentMessage->numUnackedFragments;
+					delete sentMessage;
+					it = m_SentMessages.erase (it);
+					ProcessMTUProbe (false, ts);
+					continue;
+				}
+				isLost = true;
+				if (sentMessage->numResends < SSU_MAX_NUM_RESENDS)
+				{
+					// resend fragments not ACKed yet
+					for (auto fragment: sentMessage->fragments)
+						if (fragment)
+						{
+							SendFragment (fragment);
+							m_NumResentFragments++;
+						}
+					sentMessage->numResends++;
+					if (sentMessage->numResends == SSU_MTU_BLACK_HOLE_RESENDS && m_MTU > m_MinMTU)
+						for (auto fragment: sentMessage->fragments)
+							if (fragment && fragment->len >= GetPacketSize (m_MTU))
+							{
+								DecreaseMTU (ts);
+								break;
+							}
+					int timeout = m_RTO << sentMessage->numResends; // backoff
+					if (timeout > SSU_MAX_RTO) timeout = SSU_MAX_RTO;
+					sentMessage->nextResendTime = ts + timeout;
+				}
+				else
+				{
+					LogPrint ("SSU message ", it->first, " was not ACKed after ", SSU_MAX_NUM_RESENDS, " resends. Dropped");
+					m_NumFragmentsInFlight -= sentMessage->numUnackedFragments;
+					delete sentMessage;
+					it = m_SentMessages.erase (it);
+					continue;
+				}
+			}
+			it++;
+		}
+		if (isLost)
+		{
+			// congestion, once per timer
+			m_SlowStartThreshold = m_CongestionWindow/2;
+			if (m_SlowStartThreshold < SSU_MIN_CONGESTION_WINDOW)
+				m_SlowStartThreshold = SSU_MIN_CONGESTION_WINDOW;
+			m_CongestionWindow = m_SlowStartThreshold;
+		}
+		ProcessSendQueue ();
+		ScheduleResend ();
 	}
 }
 }
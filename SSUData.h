@@ -3,14 +3,47 @@
 
 #include <inttypes.h>
 #include <map>
+#include <set>
+#include <list>
+#include <deque>
 #include <vector>
+#include <boost/asio.hpp>
 #include "I2NPProtocol.h"
+#include "OutboundQueue.h"
 
 namespace i2p
 {
 namespace ssu
 {
 
+	const size_t SSU_MTU = 1484; // max packet size
+	// path MTU, includes IP and UDP headers as in SSU spec
+	const size_t SSU_V4_MAX_MTU = 1484;
+	const size_t SSU_V4_MIN_MTU = 620;
+	const size_t SSU_V4_INITIAL_MTU = 1484; // backed off on loss
+	const size_t SSU_V4_HEADERS_SIZE = 28; // IP + UDP
+	const size_t SSU_V6_MAX_MTU = 1488;
+	const size_t SSU_V6_MIN_MTU = 1280;
+	const size_t SSU_V6_INITIAL_MTU = 1280; // guaranteed by IPv6, probed up
+	const size_t SSU_V6_HEADERS_SIZE = 48; // IP + UDP
+	const size_t SSU_MTU_PROBE_STEP = 32; // search stops if interval is smaller
+	const int SSU_MTU_PROBE_INTERVAL = 5000; // in milliseconds, between probes of one search
+	const int SSU_MTU_RAISE_INTERVAL = 600000; // in milliseconds, before next search for bigger MTU
+	const int SSU_MTU_BLACK_HOLE_RESENDS = 2; // MTU is decreased if full size fragment is resent that many times
+	// reliability
+	const int SSU_INITIAL_RTO = 1000; // in milliseconds
+	const int SSU_MIN_RTO = 200; // in milliseconds
+	const int SSU_MAX_RTO = 3000; // in milliseconds
+	const int SSU_MAX_NUM_RESENDS = 5;
+	const int SSU_INITIAL_CONGESTION_WINDOW = 8; // in fragments
+	const int SSU_MIN_CONGESTION_WINDOW = 2; // in fragments
+	const int SSU_MAX_CONGESTION_WINDOW = 256; // in fragments
+	const int SSU_INCOMPLETE_MESSAGE_TIMEOUT = 30000; // in milliseconds
+	const int SSU_RECEIVED_MESSAGE_TIMEOUT = 30000; // in milliseconds, re-ACK duplicates till then
+	const int SSU_CLEANUP_INTERVAL = 10000; // in milliseconds
+	const int SSU_DELAYED_ACK_INTERVAL = 50; // in milliseconds
+	const size_t SSU_MAX_NUM_PENDING_ACKS = 64; // sent without delay above it
+
 	// data flags
 	const uint8_t DATA_FLAG_EXTENDED_DATA_INCLUDED = 0x02;
 	const uint8_t DATA_FLAG_WANT_REPLY = 0x04;
@@ -30,24 +63,101 @@ namespace ssu
 			void ProcessMessage (uint8_t * buf, size_t len);
 			void Send (i2p::I2NPMessage * msg);
 
+			int GetRTO () const { return m_RTO; };
+			int GetCongestionWindow () const { return m_CongestionWindow; };
+			uint64_t GetNumResentFragments () const { return m_NumResentFragments; };
+			size_t GetMTU () const { return m_MTU; };
+
 		private:
 
-			void SendMsgAck (uint32_t msgID);
-			void ProcessSentMessageAck (uint32_t msgID);
+			struct Fragment
+			{
+				size_t len; // without padding, ACKs might be added
+				uint8_t buf[SSU_MTU + 18]; // not encrypted, IV and MAC are new for every send
+			};
 
-		private:
+			struct SentMessage
+			{
+				std::vector<Fragment *> fragments; // nullptr if ACKed
+				int numUnackedFragments;
+				uint64_t sendTime, nextResendTime; // in milliseconds
+				int numResends;
+
+				SentMessage (uint64_t ts): numUnackedFragments (0), sendTime (ts), nextResendTime (0), numResends (0) {};
+				~SentMessage () { for (auto it: fragments) delete it; };
+			};
 
 			struct IncompleteMessage
 			{
-				I2NPMessage * msg;
-				uint8_t nextFragmentNum;	
+				I2NPMessage * msg; // created when first fragment arrives
+				int nextFragmentNum, lastFragmentNum; // lastFragmentNum is -1 until last fragment arrives
+				bool isBroken;
+				uint64_t receivedTime; // in milliseconds
+				std::map<int, std::vector<uint8_t> > savedFragments; // received out of order
 
-				IncompleteMessage (I2NPMessage * m): msg (m), nextFragmentNum (1) {};
+				IncompleteMessage (uint64_t ts): msg (nullptr), nextFragmentNum (0), lastFragmentNum (-1),
+					isBroken (false), receivedTime (ts) {};
+				~IncompleteMessage () { DeleteI2NPMessage (msg); };
 			};
 
+			void SendMessage (i2p::I2NPMessage * msg);
+			void SendFragment (const Fragment * fragment);
+			void SendMsgAck (uint32_t msgID); // delayed
+			void SendFragmentsAck (uint32_t msgID); // delayed
+			void SendAcks (); // pending
+			size_t FillAcks (uint8_t * buf, size_t len, uint8_t& flag); // returns length of pending ACKs fit into len
+			size_t FillBitfield (const IncompleteMessage * incompleteMessage, uint8_t * bitfield) const;
+			void ScheduleAcks ();
+			void HandleAckTimer (const boost::system::error_code& ecode);
+			size_t FillFragmentHeader (uint8_t * payload, uint32_t msgID, uint32_t fragmentNum, bool isLast, size_t size); // returns header length
+			void ProcessSentMessageAck (uint32_t msgID);
+			void ProcessFragmentsAck (uint32_t msgID, const uint8_t * bitfield, size_t len);
+			void ProcessSendQueue ();
+			void ScheduleSendQueue (int delay); // till outbound bandwidth is available
+			void HandleBandwidthTimer (const boost::system::error_code& ecode);
+			void UpdateRTT (uint64_t rtt);
+			void UpdateCongestionWindow (int numAckedFragments);
+
+			size_t GetPacketSize (size_t mtu) const; // max SSU packet for MTU
+			void SendMTUProbe (uint64_t ts);
+			void ProcessMTUProbe (bool isAcked, uint64_t ts);
+			void DecreaseMTU (uint64_t ts);
+
+			bool AppendFragment (IncompleteMessage * incompleteMessage, int fragmentNum, const uint8_t * buf, size_t len);
+			void HandleCompleteMessage (uint32_t msgID, I2NPMessage * msg);
+			void Cleanup (uint64_t ts);
+
+			void ScheduleResend ();
+			void HandleResendTimer (const boost::system::error_code& ecode);
+
+		private:
+
 			SSUSession& m_Session;
 			std::map<uint32_t, IncompleteMessage *> m_IncomleteMessages;
-			std::map<uint32_t, std::vector<uint8_t *> > m_SentMessages; // msgID -> fragments	
+			std::set<uint32_t> m_ReceivedMessages;
+			std::deque<std::pair<uint64_t, uint32_t> > m_ReceivedMessagesTimes; // time, msgID
+			uint64_t m_LastCleanupTime;
+
+			std::map<uint32_t, SentMessage *> m_SentMessages; // msgID -> fragments
+			i2p::OutboundQueue m_SendQueue; // waiting for congestion window or bandwidth
+			boost::asio::deadline_timer m_BandwidthTimer;
+			bool m_IsBandwidthTimerScheduled;
+			boost::asio::deadline_timer m_ResendTimer;
+			double m_RTT, m_RTTVar; // smoothed, in milliseconds
+			int m_RTO; // in milliseconds
+			double m_CongestionWindow, m_SlowStartThreshold; // in fragments
+			int m_NumFragmentsInFlight;
+			uint64_t m_NumResentFragments;
+
+			std::vector<uint32_t> m_PendingAcks; // completed messages
+			std::set<uint32_t> m_PendingFragmentsAcks; // incomplete messages
+			boost::asio::deadline_timer m_AckTimer;
+			bool m_IsAckTimerScheduled;
+
+			size_t m_MTU, m_MinMTU, m_MaxMTU, m_HeadersSize; // current, limits and IP + UDP for address family
+			size_t m_ProbeMaxMTU, m_ProbeMTU; // smallest lost size (max + 1 if none) and probe in flight (0 if none)
+			uint32_t m_ProbeMsgID;
+			uint64_t m_NextProbeTime; // in milliseconds
 	};	
 }
 }
@@ -15,7 +15,7 @@ namespace tunnel
 	    const uint8_t * nextIdent, uint32_t nextTunnelID, 
 		const uint8_t * layerKey,const uint8_t * ivKey): 
 			m_TunnelID (receiveTunnelID),  m_NextTunnelID (nextTunnelID), 
-			m_NextIdent (nextIdent), m_NumTransmittedBytes (0)
+			m_NextIdent (nextIdent), m_NumTransmittedBytes (0), m_NumDroppedBytes (0)
 	{	
 		m_Encryption.SetKeys (layerKey, ivKey);
 	}	
@@ -27,12 +27,39 @@ namespace tunnel
 	
 	void TransitTunnel::HandleTunnelDataMsg (i2p::I2NPMessage * tunnelMsg)
 	{
+		if (IsBandwidthExceeded (tunnelMsg->GetLength ()))
+		{
+			i2p::DeleteI2NPMessage (tunnelMsg); // before encryption
+			return;
+		}
 		EncryptTunnelMsg (tunnelMsg);
-		
+		HandleEncryptedTunnelDataMsg (tunnelMsg);
+	}
+
+	bool TransitTunnel::IsBandwidthExceeded (size_t len)
+	{
+		auto& limiter = i2p::transports.GetBandwidthLimiter ();
+		uint32_t rate = limiter.GetTransitTunnelRate ();
+		if (rate != m_Bandwidth.GetRate ()) // number of transit tunnels has changed
+			m_Bandwidth.SetRate (rate);
+		// check both before consuming, dropped message must not use up tunnel's quota
+		auto& transit = limiter.GetTransit ();
+		if (!m_Bandwidth.IsAvailable () || !transit.IsAvailable ())
+		{
+			m_NumDroppedBytes += len;
+			return true;
+		}
+		m_Bandwidth.ForceConsume (len);
+		transit.ForceConsume (len);
+		return false;
+	}
+
+	void TransitTunnel::HandleEncryptedTunnelDataMsg (i2p::I2NPMessage * tunnelMsg)
+	{
 		LogPrint ("TransitTunnel: ",m_TunnelID,"->", m_NextTunnelID);
 		*(uint32_t *)(tunnelMsg->GetPayload ()) = htobe32 (m_NextTunnelID);
 		FillI2NPMessageHeader (tunnelMsg, eI2NPTunnelData);
-	
+		tunnelMsg->isTransit = true;
 		i2p::transports.SendMessage (m_NextIdent, tunnelMsg);	
 		m_NumTransmittedBytes += tunnelMsg->GetLength ();
 	}
@@ -45,6 +72,11 @@ namespace tunnel
 
 	void TransitTunnelGateway::SendTunnelDataMsg (i2p::I2NPMessage * msg)
 	{
+		if (IsBandwidthExceeded (msg->GetLength ()))
+		{
+			i2p::DeleteI2NPMessage (msg);
+			return;
+		}
 		TunnelMessageBlock block;
 		block.deliveryType = eDeliveryTypeLocal;
 		block.data = msg;
@@ -52,10 +84,8 @@ namespace tunnel
 		m_Gateway.SendTunnelDataMsg (block);
 	}		
 
-	void TransitTunnelEndpoint::HandleTunnelDataMsg (i2p::I2NPMessage * tunnelMsg)
+	void TransitTunnelEndpoint::HandleEncryptedTunnelDataMsg (i2p::I2NPMessage * tunnelMsg)
 	{
-		EncryptTunnelMsg (tunnelMsg);
-		
 		LogPrint ("TransitTunnel endpoint for ", GetTunnelID ());
 		m_Endpoint.HandleDecryptedTunnelDataMsg (tunnelMsg); 
 	}
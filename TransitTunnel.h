@@ -3,7 +3,9 @@
 
 #include <inttypes.h>
 #include <mutex>
+#include <atomic>
 #include "aes.h"
+#include "BandwidthLimiter.h"
 #include "I2NPProtocol.h"
 #include "TunnelEndpoint.h"
 #include "TunnelGateway.h"
@@ -21,22 +23,31 @@ namespace tunnel
 			    const uint8_t * nextIdent, uint32_t nextTunnelID, 
 	    		const uint8_t * layerKey,const uint8_t * ivKey); 
 			
-			virtual void HandleTunnelDataMsg (i2p::I2NPMessage * tunnelMsg);
+			void HandleTunnelDataMsg (i2p::I2NPMessage * tunnelMsg);
+			virtual void HandleEncryptedTunnelDataMsg (i2p::I2NPMessage * tunnelMsg);
 			virtual void SendTunnelDataMsg (i2p::I2NPMessage * msg);
 			virtual size_t GetNumTransmittedBytes () const { return m_NumTransmittedBytes; };
+			uint64_t GetNumDroppedBytes () const { return m_NumDroppedBytes; };
+			uint32_t GetCurrentRate () { return m_Bandwidth.GetCurrentRate (); }; // in bytes per second
 			
 			uint32_t GetTunnelID () const { return m_TunnelID; };
+			i2p::crypto::TunnelEncryption& GetEncryption () { return m_Encryption; }; // for batch encryption
 
 			// implements TunnelBase
 			void EncryptTunnelMsg (I2NPMessage * tunnelMsg); 
 			uint32_t GetNextTunnelID () const { return m_NextTunnelID; };
 			const i2p::data::IdentHash& GetNextIdentHash () const { return m_NextIdent; };
+			bool IsTransit () const { return true; };
+
+			bool IsBandwidthExceeded (size_t len); // per tunnel and router-wide transit share, consumes if not
 			
 		private:
 
 			uint32_t m_TunnelID, m_NextTunnelID;
 			i2p::data::IdentHash m_NextIdent;
 			size_t m_NumTransmittedBytes;
+			std::atomic<uint64_t> m_NumDroppedBytes;
+			i2p::util::TokenBucket m_Bandwidth;
 			
 			i2p::crypto::TunnelEncryption m_Encryption;
 	};	
@@ -70,7 +81,7 @@ namespace tunnel
 				TransitTunnel (receiveTunnelID, nextIdent, nextTunnelID, layerKey, ivKey),
 				m_Endpoint (false) {}; // transit endpoint is always outbound
 
-			void HandleTunnelDataMsg (i2p::I2NPMessage * tunnelMsg);
+			void HandleEncryptedTunnelDataMsg (i2p::I2NPMessage * tunnelMsg);
 			size_t GetNumTransmittedBytes () const { return m_Endpoint.GetNumReceivedBytes (); }
 			
 		private:
@@ -1,5 +1,6 @@
 #include <boost/bind.hpp>
 #include "Log.h"
+#include "Timestamp.h"
 #include "RouterContext.h"
 #include "I2NPProtocol.h"
 #include "NetDb.h"
@@ -9,6 +10,14 @@ using namespace i2p::data;
 
 namespace i2p
 {
+	DHKeysPairSupplier::DHKeysPairSupplier (): 
+		m_NumInProgress (0), m_ReserveSize (DH_MIN_RESERVE_SIZE), m_NumReady (0), 
+		m_LastRateUpdateTime (0), m_NumAcquiredSinceUpdate (0), m_NumGeneratedSinceUpdate (0), 
+		m_AcquireRate (0), m_GenerationRate (0), m_NumHits (0), m_NumMisses (0), m_NumGenerated (0),
+		m_IsRunning (false)
+	{
+	}
+
 	DHKeysPairSupplier::~DHKeysPairSupplier ()
 	{
 		Stop ();
@@ -17,70 +26,145 @@ namespace i2p
 	void DHKeysPairSupplier::Start ()
 	{
 		m_IsRunning = true;
-		m_Thread = new std::thread (std::bind (&DHKeysPairSupplier::Run, this));
+		m_LastRateUpdateTime = i2p::util::GetSecondsSinceEpoch ();
+		int numThreads = std::thread::hardware_concurrency ();
+		if (numThreads <= 0) numThreads = 1;
+		if (numThreads > DH_MAX_NUM_THREADS) numThreads = DH_MAX_NUM_THREADS;
+		for (int i = 0; i < numThreads; i++)
+			m_Threads.push_back (new std::thread (std::bind (&DHKeysPairSupplier::Run, this, i)));
 	}
 
 	void DHKeysPairSupplier::Stop ()
 	{
-		m_IsRunning = false;
-		m_Acquired.notify_one ();	
-		if (m_Thread)
+		{
+			std::unique_lock<std::mutex>  l(m_AcquiredMutex);
+			m_IsRunning = false;
+		}	
+		m_Acquired.notify_all ();	
+		for (auto it: m_Threads)
 		{	
-			m_Thread->join (); 
-			delete m_Thread;
-			m_Thread = 0;
+			it->join (); 
+			delete it;
 		}	
+		m_Threads.clear ();
+		while (!m_Queue.empty ())
+		{
+			delete m_Queue.front ();
+			m_Queue.pop ();
+		}	
+		m_NumReady = 0;
+		while (!m_Handlers.empty ()) // handshakes never complete
+			m_Handlers.pop ();
 	}
 
-	void DHKeysPairSupplier::Run ()
+	bool DHKeysPairSupplier::IsFillRequired (int index) const
 	{
-		while (m_IsRunning)
-		{
-			int num;
-			while ((num = m_QueueSize - m_Queue.size ()) > 0)
-				CreateDHKeysPairs (num);
-			std::unique_lock<std::mutex>  l(m_AcquiredMutex);
-			m_Acquired.wait (l); // wait for element gets aquired
-		}
-	}		
+		int numPending = m_Queue.size () + m_NumInProgress;
+		if (numPending >= m_ReserveSize + (int)m_Handlers.size ()) return false;
+		// first thread keeps reserve filled, others join if it drains
+		return !index || (int)m_Queue.size () < m_ReserveSize/2 || !m_Handlers.empty ();
+	}	
 
-	void DHKeysPairSupplier::CreateDHKeysPairs (int num)
+	void DHKeysPairSupplier::Run (int index)
 	{
-		if (num > 0)
+		std::unique_lock<std::mutex>  l(m_AcquiredMutex);
+		while (m_IsRunning)
 		{
-			for (int i = 0; i < num; i++)
+			if (IsFillRequired (index))
 			{
+				m_NumInProgress++;
+				l.unlock ();
 				i2p::data::DHKeysPair * pair = new i2p::data::DHKeysPair ();
 				i2p::data::CreateRandomDHKeysPair (pair);
-				std::unique_lock<std::mutex>  l(m_AcquiredMutex);
-				m_Queue.push (pair);
-			}
+				l.lock ();
+				m_NumInProgress--;
+				m_NumGenerated++;
+				m_NumGeneratedSinceUpdate++;
+				if (!m_Handlers.empty ())
+				{
+					// deferred handshake is waiting for it
+					auto handler = m_Handlers.front ();
+					m_Handlers.pop ();
+					l.unlock ();
+					handler (pair);
+					l.lock ();
+				}	
+				else
+				{	
+					m_Queue.push (pair);
+					m_NumReady = m_Queue.size ();
+				}	
+			}	
+			else
+				m_Acquired.wait_for (l, std::chrono::seconds (DH_RATE_UPDATE_INTERVAL)); // wait for element gets aquired
+			UpdateRates ();
 		}
+	}		
+
+	void DHKeysPairSupplier::UpdateRates ()
+	{
+		// called with locked mutex
+		uint64_t ts = i2p::util::GetSecondsSinceEpoch ();
+		if (ts < m_LastRateUpdateTime + DH_RATE_UPDATE_INTERVAL) return;
+		double interval = ts - m_LastRateUpdateTime;
+		m_AcquireRate = (m_AcquireRate + m_NumAcquiredSinceUpdate/interval)/2; 
+		m_GenerationRate = m_NumGeneratedSinceUpdate/interval;
+		m_NumAcquiredSinceUpdate = 0;
+		m_NumGeneratedSinceUpdate = 0;
+		m_LastRateUpdateTime = ts;
+		int reserveSize = m_AcquireRate*DH_RESERVE_SECONDS + 1;
+		if (reserveSize < DH_MIN_RESERVE_SIZE) reserveSize = DH_MIN_RESERVE_SIZE;
+		if (reserveSize > DH_MAX_RESERVE_SIZE) reserveSize = DH_MAX_RESERVE_SIZE;
+		if (reserveSize != m_ReserveSize)
+		{
+			LogPrint ("DH keys reserve size changed from ", (int)m_ReserveSize, " to ", reserveSize);
+			m_ReserveSize = reserveSize;
+		}	
 	}
 
 	i2p::data::DHKeysPair * DHKeysPairSupplier::Acquire ()
 	{
+		std::unique_lock<std::mutex>  l(m_AcquiredMutex); // might be called from several transports threads
+		m_NumAcquiredSinceUpdate++;
+		UpdateRates ();
+		i2p::data::DHKeysPair * pair = nullptr;
 		if (!m_Queue.empty ())
 		{
-			std::unique_lock<std::mutex>  l(m_AcquiredMutex);
-			auto pair = m_Queue.front ();
+			pair = m_Queue.front ();
 			m_Queue.pop ();
-			m_Acquired.notify_one ();
-			return pair;
+			m_NumReady = m_Queue.size ();
+			m_NumHits++;
+		}	
+		else
+			m_NumMisses++;
+		l.unlock ();
+		m_Acquired.notify_all ();
+		return pair;
+	}
+
+	void DHKeysPairSupplier::Acquire (DHKeysPairHandler handler)
+	{
+		auto pair = Acquire ();
+		if (pair)
+			handler (pair);
+		else
+		{	
+			std::unique_lock<std::mutex>  l(m_AcquiredMutex);
+			if (!m_IsRunning) return;
+			m_Handlers.push (handler);
+			l.unlock ();
+			m_Acquired.notify_all ();
 		}	
-		else // queue is empty, create new
-		{
-			i2p::data::DHKeysPair * pair = new i2p::data::DHKeysPair ();
-			i2p::data::CreateRandomDHKeysPair (pair);
-			return pair;
-		}
 	}
 
 	Transports transports;	
 	
 	Transports::Transports (): 
-		m_Thread (nullptr), m_Work (m_Service), m_NTCPAcceptor (nullptr), 
-		m_SSUServer (nullptr), m_DHKeysPairSupplier (5) // 5 pre-generated keys
+		m_IsRunning (false), m_NumThreads (1), m_Work (m_Service), m_NumCryptoThreads (1), m_IsCryptoRunning (false),
+		m_CryptoWork (m_CryptoService), m_NumHandshakes (0), m_MaxNumHandshakes (TRANSPORTS_MAX_NUM_HANDSHAKES), m_NTCPAcceptor (nullptr), 
+		m_NTCPMaxBatchSize (i2p::ntcp::NTCP_MAX_BATCH_SIZE), 
+		m_NumNTCPWrites (0), m_NumNTCPSentMessages (0), m_NumNTCPSentBytes (0),
+		m_SSUServer (nullptr), m_ReplayFilter (REPLAY_FILTER_SIZE, REPLAY_FILTER_FALSE_POSITIVES/1000000.0, REPLAY_FILTER_INTERVAL)
 	{		
 	}
 		
@@ -89,11 +173,34 @@ namespace i2p
 		Stop ();
 	}	
 
+	void Transports::SetNumThreads (int numThreads)
+	{
+		if (numThreads <= 0)
+			numThreads = std::thread::hardware_concurrency ();
+		if (numThreads <= 0) numThreads = 1;	
+		if (numThreads > TRANSPORTS_MAX_NUM_THREADS) numThreads = TRANSPORTS_MAX_NUM_THREADS;
+		m_NumThreads = numThreads;
+	}	
+
+	void Transports::SetNumCryptoThreads (int numThreads)
+	{
+		if (numThreads <= 0)
+			numThreads = std::thread::hardware_concurrency ();
+		if (numThreads <= 0) numThreads = 1;	
+		if (numThreads > TRANSPORTS_MAX_NUM_THREADS) numThreads = TRANSPORTS_MAX_NUM_THREADS;
+		m_NumCryptoThreads = numThreads;
+	}	
+
 	void Transports::Start ()
 	{
 		m_DHKeysPairSupplier.Start ();
 		m_IsRunning = true;
-		m_Thread = new std::thread (std::bind (&Transports::Run, this));
+		m_IsCryptoRunning = true;
+		for (int i = 0; i < m_NumThreads; i++)
+			m_Threads.push_back (new std::thread (std::bind (&Transports::Run, this)));
+		for (int i = 0; i < m_NumCryptoThreads; i++)
+			m_CryptoThreads.push_back (new std::thread (std::bind (&Transports::RunCrypto, this)));
+		LogPrint ("Transports: ", m_NumThreads, " threads, ", m_NumCryptoThreads, " crypto threads");
 		// create acceptors
 		auto addresses = context.GetRouterInfo ().GetAddresses ();
 		for (auto& address : addresses)
@@ -104,7 +211,7 @@ namespace i2p
 					boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), address.port));
 
 				LogPrint ("Start listening TCP port ", address.port);	
-				auto conn = new i2p::ntcp::NTCPServerConnection (m_Service);
+				auto conn = std::make_shared<i2p::ntcp::NTCPServerConnection> (m_Service);
 				m_NTCPAcceptor->async_accept(conn->GetSocket (), boost::bind (&Transports::HandleAccept, this, 
 					conn, boost::asio::placeholders::error));
 			}	
@@ -115,7 +222,7 @@ namespace i2p
 					m_SSUServer = new i2p::ssu::SSUServer (address.port);
 					LogPrint ("Start listening UDP port ", address.port);
 					m_SSUServer->Start ();	
-					DetectExternalIP ();
+					m_SSUServer->GetService ().post (boost::bind (&Transports::DetectExternalIP, this));
 				}
 				else
 					LogPrint ("SSU server already exists");
@@ -125,26 +232,37 @@ namespace i2p
 		
 	void Transports::Stop ()
 	{	
+		m_DHKeysPairSupplier.Stop (); // drop waiting handshakes first
+		// crypto threads post results to SSU server and sessions
+		m_IsCryptoRunning = false;
+		m_CryptoService.stop ();
+		for (auto it: m_CryptoThreads)
+		{	
+			it->join (); 
+			delete it;
+		}	
+		m_CryptoThreads.clear ();
 		if (m_SSUServer)
 		{
 			m_SSUServer->Stop ();
 			delete m_SSUServer;
+			m_SSUServer = nullptr;
 		}	
 		
-		for (auto session: m_NTCPSessions)
-			delete session.second;
-		m_NTCPSessions.clear ();
-		delete m_NTCPAcceptor;
-
-		m_DHKeysPairSupplier.Stop ();
 		m_IsRunning = false;
 		m_Service.stop ();
-		if (m_Thread)
+		for (auto it: m_Threads)
 		{	
-			m_Thread->join (); 
-			delete m_Thread;
-			m_Thread = 0;
+			it->join (); 
+			delete it;
 		}	
+		m_Threads.clear ();
+
+		// sessions are deleted once pending handlers release them
+		std::unique_lock<std::mutex> l(m_NTCPSessionsMutex);
+		m_NTCPSessions.clear ();
+		delete m_NTCPAcceptor;
+		m_NTCPAcceptor = nullptr;
 	}	
 
 	void Transports::Run () 
@@ -162,56 +280,115 @@ namespace i2p
 		}	
 	}
 		
-	void Transports::AddNTCPSession (i2p::ntcp::NTCPSession * session)
+	void Transports::RunCrypto () 
+	{ 
+		while (m_IsCryptoRunning)
+		{
+			try
+			{	
+				m_CryptoService.run ();
+			}
+			catch (std::exception& ex)
+			{
+				LogPrint ("Transports crypto: ", ex.what ());
+			}	
+		}	
+	}
+
+	bool Transports::AcquireHandshake (bool isIncoming)
+	{
+		int numHandshakes = ++m_NumHandshakes;
+		if (isIncoming && numHandshakes > m_MaxNumHandshakes)
+		{
+			m_NumHandshakes--;
+			return false;
+		}	
+		return true;
+	}	
+		
+	void Transports::AddNTCPSession (std::shared_ptr<i2p::ntcp::NTCPSession> session)
 	{
 		if (session)
+		{
+			std::unique_lock<std::mutex> l(m_NTCPSessionsMutex);
 			m_NTCPSessions[session->GetRemoteRouterInfo ().GetIdentHash ()] = session;
+		}	
 	}	
 
-	void Transports::RemoveNTCPSession (i2p::ntcp::NTCPSession * session)
+	void Transports::RemoveNTCPSession (std::shared_ptr<i2p::ntcp::NTCPSession> session)
 	{
 		if (session)
-			m_NTCPSessions.erase (session->GetRemoteRouterInfo ().GetIdentHash ());
+		{
+			std::unique_lock<std::mutex> l(m_NTCPSessionsMutex);
+			auto it = m_NTCPSessions.find (session->GetRemoteRouterInfo ().GetIdentHash ());
+			if (it != m_NTCPSessions.end () && it->second == session) // might be replaced by another one already
+				m_NTCPSessions.erase (it);
+		}	
 	}	
 		
-	void Transports::HandleAccept (i2p::ntcp::NTCPServerConnection * conn, const boost::system::error_code& error)
+	void Transports::HandleAccept (std::shared_ptr<i2p::ntcp::NTCPServerConnection> conn, const boost::system::error_code& error)
 	{		
 		if (!error)
 		{
-			LogPrint ("Connected from ", conn->GetSocket ().remote_endpoint().address ().to_string ());
-			conn->ServerLogin ();
-		}
-		else
-		{
-			delete conn;
+			boost::system::error_code ec;
+			LogPrint ("Connected from ", conn->GetSocket ().remote_endpoint(ec).address ().to_string ());
+			if (AcquireHandshake (true))
+				conn->ServerLogin ();
+			else
+			{
+				// keep established sessions going rather than doing more DH
+				LogPrint ("Too many handshakes in progress. Connection dropped");
+				conn->GetSocket ().close ();
+			}	
 		}
 
-    	conn = new i2p::ntcp::NTCPServerConnection (m_Service);
+		if (error == boost::asio::error::operation_aborted) return; // acceptor is closed
+    	conn = std::make_shared<i2p::ntcp::NTCPServerConnection> (m_Service);
 		m_NTCPAcceptor->async_accept(conn->GetSocket (), boost::bind (&Transports::HandleAccept, this, 
 			conn, boost::asio::placeholders::error));
 	}
 
-	i2p::ntcp::NTCPSession * Transports::GetNextNTCPSession ()
+	std::shared_ptr<i2p::ntcp::NTCPSession> Transports::GetNextNTCPSession ()
 	{
+		std::unique_lock<std::mutex> l(m_NTCPSessionsMutex);
 		for (auto session: m_NTCPSessions)
 			if (session.second->IsEstablished ())
 				return session.second;
-		return 0;
+		return nullptr;
 	}	
 
-	i2p::ntcp::NTCPSession * Transports::FindNTCPSession (const i2p::data::IdentHash& ident)
+	std::shared_ptr<i2p::ntcp::NTCPSession> Transports::FindNTCPSession (const i2p::data::IdentHash& ident)
 	{
+		std::unique_lock<std::mutex> l(m_NTCPSessionsMutex);
 		auto it = m_NTCPSessions.find (ident);
 		if (it != m_NTCPSessions.end ())
 			return it->second;
-		return 0;
+		return nullptr;
 	}	
 
+	void Transports::GetNTCPSessions (std::vector<std::shared_ptr<i2p::ntcp::NTCPSession> >& sessions)
+	{
+		std::unique_lock<std::mutex> l(m_NTCPSessionsMutex);
+		for (auto it: m_NTCPSessions)
+			sessions.push_back (it.second);
+	}	
+
+	bool Transports::IsReplayedMessage (i2p::I2NPMessage * msg)
+	{
+		auto header = msg->GetHeader ();
+		// transit traffic is not checked to keep filter's capacity for messages to us
+		if (header->typeID == eI2NPTunnelData || header->typeID == eI2NPTunnelGateway) return false;
+		uint8_t key[12]; // msgID and expiration
+		memcpy (key, &header->msgID, 4);
+		memcpy (key + 4, &header->expiration, 8);
+		return m_ReplayFilter.CheckAndAdd (key, 12);
+	}
+
 	void Transports::SendMessage (const i2p::data::IdentHash& ident, i2p::I2NPMessage * msg)
 	{
 		if (ident == i2p::context.GetRouterInfo ().GetIdentHash ())
 			// we send it to ourself
-			i2p::HandleI2NPMessage (msg);
+			i2p::HandleI2NPMessage (UnshareI2NPMessage (msg));
 		else
 			m_Service.post (boost::bind (&Transports::PostMessage, this, ident, msg));                             
 	}	
@@ -226,33 +403,11 @@ namespace i2p
 			RouterInfo * r = netdb.FindRouter (ident);
 			if (r)
 			{	
-				auto ssuSession = m_SSUServer ? m_SSUServer->FindSession (r) : nullptr;
-				if (ssuSession)
-					ssuSession->SendI2NPMessage (msg);
+				if (m_SSUServer)
+					// SSU sessions are accessed from SSU thread only
+					m_SSUServer->GetService ().post (boost::bind (&Transports::PostSSUMessage, this, r, msg));
 				else
-				{	
-					// existing session not found. create new 
-					// try NTCP first if message size < 16K
-					auto address = r->GetNTCPAddress ();
-					if (address && !r->UsesIntroducer () && !r->IsUnreachable () && msg->GetLength () < i2p::ntcp::NTCP_MAX_MESSAGE_SIZE)
-					{	
-						auto s = new i2p::ntcp::NTCPClient (m_Service, address->host, address->port, *r);
-						AddNTCPSession (s);
-						s->SendI2NPMessage (msg);
-					}	
-					else
-					{	
-						// then SSU					
-						auto s = m_SSUServer ? m_SSUServer->GetSession (r) : nullptr;
-						if (s)
-							s->SendI2NPMessage (msg);
-						else
-						{
-							LogPrint ("No NTCP and SSU addresses available");
-							DeleteI2NPMessage (msg); 
-						}
-					}
-				}	
+					CreateSession (r, msg);
 			}
 			else
 			{
@@ -263,6 +418,59 @@ namespace i2p
 		}	
 	}	
 
+	void Transports::PostSSUMessage (RouterInfo * router, i2p::I2NPMessage * msg)
+	{
+		auto ssuSession = m_SSUServer->FindSession (router);
+		if (ssuSession)
+			ssuSession->SendI2NPMessage (msg);
+		else
+			CreateSession (router, msg);
+	}	
+
+	void Transports::CreateSession (RouterInfo * router, i2p::I2NPMessage * msg)
+	{
+		// existing session not found. create new 
+		// try NTCP first if message size < 16K
+		auto address = router->GetNTCPAddress ();
+		if (address && !router->UsesIntroducer () && !router->IsUnreachable () && msg->GetLength () < i2p::ntcp::NTCP_MAX_MESSAGE_SIZE)
+		{	
+			// messages to the same router might be posted before its session is added, find or create atomically
+			std::shared_ptr<i2p::ntcp::NTCPSession> s;
+			std::shared_ptr<i2p::ntcp::NTCPClient> client;
+			{
+				std::unique_lock<std::mutex> l(m_NTCPSessionsMutex);
+				auto& session = m_NTCPSessions[router->GetIdentHash ()];
+				if (!session)
+				{
+					client = std::make_shared<i2p::ntcp::NTCPClient> (m_Service, address->host, address->port, *router);
+					session = client;
+				}
+				s = session;
+			}
+			if (client) client->Connect ();
+			s->SendI2NPMessage (msg);
+		}	
+		else
+		{	
+			// then SSU, we are in SSU thread here				
+			auto s = m_SSUServer ? m_SSUServer->GetSession (router) : nullptr;
+			if (s)
+				s->SendI2NPMessage (msg);
+			else
+			{
+				LogPrint ("No NTCP and SSU addresses available");
+				DeleteI2NPMessage (msg); 
+			}
+		}
+	}	
+
+	void Transports::UpdateNTCPSentStats (int numMessages, size_t numBytes)
+	{
+		m_NumNTCPWrites++;
+		m_NumNTCPSentMessages += numMessages;
+		m_NumNTCPSentBytes += numBytes;
+	}	
+
 	void Transports::DetectExternalIP ()
 	{
 		for (int i = 0; i < 5; i ++)
@@ -272,10 +480,4 @@ namespace i2p
 				m_SSUServer->GetSession (router, true);  // peer test	
 		}	
 	}
-		
-		
-	i2p::data::DHKeysPair * Transports::GetNextDHKeysPair ()
-	{
-		return m_DHKeysPairSupplier.Acquire ();
-	}
 }
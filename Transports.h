@@ -6,7 +6,10 @@
 #include <condition_variable>
 #include <functional>
 #include <map>
+#include <vector>
+#include <memory>
 #include <queue>
+#include <atomic>
 #include <string>
 #include <boost/asio.hpp>
 #include "NTCPSession.h"
@@ -14,35 +17,66 @@
 #include "RouterInfo.h"
 #include "I2NPProtocol.h"
 #include "Identity.h"
+#include "BloomFilter.h"
+#include "BandwidthLimiter.h"
 
 namespace i2p
 {
+	const int DH_MIN_RESERVE_SIZE = 5;
+	const int DH_MAX_RESERVE_SIZE = 256;
+	const int DH_RESERVE_SECONDS = 5; // keep enough keys for 5 seconds of connection attempts
+	const int DH_RATE_UPDATE_INTERVAL = 10; // in seconds
+	const int DH_MAX_NUM_THREADS = 4;
+	typedef std::function<void (i2p::data::DHKeysPair *)> DHKeysPairHandler;
+	const size_t REPLAY_FILTER_SIZE = 2*1024*1024; // in bytes
+	const int REPLAY_FILTER_FALSE_POSITIVES = 1; // per million
+	const int REPLAY_FILTER_INTERVAL = 60; // in seconds, keys are remembered for 2-3 minutes
 	class DHKeysPairSupplier
 	{
 		public:
 
-			DHKeysPairSupplier (int size): m_QueueSize (size), m_IsRunning (false), m_Thread (nullptr) {};
+			DHKeysPairSupplier ();
 			~DHKeysPairSupplier ();
 			void Start ();
 			void Stop ();
-			i2p::data::DHKeysPair * Acquire ();
+			i2p::data::DHKeysPair * Acquire (); // never blocks, nullptr if no key is ready
+			void Acquire (DHKeysPairHandler handler); // handler is called from supplier's thread if no key is ready
+
+			uint64_t GetNumHits () const { return m_NumHits; };
+			uint64_t GetNumMisses () const { return m_NumMisses; };
+			uint64_t GetNumGenerated () const { return m_NumGenerated; };
+			double GetAcquireRate () const { return m_AcquireRate; }; // per second
+			double GetGenerationRate () const { return m_GenerationRate; }; // per second
+			int GetReserveSize () const { return m_ReserveSize; };
+			int GetNumReady () const { return m_NumReady; };
+			int GetNumThreads () const { return m_Threads.size (); };
 
 		private:
 
-			void Run ();
-			void CreateDHKeysPairs (int num);
+			void Run (int index);
+			bool IsFillRequired (int index) const;
+			void UpdateRates ();
 
 		private:
 
-			int m_QueueSize;
 			std::queue<i2p::data::DHKeysPair *> m_Queue;
+			std::queue<DHKeysPairHandler> m_Handlers; // waiting for keys
+			int m_NumInProgress;
+			std::atomic<int> m_ReserveSize, m_NumReady;
+
+			uint64_t m_LastRateUpdateTime;
+			int m_NumAcquiredSinceUpdate, m_NumGeneratedSinceUpdate;
+			std::atomic<double> m_AcquireRate, m_GenerationRate;
+			std::atomic<uint64_t> m_NumHits, m_NumMisses, m_NumGenerated;
 
 			bool m_IsRunning;
-			std::thread * m_Thread;	
+			std::vector<std::thread *> m_Threads;	
 			std::condition_variable m_Acquired;
 			std::mutex m_AcquiredMutex;
 	};
 
+	const int TRANSPORTS_MAX_NUM_THREADS = 16;
+	const int TRANSPORTS_MAX_NUM_HANDSHAKES = 128; // in progress, incoming are rejected above it
 	class Transports
 	{
 		public:
@@ -52,43 +86,87 @@ namespace i2p
 
 			void Start ();
 			void Stop ();
+			void SetNumThreads (int numThreads); // 0 means number of cores
+			void SetNumCryptoThreads (int numThreads); // 0 means number of cores
+			void SetMaxNumHandshakes (int maxNumHandshakes) { m_MaxNumHandshakes = maxNumHandshakes; };
+			void SetNTCPMaxBatchSize (size_t size) { m_NTCPMaxBatchSize = size; };
+			size_t GetNTCPMaxBatchSize () const { return m_NTCPMaxBatchSize; };
 			
 			boost::asio::io_service& GetService () { return m_Service; };
-			i2p::data::DHKeysPair * GetNextDHKeysPair ();	
-
-			void AddNTCPSession (i2p::ntcp::NTCPSession * session);
-			void RemoveNTCPSession (i2p::ntcp::NTCPSession * session);
+			boost::asio::io_service& GetCryptoService () { return m_CryptoService; }; // DH and DSA of handshakes
+			i2p::data::DHKeysPair * GetNextDHKeysPair () { return m_DHKeysPairSupplier.Acquire (); };	
+			void GetNextDHKeysPair (DHKeysPairHandler handler) { m_DHKeysPairSupplier.Acquire (handler); };
+			const DHKeysPairSupplier& GetDHKeysPairSupplier () const { return m_DHKeysPairSupplier; };
+
+			// NTCP sessions can be added, removed and found from any thread
+			void AddNTCPSession (std::shared_ptr<i2p::ntcp::NTCPSession> session);
+			void RemoveNTCPSession (std::shared_ptr<i2p::ntcp::NTCPSession> session);
 			
-			i2p::ntcp::NTCPSession * GetNextNTCPSession ();
-			i2p::ntcp::NTCPSession * FindNTCPSession (const i2p::data::IdentHash& ident);
+			std::shared_ptr<i2p::ntcp::NTCPSession> GetNextNTCPSession ();
+			std::shared_ptr<i2p::ntcp::NTCPSession> FindNTCPSession (const i2p::data::IdentHash& ident);
 
 			void SendMessage (const i2p::data::IdentHash& ident, i2p::I2NPMessage * msg);
+
+			bool AcquireHandshake (bool isIncoming); // false if too many handshakes in progress
+			void ReleaseHandshake () { m_NumHandshakes--; };
+			int GetNumHandshakes () const { return m_NumHandshakes; };
+
+			void UpdateNTCPSentStats (int numMessages, size_t numBytes); // per write
+			uint64_t GetNumNTCPWrites () const { return m_NumNTCPWrites; };
+			uint64_t GetNumNTCPSentMessages () const { return m_NumNTCPSentMessages; };
+			uint64_t GetNumNTCPSentBytes () const { return m_NumNTCPSentBytes; };
+
+			// router-wide replay detection, from any thread
+			void SetReplayFilterParams (size_t size, double falsePositiveRate) { m_ReplayFilter.Configure (size, falsePositiveRate); };
+			bool IsReplayedIV (const uint8_t * iv) { return m_ReplayFilter.CheckAndAdd (iv, 16); };
+			bool IsReplayedMessage (i2p::I2NPMessage * msg);
+			const i2p::util::RotatingBloomFilter& GetReplayFilter () const { return m_ReplayFilter; };
+
+			// router-wide bandwidth limits, from any thread
+			void SetBandwidthLimits (uint32_t inbound, uint32_t outbound, int transitShare) { m_BandwidthLimiter.SetLimits (inbound, outbound, transitShare); };
+			i2p::util::BandwidthLimiter& GetBandwidthLimiter () { return m_BandwidthLimiter; };
 						
 		private:
 
 			void Run ();
-			void HandleAccept (i2p::ntcp::NTCPServerConnection * conn, const boost::system::error_code& error);
+			void RunCrypto ();
+			void HandleAccept (std::shared_ptr<i2p::ntcp::NTCPServerConnection> conn, const boost::system::error_code& error);
 			void PostMessage (const i2p::data::IdentHash& ident, i2p::I2NPMessage * msg);
+			void PostSSUMessage (i2p::data::RouterInfo * router, i2p::I2NPMessage * msg); // in SSU thread
+			void CreateSession (i2p::data::RouterInfo * router, i2p::I2NPMessage * msg);
 
 			void DetectExternalIP ();
 			
 		private:
 
 			bool m_IsRunning;
-			std::thread * m_Thread;	
+			int m_NumThreads;
+			std::vector<std::thread *> m_Threads;	
 			boost::asio::io_service m_Service;
 			boost::asio::io_service::work m_Work;
+			int m_NumCryptoThreads;
+			std::atomic<bool> m_IsCryptoRunning; // crypto threads stop before others
+			std::vector<std::thread *> m_CryptoThreads;	
+			boost::asio::io_service m_CryptoService;
+			boost::asio::io_service::work m_CryptoWork;
+			std::atomic<int> m_NumHandshakes;
+			int m_MaxNumHandshakes;
 			boost::asio::ip::tcp::acceptor * m_NTCPAcceptor;
 
-			std::map<i2p::data::IdentHash, i2p::ntcp::NTCPSession *> m_NTCPSessions;
+			std::map<i2p::data::IdentHash, std::shared_ptr<i2p::ntcp::NTCPSession> > m_NTCPSessions;
+			std::mutex m_NTCPSessionsMutex;
+			size_t m_NTCPMaxBatchSize;
+			std::atomic<uint64_t> m_NumNTCPWrites, m_NumNTCPSentMessages, m_NumNTCPSentBytes;
 			i2p::ssu::SSUServer * m_SSUServer;
 
 			DHKeysPairSupplier m_DHKeysPairSupplier;
+			i2p::util::RotatingBloomFilter m_ReplayFilter; // SSU IVs and I2NP messages
+			i2p::util::BandwidthLimiter m_BandwidthLimiter;
 
 		public:
 
 			// for HTTP only
-			const decltype(m_NTCPSessions)& GetNTCPSessions () const { return m_NTCPSessions; };
+			void GetNTCPSessions (std::vector<std::shared_ptr<i2p::ntcp::NTCPSession> >& sessions);
 			const i2p::ssu::SSUServer * GetSSUServer () const { return m_SSUServer; };
 	};	
 
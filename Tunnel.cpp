@@ -1,5 +1,6 @@
 #include "I2PEndian.h"
 #include <thread>
+#include <algorithm>
 #include <cryptopp/sha.h>
 #include "RouterContext.h"
 #include "Log.h"
@@ -187,7 +188,8 @@ namespace tunnel
 	Tunnels tunnels;
 	
 	Tunnels::Tunnels (): m_IsRunning (false), m_IsTunnelCreated (false), 
-		m_NextReplyMsgID (555), m_Thread (nullptr), m_ExploratoryPool (nullptr)
+		m_NextReplyMsgID (555), m_Thread (nullptr), m_ExploratoryPool (nullptr), 
+		m_NumThreads (1), m_QueueCapacity (TUNNELS_QUEUE_CAPACITY)
 	{
 	}
 	
@@ -212,10 +214,19 @@ namespace tunnel
 		for (auto& it: m_Pools)
 			delete it.second;
 		m_Pools.clear ();
+
+		for (auto it: m_RetiredTunnels)
+			delete it;
+		m_RetiredTunnels.clear ();
+
+		for (auto it: m_Shards)
+			delete it;
+		m_Shards.clear ();
 	}	
 	
 	InboundTunnel * Tunnels::GetInboundTunnel (uint32_t tunnelID)
 	{
+		std::unique_lock<std::recursive_mutex> l(m_TunnelsMutex);
 		auto it = m_InboundTunnels.find(tunnelID);
 		if (it != m_InboundTunnels.end ())
 			return it->second;
@@ -224,6 +235,7 @@ namespace tunnel
 	
 	TransitTunnel * Tunnels::GetTransitTunnel (uint32_t tunnelID)
 	{
+		std::unique_lock<std::mutex> l(m_TransitTunnelsMutex);
 		auto it = m_TransitTunnels.find(tunnelID);
 		if (it != m_TransitTunnels.end ())
 			return it->second;
@@ -232,6 +244,7 @@ namespace tunnel
 		
 	Tunnel * Tunnels::GetPendingTunnel (uint32_t replyMsgID)
 	{
+		std::unique_lock<std::mutex> l(m_PendingTunnelsMutex);
 		auto it = m_PendingTunnels.find(replyMsgID);
 		if (it != m_PendingTunnels.end ())
 		{
@@ -244,6 +257,7 @@ namespace tunnel
 
 	InboundTunnel * Tunnels::GetNextInboundTunnel ()
 	{
+		std::unique_lock<std::recursive_mutex> l(m_TunnelsMutex);
 		InboundTunnel * tunnel  = nullptr; 
 		size_t minReceived = 0;
 		for (auto it : m_InboundTunnels)
@@ -260,6 +274,8 @@ namespace tunnel
 	
 	OutboundTunnel * Tunnels::GetNextOutboundTunnel ()
 	{
+		std::unique_lock<std::recursive_mutex> l(m_TunnelsMutex);
+		if (m_OutboundTunnels.empty ()) return nullptr;
 		CryptoPP::RandomNumberGenerator& rnd = i2p::context.GetRandomNumberGenerator ();
 		uint32_t ind = rnd.GenerateWord32 (0, m_OutboundTunnels.size () - 1), i = 0;
 		OutboundTunnel * tunnel = nullptr;
@@ -278,6 +294,7 @@ namespace tunnel
 	TunnelPool * Tunnels::CreateTunnelPool (i2p::data::LocalDestination& localDestination, int numHops)
 	{
 		auto pool = new TunnelPool (localDestination, numHops);
+		std::unique_lock<std::recursive_mutex> l(m_TunnelsMutex);
 		m_Pools[pool->GetIdentHash ()] = pool;
 		return pool;
 	}	
@@ -286,6 +303,7 @@ namespace tunnel
 	{
 		if (pool)
 		{
+			std::unique_lock<std::recursive_mutex> l(m_TunnelsMutex);
 			m_Pools.erase (pool->GetIdentHash ());
 			delete pool;
 		}
@@ -293,19 +311,72 @@ namespace tunnel
 	
 	void Tunnels::AddTransitTunnel (TransitTunnel * tunnel)
 	{
-		m_TransitTunnels[tunnel->GetTunnelID ()] = tunnel;
+		{
+			std::unique_lock<std::mutex> l(m_TransitTunnelsMutex);
+			m_TransitTunnels[tunnel->GetTunnelID ()] = tunnel;
+			i2p::transports.GetBandwidthLimiter ().SetNumTransitTunnels (m_TransitTunnels.size ());
+		}
+		auto shard = GetShard (tunnel->GetTunnelID ());
+		std::unique_lock<std::mutex> l(shard->mutex);
+		shard->transitTunnels[tunnel->GetTunnelID ()] = tunnel;
+	}	
+
+	void Tunnels::DeleteFromShard (uint32_t tunnelID)
+	{
+		// shard thread might still process a message of it, so tunnel is deleted next round
+		auto shard = GetShard (tunnelID);
+		std::unique_lock<std::mutex> l(shard->mutex);
+		shard->inboundTunnels.erase (tunnelID);
+		shard->transitTunnels.erase (tunnelID);
 	}	
 
+	void Tunnels::SetNumThreads (int numThreads)
+	{
+		if (numThreads <= 0)
+			numThreads = std::thread::hardware_concurrency ();
+		if (numThreads <= 0) numThreads = 1;	
+		if (numThreads > TUNNELS_MAX_NUM_THREADS) numThreads = TUNNELS_MAX_NUM_THREADS;
+		m_NumThreads = numThreads;
+	}	
+	
 	void Tunnels::Start ()
 	{
+		if (m_Shards.empty ())
+		{
+			for (int i = 0; i < m_NumThreads; i++)
+			{
+				auto shard = new TunnelsShard ("tunnels" + std::to_string (i));
+				shard->queue.SetCapacity (m_QueueCapacity/m_NumThreads);
+				shard->queue.SetDropper (i2p::DeleteI2NPMessage);
+				shard->queue.SetClassifier ([shard](I2NPMessage * msg)
+					{
+						// our inbound tunnels are protected
+						std::unique_lock<std::mutex> l(shard->mutex);
+						return !shard->inboundTunnels.count (be32toh (*(uint32_t *)msg->GetPayload ()));
+					});
+				m_Shards.push_back (shard);
+			}	
+		}		
 		m_IsRunning = true;
+		for (auto it: m_Shards)
+			it->thread = new std::thread (std::bind (&Tunnels::RunShard, this, it));
 		m_Thread = new std::thread (std::bind (&Tunnels::Run, this));
+		LogPrint ("Tunnels: ", m_Shards.size (), " threads");
 	}
 	
 	void Tunnels::Stop ()
 	{
 		m_IsRunning = false;
-		m_Queue.WakeUp ();
+		for (auto it: m_Shards)
+		{
+			it->queue.WakeUp ();
+			if (it->thread)
+			{
+				it->thread->join ();
+				delete it->thread;
+				it->thread = nullptr;
+			}	
+		}	
 		if (m_Thread)
 		{	
 			m_Thread->join (); 
@@ -323,27 +394,6 @@ namespace tunnel
 		{
 			try
 			{	
-				I2NPMessage * msg = m_Queue.GetNextWithTimeout (1000); // 1 sec
-				while (msg)
-				{
-					uint32_t  tunnelID = be32toh (*(uint32_t *)msg->GetPayload ()); 
-					InboundTunnel * tunnel = GetInboundTunnel (tunnelID);
-					if (tunnel)
-						tunnel->HandleTunnelDataMsg (msg);
-					else
-					{	
-						TransitTunnel * transitTunnel = GetTransitTunnel (tunnelID);
-						if (transitTunnel)
-							transitTunnel->HandleTunnelDataMsg (msg);
-						else	
-						{	
-							LogPrint ("Tunnel ", tunnelID, " not found");
-							i2p::DeleteI2NPMessage (msg);
-						}	
-					}	
-					msg = m_Queue.Get ();
-				}	
-			
 				uint64_t ts = i2p::util::GetSecondsSinceEpoch ();
 				if (ts - lastTs >= 15) // manage tunnels every 15 seconds
 				{
@@ -355,19 +405,99 @@ namespace tunnel
 			{
 				LogPrint ("Tunnels: ", ex.what ());
 			}	
+			std::this_thread::sleep_for (std::chrono::seconds(1));
+		}	
+	}	
+
+	void Tunnels::RunShard (TunnelsShard * shard)
+	{
+		std::vector<I2NPMessage *> msgs;
+		std::vector<std::pair<InboundTunnel *, I2NPMessage *> > inboundMsgs;
+		std::vector<std::pair<TransitTunnel *, I2NPMessage *> > transitMsgs;
+		while (m_IsRunning)
+		{
+			try
+			{	
+				msgs.clear ();
+				if (shard->queue.GetAllWithTimeout (msgs, 1000)) // 1 sec
+				{
+					inboundMsgs.clear ();
+					transitMsgs.clear ();
+					std::unique_lock<std::mutex> l(shard->mutex);
+					for (auto msg: msgs)
+					{
+						uint32_t  tunnelID = be32toh (*(uint32_t *)msg->GetPayload ()); 
+						auto it = shard->inboundTunnels.find (tunnelID);
+						if (it != shard->inboundTunnels.end ())
+							inboundMsgs.push_back (std::make_pair (it->second, msg));
+						else
+						{	
+							auto it1 = shard->transitTunnels.find (tunnelID);
+							if (it1 != shard->transitTunnels.end ())
+							{
+								// over limit messages are dropped before batch encryption
+								if (it1->second->IsBandwidthExceeded (msg->GetLength ()))
+									i2p::DeleteI2NPMessage (msg);
+								else
+									transitMsgs.push_back (std::make_pair (it1->second, msg));
+							}
+							else	
+							{	
+								LogPrint ("Tunnel ", tunnelID, " not found");
+								i2p::DeleteI2NPMessage (msg);
+							}	
+						}	
+					}	
+					l.unlock ();
+					// messages to us might add tunnels, so they are handled without shard's lock
+					for (auto& it: inboundMsgs)
+						it.first->HandleTunnelDataMsg (it.second);
+					HandleTransitTunnelDataMsgs (transitMsgs);
+				}
+			}
+			catch (std::exception& ex)
+			{
+				LogPrint ("Tunnels: ", ex.what ());
+			}	
+		}	
+	}	
+
+	void Tunnels::HandleTransitTunnelDataMsgs (std::vector<std::pair<TransitTunnel *, I2NPMessage *> >& msgs)
+	{
+		i2p::crypto::TunnelEncryption * encryptions[i2p::crypto::TUNNEL_ENCRYPTION_BATCH_SIZE];
+		uint8_t * payloads[i2p::crypto::TUNNEL_ENCRYPTION_BATCH_SIZE];
+		for (size_t i = 0; i < msgs.size (); i += i2p::crypto::TUNNEL_ENCRYPTION_BATCH_SIZE)
+		{
+			int num = std::min (msgs.size () - i, (size_t)i2p::crypto::TUNNEL_ENCRYPTION_BATCH_SIZE);
+			for (int j = 0; j < num; j++)
+			{
+				encryptions[j] = &msgs[i + j].first->GetEncryption ();
+				payloads[j] = msgs[i + j].second->GetPayload () + 4; // after tunnelID
+			}	
+			i2p::crypto::TunnelEncryption::Encrypt (encryptions, payloads, num);
+			for (int j = 0; j < num; j++)
+				msgs[i + j].first->HandleEncryptedTunnelDataMsg (msgs[i + j].second);
 		}	
 	}	
 
 	void Tunnels::ManageTunnels ()
 	{
+		// tunnels removed from shards one round ago are not processed anymore
+		for (auto it: m_RetiredTunnels)
+			delete it;
+		m_RetiredTunnels.clear ();
+
 		// check pending tunnel. if something is still there, wipe it out
 		// because it wouldn't be reponded anyway
-		for (auto& it : m_PendingTunnels)
-		{	
-			LogPrint ("Pending tunnel build request ", it.first, " has not been responded. Deleted");
-			delete it.second;
-		}	
-		m_PendingTunnels.clear ();
+		{
+			std::unique_lock<std::mutex> l(m_PendingTunnelsMutex);
+			for (auto& it : m_PendingTunnels)
+			{	
+				LogPrint ("Pending tunnel build request ", it.first, " has not been responded. Deleted");
+				delete it.second;
+			}	
+			m_PendingTunnels.clear ();
+		}
 		
 		ManageInboundTunnels ();
 		ManageOutboundTunnels ();
@@ -389,6 +519,7 @@ namespace tunnel
 
 	void Tunnels::ManageOutboundTunnels ()
 	{
+		std::unique_lock<std::recursive_mutex> l(m_TunnelsMutex);
 		uint64_t ts = i2p::util::GetSecondsSinceEpoch ();
 		for (auto it = m_OutboundTunnels.begin (); it != m_OutboundTunnels.end ();)
 		{
@@ -422,7 +553,9 @@ namespace tunnel
 	
 	void Tunnels::ManageInboundTunnels ()
 	{
+		std::unique_lock<std::recursive_mutex> l(m_TunnelsMutex);
 		uint64_t ts = i2p::util::GetSecondsSinceEpoch ();
+		size_t numRetired = m_RetiredTunnels.size ();
 		for (auto it = m_InboundTunnels.begin (); it != m_InboundTunnels.end ();)
 		{
 			if (ts > it->second->GetCreationTime () + TUNNEL_EXPIRATION_TIMEOUT)
@@ -431,14 +564,20 @@ namespace tunnel
 				auto pool = it->second->GetTunnelPool ();
 				if (pool)
 					pool->TunnelExpired (it->second);
-				delete it->second;
+				m_RetiredTunnels.push_back (it->second);
 				it = m_InboundTunnels.erase (it);
 			}	
 			else 
 				it++;
 		}
+		bool isEmpty = m_InboundTunnels.empty ();
+		bool needMore = m_OutboundTunnels.empty () || m_InboundTunnels.size () < 5;
+		l.unlock ();
+		// shard's mutex is never taken under tunnels' one, new tunnel might be added to shard by this thread
+		for (size_t i = numRetired; i < m_RetiredTunnels.size (); i++)
+			DeleteFromShard (m_RetiredTunnels[i]->GetTunnelID ());
 
-		if (m_InboundTunnels.empty ())
+		if (isEmpty)
 		{
 			LogPrint ("Creating zero hops inbound tunnel...");
 			CreateZeroHopsInboundTunnel ();
@@ -447,7 +586,7 @@ namespace tunnel
 			return;
 		}
 		
-		if (m_OutboundTunnels.empty () || m_InboundTunnels.size () < 5) 
+		if (needMore)
 		{
 			// trying to create one more inbound tunnel			
 			LogPrint ("Creating one hop inbound tunnel...");
@@ -461,23 +600,29 @@ namespace tunnel
 
 	void Tunnels::ManageTransitTunnels ()
 	{
+		std::unique_lock<std::mutex> l(m_TransitTunnelsMutex);
 		uint32_t ts = i2p::util::GetSecondsSinceEpoch ();
+		size_t numRetired = m_RetiredTunnels.size ();
 		for (auto it = m_TransitTunnels.begin (); it != m_TransitTunnels.end ();)
 		{
 			if (ts > it->second->GetCreationTime () + TUNNEL_EXPIRATION_TIMEOUT)
 			{
 				LogPrint ("Transit tunnel ", it->second->GetTunnelID (), " expired");
-				auto tmp = it->second;
+				m_RetiredTunnels.push_back (it->second);
 				it = m_TransitTunnels.erase (it);
-				delete tmp;
 			}	
 			else 
 				it++;
 		}
+		i2p::transports.GetBandwidthLimiter ().SetNumTransitTunnels (m_TransitTunnels.size ());
+		l.unlock ();
+		for (size_t i = numRetired; i < m_RetiredTunnels.size (); i++)
+			DeleteFromShard (m_RetiredTunnels[i]->GetTunnelID ());
 	}	
 
 	void Tunnels::ManageTunnelPools ()
 	{
+		std::unique_lock<std::recursive_mutex> l(m_TunnelsMutex);
 		for (auto& it: m_Pools)
 		{	
 			it.second->CreateTunnels ();
@@ -487,21 +632,28 @@ namespace tunnel
 	
 	void Tunnels::PostTunnelData (I2NPMessage * msg)
 	{
-		if (msg) m_Queue.Put (msg);		
+		// classified by shard's classifier at capacity and when dropped at dequeue
+		if (msg) 
+			GetShard (be32toh (*(uint32_t *)msg->GetPayload ()))->queue.Put (msg, i2p::util::eQueueClassTransit);		
 	}	
 
 	template<class TTunnel>
 	TTunnel * Tunnels::CreateTunnel (TunnelConfig * config, OutboundTunnel * outboundTunnel)
 	{
 		TTunnel * newTunnel = new TTunnel (config);
-		m_PendingTunnels[m_NextReplyMsgID] = newTunnel; 
-		newTunnel->Build (m_NextReplyMsgID, outboundTunnel);
-		m_NextReplyMsgID++; // TODO: should be atomic
+		uint32_t replyMsgID;
+		{
+			std::unique_lock<std::mutex> l(m_PendingTunnelsMutex);
+			replyMsgID = m_NextReplyMsgID++;
+			m_PendingTunnels[replyMsgID] = newTunnel; 
+		}	
+		newTunnel->Build (replyMsgID, outboundTunnel);
 		return newTunnel;
 	}	
 
 	void Tunnels::AddOutboundTunnel (OutboundTunnel * newTunnel)
 	{
+		std::unique_lock<std::recursive_mutex> l(m_TunnelsMutex);
 		m_OutboundTunnels.push_back (newTunnel);
 		auto pool = newTunnel->GetTunnelPool ();
 		if (pool)
@@ -510,6 +662,12 @@ namespace tunnel
 
 	void Tunnels::AddInboundTunnel (InboundTunnel * newTunnel)
 	{
+		{
+			auto shard = GetShard (newTunnel->GetTunnelID ());
+			std::unique_lock<std::mutex> l(shard->mutex);
+			shard->inboundTunnels[newTunnel->GetTunnelID ()] = newTunnel;
+		}	
+		std::unique_lock<std::recursive_mutex> l(m_TunnelsMutex);
 		m_InboundTunnels[newTunnel->GetTunnelID ()] = newTunnel;
 		auto pool = newTunnel->GetTunnelPool ();
 		if (!pool)
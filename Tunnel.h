@@ -22,6 +22,8 @@ namespace i2p
 namespace tunnel
 {	
 	const int TUNNEL_EXPIRATION_TIMEOUT = 660; // 11 minutes	
+	const int TUNNELS_QUEUE_CAPACITY = 16384; // messages, for all threads
+	const int TUNNELS_MAX_NUM_THREADS = 16;
 	
 	class OutboundTunnel;
 	class InboundTunnel;
@@ -92,6 +94,18 @@ namespace tunnel
 			TunnelEndpoint m_Endpoint; 
 	};	
 
+
+	// tunnel data of a tunnel is always processed by the same thread 
+	struct TunnelsShard
+	{
+		TunnelsShard (const std::string& name): thread (nullptr), queue (name) {};
+		
+		std::thread * thread;
+		std::mutex mutex; // locked while tunnels are looked up, never together with other tunnels' mutexes
+		std::map<uint32_t, InboundTunnel *> inboundTunnels;
+		std::map<uint32_t, TransitTunnel *> transitTunnels;
+		i2p::util::Queue<I2NPMessage> queue;
+	};	
 	
 	class Tunnels
 	{	
@@ -112,6 +126,8 @@ namespace tunnel
 			void AddOutboundTunnel (OutboundTunnel * newTunnel);
 			void AddInboundTunnel (InboundTunnel * newTunnel);
 			void PostTunnelData (I2NPMessage * msg);
+			void SetQueueCapacity (size_t capacity) { m_QueueCapacity = capacity; };
+			void SetNumThreads (int numThreads); // 0 means number of cores
 			template<class TTunnel>
 			TTunnel * CreateTunnel (TunnelConfig * config, OutboundTunnel * outboundTunnel = 0);
 			TunnelPool * CreateTunnelPool (i2p::data::LocalDestination& localDestination, int numHops);
@@ -120,6 +136,10 @@ namespace tunnel
 		private:
 			
 			void Run ();	
+			void RunShard (TunnelsShard * shard);
+			void HandleTransitTunnelDataMsgs (std::vector<std::pair<TransitTunnel *, I2NPMessage *> >& msgs);
+			TunnelsShard * GetShard (uint32_t tunnelID) { return m_Shards[tunnelID % m_Shards.size ()]; };
+			void DeleteFromShard (uint32_t tunnelID);
 			void ManageTunnels ();
 			void ManageOutboundTunnels ();
 			void ManageInboundTunnels ();
@@ -133,14 +153,20 @@ namespace tunnel
 			bool m_IsRunning;
 			bool m_IsTunnelCreated; // TODO: temporary
 			uint32_t m_NextReplyMsgID; // TODO: make it random later
-			std::thread * m_Thread;	
+			std::thread * m_Thread;	// management
 			std::map<uint32_t, Tunnel *> m_PendingTunnels; // by replyMsgID
+			std::mutex m_PendingTunnelsMutex;
 			std::map<uint32_t, InboundTunnel *> m_InboundTunnels;
 			std::list<OutboundTunnel *> m_OutboundTunnels;
-			std::map<uint32_t, TransitTunnel *> m_TransitTunnels;
 			std::map<i2p::data::IdentHash, TunnelPool *> m_Pools;
+			std::recursive_mutex m_TunnelsMutex; // tunnels and pools, build replies come from shard threads
+			std::map<uint32_t, TransitTunnel *> m_TransitTunnels;
+			std::mutex m_TransitTunnelsMutex; // added from transports threads
+			std::vector<TunnelBase *> m_RetiredTunnels; // removed from shards, deleted next management round
 			TunnelPool * m_ExploratoryPool;
-			i2p::util::Queue<I2NPMessage> m_Queue;
+			int m_NumThreads;
+			size_t m_QueueCapacity;
+			std::vector<TunnelsShard *> m_Shards;
 
 		public:
 
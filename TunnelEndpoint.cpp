@@ -102,7 +102,8 @@ namespace tunnel
 				if (fragment + size < decrypted + TUNNEL_DATA_ENCRYPTED_SIZE)
 				{
 					// this is not last message. we have to copy it
-					m.data = NewI2NPMessage ();
+					m.data = (!isFollowOnFragment && isLastFragment) ? 
+						NewI2NPMessage (size + sizeof (TunnelGatewayHeader)) : NewI2NPMessage ();
 					m.data->offset += sizeof (TunnelGatewayHeader); // reserve room for TunnelGateway header
 					m.data->len += sizeof (TunnelGatewayHeader);
 					*(m.data) = *msg;
@@ -153,6 +154,14 @@ namespace tunnel
 				I2NPMessage * incompleteMessage = it->second.data; 
 				if (incompleteMessage->len + size < I2NP_MAX_MESSAGE_SIZE) // check if messega is not too long
 				{	
+					if (incompleteMessage->len + size > incompleteMessage->maxLen)
+					{
+						// first fragment was left in TunnelData buffer, move it to bigger one
+						I2NPMessage * newMsg = NewI2NPMessage ();
+						*newMsg = *incompleteMessage;
+						i2p::DeleteI2NPMessage (incompleteMessage);
+						it->second.data = incompleteMessage = newMsg;
+					}	
 					memcpy (incompleteMessage->buf + incompleteMessage->len, fragment, size); // concatenate fragment
 					incompleteMessage->len += size;
 					if (isLastFragment)
@@ -193,8 +202,12 @@ namespace tunnel
 				i2p::HandleI2NPMessage (msg.data);
 			break;
 			case eDeliveryTypeTunnel:
-				i2p::transports.SendMessage (msg.hash, i2p::CreateTunnelGatewayMsg (msg.tunnelID, msg.data));
-			break;
+			{
+				auto gatewayMsg = i2p::CreateTunnelGatewayMsg (msg.tunnelID, msg.data);
+				gatewayMsg->isTransit = !m_IsInbound;
+				i2p::transports.SendMessage (msg.hash, gatewayMsg);
+				break;
+			}
 			case eDeliveryTypeRouter:
 				if (msg.hash == i2p::context.GetRouterInfo ().GetIdentHash ()) // check if message is sent to us
 					i2p::HandleI2NPMessage (msg.data);
@@ -206,10 +219,11 @@ namespace tunnel
 						if (msg.data->GetHeader()->typeID == eI2NPDatabaseStore)
 						{
 							// catch RI
-							auto ds = NewI2NPMessage ();
+							auto ds = NewI2NPMessage (msg.data->GetLength ());
 							*ds = *(msg.data);
-							i2p::data::netdb.PostI2NPMsg (ds);
+							i2p::data::netdb.PostI2NPMsg (ds, true);
 						}
+						msg.data->isTransit = true;
 						i2p::transports.SendMessage (msg.hash, msg.data);
 					}
 					else // we shouldn't send this message. possible leakage 
@@ -25,6 +25,7 @@ namespace tunnel
 
 	void TunnelPool::TunnelCreated (InboundTunnel * createdTunnel)
 	{
+		std::unique_lock<std::mutex> l(m_TunnelsMutex);
 		m_InboundTunnels.insert (createdTunnel);
 	}
 
@@ -33,8 +34,12 @@ namespace tunnel
 		if (expiredTunnel)
 		{	
 			expiredTunnel->SetTunnelPool (nullptr);
-			m_InboundTunnels.erase (expiredTunnel);
-			for (auto it: m_Tests)
+			{
+				std::unique_lock<std::mutex> l(m_TunnelsMutex);
+				m_InboundTunnels.erase (expiredTunnel);
+			}
+			std::unique_lock<std::mutex> l(m_TestsMutex);
+			for (auto& it: m_Tests)
 				if (it.second.second == expiredTunnel) it.second.second = nullptr;
 				
 		}	
@@ -43,6 +48,7 @@ namespace tunnel
 
 	void TunnelPool::TunnelCreated (OutboundTunnel * createdTunnel)
 	{
+		std::unique_lock<std::mutex> l(m_TunnelsMutex);
 		m_OutboundTunnels.insert (createdTunnel);
 	}
 
@@ -51,8 +57,12 @@ namespace tunnel
 		if (expiredTunnel)
 		{
 			expiredTunnel->SetTunnelPool (nullptr);
-			m_OutboundTunnels.erase (expiredTunnel);
-			for (auto it: m_Tests)
+			{
+				std::unique_lock<std::mutex> l(m_TunnelsMutex);
+				m_OutboundTunnels.erase (expiredTunnel);
+			}
+			std::unique_lock<std::mutex> l(m_TestsMutex);
+			for (auto& it: m_Tests)
 				if (it.second.first == expiredTunnel) it.second.first = nullptr;
 		}
 	}
@@ -60,6 +70,7 @@ namespace tunnel
 	std::vector<InboundTunnel *> TunnelPool::GetInboundTunnels (int num) const
 	{
 		std::vector<InboundTunnel *> v;
+		std::unique_lock<std::mutex> l(m_TunnelsMutex);
 		int i = 0;
 		for (auto it : m_InboundTunnels)
 		{
@@ -86,7 +97,7 @@ namespace tunnel
 	template<class TTunnels>
 	typename TTunnels::value_type TunnelPool::GetNextTunnel (TTunnels& tunnels)
 	{
-		if (tunnels.empty ()) return nullptr;
+		std::unique_lock<std::mutex> l(m_TunnelsMutex);
 		for (auto it: tunnels)
 			if (!it->IsFailed ())
 				return it;
@@ -95,10 +106,14 @@ namespace tunnel
 
 	void TunnelPool::CreateTunnels ()
 	{
+		std::unique_lock<std::mutex> l(m_TunnelsMutex);
 		int num = m_InboundTunnels.size ();
+		l.unlock ();
 		for (int i = num; i < m_NumTunnels; i++)
 			CreateInboundTunnel ();	
+		l.lock ();
 		num = m_OutboundTunnels.size ();
+		l.unlock ();
 		for (int i = num; i < m_NumTunnels; i++)
 			CreateOutboundTunnel ();	
 	}
@@ -106,6 +121,8 @@ namespace tunnel
 	void TunnelPool::TestTunnels ()
 	{
 		auto& rnd = i2p::context.GetRandomNumberGenerator ();
+		std::unique_lock<std::mutex> l(m_TestsMutex);
+		std::unique_lock<std::mutex> l1(m_TunnelsMutex);
 		for (auto it: m_Tests)
 		{
 			LogPrint ("Tunnel test ", (int)it.first, " failed"); 
@@ -122,9 +139,14 @@ namespace tunnel
 			}	
 		}
 		m_Tests.clear ();	
-		auto it1 = m_OutboundTunnels.begin ();
-		auto it2 = m_InboundTunnels.begin ();
-		while (it1 != m_OutboundTunnels.end () && it2 != m_InboundTunnels.end ())
+		// tunnels might be removed from sets while tests are sent, iterate copies
+		std::vector<OutboundTunnel *> outboundTunnels (m_OutboundTunnels.begin (), m_OutboundTunnels.end ());
+		std::vector<InboundTunnel *> inboundTunnels (m_InboundTunnels.begin (), m_InboundTunnels.end ());
+		l1.unlock ();
+		l.unlock ();
+		auto it1 = outboundTunnels.begin ();
+		auto it2 = inboundTunnels.begin ();
+		while (it1 != outboundTunnels.end () && it2 != inboundTunnels.end ())
 		{
 			bool failed = false;
 			if ((*it1)->IsFailed ())
@@ -140,7 +162,9 @@ namespace tunnel
 			if (!failed)
 			{	
 				uint32_t msgID = rnd.GenerateWord32 ();
+				l.lock ();
 				m_Tests[msgID] = std::make_pair (*it1, *it2);
+				l.unlock ();
 				(*it1)->SendTunnelDataMsg ((*it2)->GetNextIdentHash (), (*it2)->GetNextTunnelID (),
 					CreateDeliveryStatusMsg (msgID));
 				it1++; it2++;
@@ -151,6 +175,7 @@ namespace tunnel
 	void TunnelPool::ProcessDeliveryStatus (I2NPMessage * msg)
 	{
 		I2NPDeliveryStatusMsg * deliveryStatus = (I2NPDeliveryStatusMsg *)msg->GetPayload ();
+		std::unique_lock<std::mutex> l(m_TestsMutex);
 		auto it = m_Tests.find (be32toh (deliveryStatus->msgID));
 		if (it != m_Tests.end ())
 		{
@@ -158,14 +183,21 @@ namespace tunnel
 			m_Tests.erase (it);
 		}
 		else
+		{
+			l.unlock ();
 			i2p::garlic::routing.HandleDeliveryStatusMessage (msg->GetPayload (), msg->GetLength ()); // TODO:
+		}
 		DeleteI2NPMessage (msg);
 	}
 
 	void TunnelPool::CreateInboundTunnel ()
 	{
-		OutboundTunnel * outboundTunnel = m_OutboundTunnels.size () > 0 ? 
-			*m_OutboundTunnels.begin () : tunnels.GetNextOutboundTunnel ();
+		OutboundTunnel * outboundTunnel = nullptr;
+		{
+			std::unique_lock<std::mutex> l(m_TunnelsMutex);
+			if (!m_OutboundTunnels.empty ()) outboundTunnel = *m_OutboundTunnels.begin ();
+		}
+		if (!outboundTunnel) outboundTunnel = tunnels.GetNextOutboundTunnel ();
 		LogPrint ("Creating destination inbound tunnel...");
 		const i2p::data::RouterInfo * prevHop = &i2p::context.GetRouterInfo ();	
 		std::vector<const i2p::data::RouterInfo *> hops;
@@ -194,8 +226,12 @@ namespace tunnel
 
 	void TunnelPool::CreateOutboundTunnel ()
 	{
-		InboundTunnel * inboundTunnel = m_InboundTunnels.size () > 0 ? 
-			*m_InboundTunnels.begin () : tunnels.GetNextInboundTunnel ();
+		InboundTunnel * inboundTunnel = nullptr;
+		{
+			std::unique_lock<std::mutex> l(m_TunnelsMutex);
+			if (!m_InboundTunnels.empty ()) inboundTunnel = *m_InboundTunnels.begin ();
+		}
+		if (!inboundTunnel) inboundTunnel = tunnels.GetNextInboundTunnel ();
 		if (inboundTunnel)
 		{	
 			LogPrint ("Creating destination outbound tunnel...");
@@ -5,6 +5,7 @@
 #include <set>
 #include <vector>
 #include <utility>
+#include <mutex>
 #include "Identity.h"
 #include "LeaseSet.h"
 #include "I2NPProtocol.h"
@@ -56,7 +57,9 @@ namespace tunnel
 			int m_NumHops, m_NumTunnels;
 			std::set<InboundTunnel *, TunnelCreationTimeCmp> m_InboundTunnels; // recent tunnel appears first
 			std::set<OutboundTunnel *, TunnelCreationTimeCmp> m_OutboundTunnels;
+			mutable std::mutex m_TunnelsMutex; // used by destinations, changed by tunnels threads. Taken after Tunnels' one and m_TestsMutex
 			std::map<uint32_t, std::pair<OutboundTunnel *, InboundTunnel *> > m_Tests;
+			std::mutex m_TestsMutex; // results come from tunnels threads. Taken before m_TunnelsMutex
 	};	
 }
 }
@@ -95,17 +95,41 @@ namespace crypto
 		"aesenc	208(%["#sched"]), %%xmm0 \n" \
 		"aesenclast	224(%["#sched"]), %%xmm0 \n"
 		
-	void ECBEncryptionAESNI::Encrypt (const ChipherBlock * in, ChipherBlock * out)
+#endif
+
+	void ECBEncryption::SetKey (const uint8_t * key)
 	{
-		__asm__
-		(
-			"movups	(%[in]), %%xmm0 \n"
-			EncryptAES256(sched)
-			"movups	%%xmm0, (%[out]) \n"	
-			: : [sched]"r"(m_KeySchedule), [in]"r"(in), [out]"r"(out) : "%xmm0"
-		);
+#ifdef AESNI
+		m_IsAESNI = i2p::cpu::aesni;
+		if (m_IsAESNI)
+		{
+			ExpandKey (key);
+			return;
+		}	
+#endif
+		m_Encryption.SetKey (key, 32); 
+	}	
+
+	void ECBEncryption::Encrypt (const ChipherBlock * in, ChipherBlock * out)
+	{
+#ifdef AESNI
+		if (m_IsAESNI)
+		{	
+			__asm__
+			(
+				"movups	(%[in]), %%xmm0 \n"
+				EncryptAES256(sched)
+				"movups	%%xmm0, (%[out]) \n"	
+				: : [sched]"r"(m_KeySchedule), [in]"r"(in), [out]"r"(out) : "%xmm0", "memory"
+			);
+			return;
+		}	
+#endif
+		m_Encryption.ProcessData (out->buf, in->buf, 16);
 	}		
 
+#ifdef AESNI
+
 	#define DecryptAES256(sched) \
 		"pxor 224(%["#sched"]), %%xmm0 \n" \
 		"aesdec	208(%["#sched"]), %%xmm0 \n" \
@@ -123,24 +147,44 @@ namespace crypto
 		"aesdec	16(%["#sched"]), %%xmm0 \n" \
 		"aesdeclast (%["#sched"]), %%xmm0 \n"
 	
-	void ECBDecryptionAESNI::Decrypt (const ChipherBlock * in, ChipherBlock * out)
+#endif
+
+	void ECBDecryption::Decrypt (const ChipherBlock * in, ChipherBlock * out)
 	{
-		__asm__
-		(
-			"movups	(%[in]), %%xmm0 \n"
-			DecryptAES256(sched)
-			"movups	%%xmm0, (%[out]) \n"	
-			: : [sched]"r"(m_KeySchedule), [in]"r"(in), [out]"r"(out) : "%xmm0"
-		);		
+#ifdef AESNI
+		if (m_IsAESNI)
+		{	
+			__asm__
+			(
+				"movups	(%[in]), %%xmm0 \n"
+				DecryptAES256(sched)
+				"movups	%%xmm0, (%[out]) \n"	
+				: : [sched]"r"(m_KeySchedule), [in]"r"(in), [out]"r"(out) : "%xmm0", "memory"
+			);		
+			return;
+		}	
+#endif
+		m_Decryption.ProcessData (out->buf, in->buf, 16);
 	}
 
+#ifdef AESNI
+
 	#define CallAESIMC(offset) \
 		"movaps "#offset"(%[shed]), %%xmm0 \n"	\
 		"aesimc %%xmm0, %%xmm0 \n" \
 		"movaps %%xmm0, "#offset"(%[shed]) \n" 
 
-	void ECBDecryptionAESNI::SetKey (const uint8_t * key)
+#endif
+
+	void ECBDecryption::SetKey (const uint8_t * key)
 	{
+#ifdef AESNI
+		m_IsAESNI = i2p::cpu::aesni;
+		if (!m_IsAESNI)
+		{
+			m_Decryption.SetKey (key, 32); 
+			return;
+		}	
 		ExpandKey (key); // expand encryption key first
 		// then  invert it using aesimc
 		__asm__
@@ -158,20 +202,106 @@ namespace crypto
 			CallAESIMC(176)
 			CallAESIMC(192)
 			CallAESIMC(208)
-			: : [shed]"r"(m_KeySchedule) : "%xmm0"
+			: : [shed]"r"(m_KeySchedule) : "%xmm0", "memory"
 		);
+#else
+		m_Decryption.SetKey (key, 32); 
+#endif
 	}
 
+#ifdef AESNI
+
+	#define DecryptRound4(round) \
+		"aesdec "#round"(%[sched]), %%xmm0 \n" \
+		"aesdec "#round"(%[sched]), %%xmm1 \n" \
+		"aesdec "#round"(%[sched]), %%xmm2 \n" \
+		"aesdec "#round"(%[sched]), %%xmm3 \n" 
+
+	#define DecryptAES256x4 \
+		"movaps 224(%[sched]), %%xmm4 \n" \
+		"pxor %%xmm4, %%xmm0 \n" \
+		"pxor %%xmm4, %%xmm1 \n" \
+		"pxor %%xmm4, %%xmm2 \n" \
+		"pxor %%xmm4, %%xmm3 \n" \
+		DecryptRound4(208) DecryptRound4(192) DecryptRound4(176) DecryptRound4(160) \
+		DecryptRound4(144) DecryptRound4(128) DecryptRound4(112) DecryptRound4(96) \
+		DecryptRound4(80) DecryptRound4(64) DecryptRound4(48) DecryptRound4(32) \
+		DecryptRound4(16) \
+		"aesdeclast (%[sched]), %%xmm0 \n" \
+		"aesdeclast (%[sched]), %%xmm1 \n" \
+		"aesdeclast (%[sched]), %%xmm2 \n" \
+		"aesdeclast (%[sched]), %%xmm3 \n" 
+
+	// CBC decryption has no dependency between blocks, so 4 blocks are decrypted at once
+	// in and out might be the same
+	static void DecryptCBCAESNI (const uint8_t * sched, ChipherBlock * iv, 
+		int numBlocks, const ChipherBlock * in, ChipherBlock * out)
+	{
+		__asm__ __volatile__
+		(
+			"movups	(%[iv]), %%xmm5 \n"
+			"cmp $4, %[num] \n"
+			"jb 2f \n"
+			"1: \n"
+			"movups	(%[in]), %%xmm0 \n"
+			"movups	16(%[in]), %%xmm1 \n"
+			"movups	32(%[in]), %%xmm2 \n"
+			"movups	48(%[in]), %%xmm3 \n"
+			DecryptAES256x4
+			// xor with previous ciphertext blocks before anything is written
+			"pxor %%xmm5, %%xmm0 \n"
+			"movups	(%[in]), %%xmm6 \n"
+			"pxor %%xmm6, %%xmm1 \n"
+			"movups	16(%[in]), %%xmm6 \n"
+			"pxor %%xmm6, %%xmm2 \n"
+			"movups	32(%[in]), %%xmm6 \n"
+			"pxor %%xmm6, %%xmm3 \n"
+			"movups	48(%[in]), %%xmm5 \n"
+			"movups	%%xmm0, (%[out]) \n"
+			"movups	%%xmm1, 16(%[out]) \n"
+			"movups	%%xmm2, 32(%[out]) \n"
+			"movups	%%xmm3, 48(%[out]) \n"
+			"add $64, %[in] \n"
+			"add $64, %[out] \n"
+			"sub $4, %[num] \n"
+			"cmp $4, %[num] \n"
+			"jae 1b \n"
+			"2: \n"
+			// remaining blocks one by one
+			"test %[num], %[num] \n"
+			"jz 4f \n"
+			"3: \n"
+			"movups	(%[in]), %%xmm0 \n"
+			"movaps %%xmm0, %%xmm6 \n"
+			DecryptAES256(sched)
+			"pxor %%xmm5, %%xmm0 \n"
+			"movups	%%xmm0, (%[out]) \n"
+			"movaps %%xmm6, %%xmm5 \n"
+			"add $16, %[in] \n"
+			"add $16, %[out] \n"
+			"dec %[num] \n"
+			"jnz 3b \n"
+			"4: \n"
+			"movups	%%xmm5, (%[iv]) \n"
+			: [in]"+r"(in), [out]"+r"(out), [num]"+r"(numBlocks)
+			: [iv]"r"(iv), [sched]"r"(sched)
+			: "%xmm0", "%xmm1", "%xmm2", "%xmm3", "%xmm4", "%xmm5", "%xmm6", "cc", "memory"
+		);
+	}	
+
 #endif		
 
 
 	void CBCEncryption::Encrypt (int numBlocks, const ChipherBlock * in, ChipherBlock * out)
 	{
+		if (numBlocks <= 0) return;
 #ifdef AESNI
-		__asm__
+		if (m_ECBEncryption.IsAESNI ())
+		{	
+		__asm__ __volatile__
 		(
 		 	"movups	(%[iv]), %%xmm1 \n"
-		 	"block_e: \n"
+		 	"1: \n"
 		 	"movups	(%[in]), %%xmm0 \n"
 		 	"pxor %%xmm1, %%xmm0 \n"
 		 	EncryptAES256(sched)
@@ -180,21 +310,21 @@ namespace crypto
 		 	"add $16, %[in] \n"
 		 	"add $16, %[out] \n"
 		 	"dec %[num] \n"
-		 	"jnz block_e; \n"	 	
+		 	"jnz 1b; \n"	 	
 		 	"movups	%%xmm1, (%[iv]) \n"
-			: 
-			: [iv]"r"(&m_LastBlock), [sched]"r"(m_ECBEncryption.GetKeySchedule ()), 
-			  [in]"r"(in), [out]"r"(out), [num]"r"(numBlocks)
+			: [in]"+r"(in), [out]"+r"(out), [num]"+r"(numBlocks)
+			: [iv]"r"(&m_LastBlock), [sched]"r"(m_ECBEncryption.GetKeySchedule ())
 			: "%xmm0", "%xmm1", "cc", "memory"
 		); 
-#else		
+			return;
+		}	
+#endif		
 		for (int i = 0; i < numBlocks; i++)
 		{
 			m_LastBlock ^= in[i];
 			m_ECBEncryption.Encrypt (&m_LastBlock, &m_LastBlock);
 			out[i] = m_LastBlock;
 		}
-#endif		
 	}
 
 	void CBCEncryption::Encrypt (const uint8_t * in, std::size_t len, uint8_t * out)
@@ -206,6 +336,8 @@ namespace crypto
 	void CBCEncryption::Encrypt (const uint8_t * in, uint8_t * out)
 	{
 #ifdef AESNI
+		if (m_ECBEncryption.IsAESNI ())
+		{	
 		__asm__
 		(
 			"movups	(%[iv]), %%xmm1 \n"
@@ -219,35 +351,21 @@ namespace crypto
 			  [in]"r"(in), [out]"r"(out)
 			: "%xmm0", "%xmm1", "memory"
 		);		
-#else
-		Encrypt (1, (const ChipherBlock *)in, (ChipherBlock *)out); 
+			return;
+		}	
 #endif
+		Encrypt (1, (const ChipherBlock *)in, (ChipherBlock *)out); 
 	}
 
 	void CBCDecryption::Decrypt (int numBlocks, const ChipherBlock * in, ChipherBlock * out)
 	{
 #ifdef AESNI
-		__asm__
-		(
-			"movups	(%[iv]), %%xmm1 \n"
-		 	"block_d: \n"
-		 	"movups	(%[in]), %%xmm0 \n"
-			"movaps %%xmm0, %%xmm2 \n"
-		 	DecryptAES256(sched)
-			"pxor %%xmm1, %%xmm0 \n"
-		 	"movups	%%xmm0, (%[out]) \n"
-			"movaps %%xmm2, %%xmm1 \n"
-		 	"add $16, %[in] \n"
-		 	"add $16, %[out] \n"
-		 	"dec %[num] \n"
-		 	"jnz block_d; \n"	 	
-		 	"movups	%%xmm1, (%[iv]) \n"
-			: 
-			: [iv]"r"(&m_IV), [sched]"r"(m_ECBDecryption.GetKeySchedule ()), 
-			  [in]"r"(in), [out]"r"(out), [num]"r"(numBlocks)
-			: "%xmm0", "%xmm1", "%xmm2", "cc", "memory"
-		); 
-#else
+		if (m_ECBDecryption.IsAESNI ())
+		{	
+			DecryptCBCAESNI (m_ECBDecryption.GetKeySchedule (), &m_IV, numBlocks, in, out);
+			return;
+		}	
+#endif
 		for (int i = 0; i < numBlocks; i++)
 		{
 			ChipherBlock tmp = in[i];
@@ -255,7 +373,6 @@ namespace crypto
 			out[i] ^= m_IV;
 			m_IV = tmp;
 		}
-#endif
 	}
 
 	void CBCDecryption::Decrypt (const uint8_t * in, std::size_t len, uint8_t * out)
@@ -266,6 +383,8 @@ namespace crypto
 	void CBCDecryption::Decrypt (const uint8_t * in, uint8_t * out)
 	{
 #ifdef AESNI
+		if (m_ECBDecryption.IsAESNI ())
+		{	
 		__asm__
 		(
 			"movups	(%[iv]), %%xmm1 \n"
@@ -279,15 +398,19 @@ namespace crypto
 			  [in]"r"(in), [out]"r"(out)
 			: "%xmm0", "%xmm1", "memory"
 		);
-#else
-		Decrypt (1, (const ChipherBlock *)in, (ChipherBlock *)out); 
+			return;
+		}	
 #endif
+		Decrypt (1, (const ChipherBlock *)in, (ChipherBlock *)out); 
 	}
 
 	void TunnelEncryption::Encrypt (uint8_t * payload)
 	{
 #ifdef AESNI
-		__asm__
+		if (m_IVEncryption.IsAESNI ())
+		{	
+		int num = 63; // 63 blocks = 1008 bytes
+		__asm__ __volatile__
 		(
             // encrypt IV 
 			"movups	(%[payload]), %%xmm0 \n"
@@ -297,7 +420,7 @@ namespace crypto
 			EncryptAES256(sched_iv)
 			"movups %%xmm0, (%[payload]) \n"
 			// encrypt data, IV is xmm1
-			"block_et: \n"
+			"1: \n"
 			"add $16, %[payload] \n"
 		 	"movups	(%[payload]), %%xmm0 \n"
 		 	"pxor %%xmm1, %%xmm0 \n"
@@ -305,54 +428,124 @@ namespace crypto
 		 	"movaps	%%xmm0, %%xmm1 \n"	
 		 	"movups	%%xmm0, (%[payload]) \n"
 		 	"dec %[num] \n"
-		 	"jnz block_et; \n"	 	
-			: 
-			: [sched_iv]"r"(m_IVEncryption.GetKeySchedule ()), [sched_l]"r"(m_LayerEncryption.GetKeySchedule ()), 
-			  [payload]"r"(payload), [num]"r"(63) // 63 blocks = 1008 bytes
+		 	"jnz 1b; \n"	 	
+			: [payload]"+r"(payload), [num]"+r"(num)
+			: [sched_iv]"r"(m_IVEncryption.GetKeySchedule ()), 
+			  [sched_l]"r"(m_LayerEncryption.GetECBEncryption ().GetKeySchedule ())
 			: "%xmm0", "%xmm1", "cc", "memory"
 		);
-#else
+			return;
+		}	
+#endif
 		m_IVEncryption.Encrypt ((ChipherBlock *)payload, (ChipherBlock *)payload); // iv
 		m_LayerEncryption.SetIV (payload);
 		m_LayerEncryption.Encrypt (payload + 16, i2p::tunnel::TUNNEL_DATA_ENCRYPTED_SIZE, payload + 16); // data
 		m_IVEncryption.Encrypt ((ChipherBlock *)payload, (ChipherBlock *)payload); // double iv
-#endif
 	}
 
-	void TunnelDecryption::Decrypt (uint8_t * payload)
+	void TunnelEncryption::Encrypt (TunnelEncryption * const encryptions[], uint8_t * const payloads[], int num)
 	{
+		int i = 0;
 #ifdef AESNI
-		__asm__
+		for (; i + 4 <= num; i += 4)
+		{	
+			if (encryptions[i]->m_IVEncryption.IsAESNI () && encryptions[i + 1]->m_IVEncryption.IsAESNI () &&
+			    encryptions[i + 2]->m_IVEncryption.IsAESNI () && encryptions[i + 3]->m_IVEncryption.IsAESNI ())
+				Encrypt4 (encryptions + i, payloads + i);
+			else
+				for (int j = i; j < i + 4; j++)
+					encryptions[j]->Encrypt (payloads[j]);
+		}
+#endif
+		for (; i < num; i++)
+			encryptions[i]->Encrypt (payloads[i]);
+	}
+
+#ifdef AESNI
+
+	#define EncryptRound4(round) \
+		"aesenc "#round"(%[s0]), %%xmm0 \n" \
+		"aesenc "#round"(%[s1]), %%xmm1 \n" \
+		"aesenc "#round"(%[s2]), %%xmm2 \n" \
+		"aesenc "#round"(%[s3]), %%xmm3 \n" 
+
+	#define EncryptAES256x4 \
+		"pxor (%[s0]), %%xmm0 \n" \
+		"pxor (%[s1]), %%xmm1 \n" \
+		"pxor (%[s2]), %%xmm2 \n" \
+		"pxor (%[s3]), %%xmm3 \n" \
+		EncryptRound4(16) EncryptRound4(32) EncryptRound4(48) EncryptRound4(64) \
+		EncryptRound4(80) EncryptRound4(96) EncryptRound4(112) EncryptRound4(128) \
+		EncryptRound4(144) EncryptRound4(160) EncryptRound4(176) EncryptRound4(192) \
+		EncryptRound4(208) \
+		"aesenclast 224(%[s0]), %%xmm0 \n" \
+		"aesenclast 224(%[s1]), %%xmm1 \n" \
+		"aesenclast 224(%[s2]), %%xmm2 \n" \
+		"aesenclast 224(%[s3]), %%xmm3 \n" 
+
+	#define XorBlock4(p, xmm) \
+		"add $16, %["#p"] \n" \
+		"movups (%["#p"]), %%xmm4 \n" \
+		"pxor %%xmm4, %%"#xmm" \n"
+		
+	void TunnelEncryption::Encrypt4 (TunnelEncryption * const encryptions[], uint8_t * const payloads[])
+	{
+		// 4 independent CBC chains, so every aesenc of one chain overlaps with 3 others
+		ChipherBlock ivs[4];
+		for (int i = 0; i < 4; i++)
+			encryptions[i]->m_IVEncryption.Encrypt ((ChipherBlock *)payloads[i], ivs + i);
+		uint8_t * p0 = payloads[0], * p1 = payloads[1], * p2 = payloads[2], * p3 = payloads[3]; 
+		int num = 63; // 63 blocks = 1008 bytes
+		__asm__ __volatile__
 		(
-            // decrypt IV 
-			"movups	(%[payload]), %%xmm0 \n"
-			DecryptAES256(sched_iv)
-			"movaps %%xmm0, %%xmm1 \n"
-			// double IV encryption
-			DecryptAES256(sched_iv)
-			"movups %%xmm0, (%[payload]) \n"
-			// decrypt data, IV is xmm1
-			"block_dt: \n"
-			"add $16, %[payload] \n"
-			"movups	(%[payload]), %%xmm0 \n"
-			"movaps %%xmm0, %%xmm2 \n"
-		 	DecryptAES256(sched_l)
-			"pxor %%xmm1, %%xmm0 \n"
-		 	"movups	%%xmm0, (%[payload]) \n"
-			"movaps %%xmm2, %%xmm1 \n"
-		 	"dec %[num] \n"
-		 	"jnz block_dt; \n"	 	
-			: 
-			: [sched_iv]"r"(m_IVDecryption.GetKeySchedule ()), [sched_l]"r"(m_LayerDecryption.GetKeySchedule ()), 
-			  [payload]"r"(payload), [num]"r"(63) // 63 blocks = 1008 bytes
-			: "%xmm0", "%xmm1", "%xmm2", "cc", "memory"
+			"movups %[iv0], %%xmm0 \n"
+			"movups %[iv1], %%xmm1 \n"
+			"movups %[iv2], %%xmm2 \n"
+			"movups %[iv3], %%xmm3 \n"
+			"1: \n"
+			XorBlock4(p0, xmm0)
+			XorBlock4(p1, xmm1)
+			XorBlock4(p2, xmm2)
+			XorBlock4(p3, xmm3)
+			EncryptAES256x4
+			"movups %%xmm0, (%[p0]) \n"
+			"movups %%xmm1, (%[p1]) \n"
+			"movups %%xmm2, (%[p2]) \n"
+			"movups %%xmm3, (%[p3]) \n"
+			"dec %[num] \n"
+			"jnz 1b \n"
+			: [p0]"+r"(p0), [p1]"+r"(p1), [p2]"+r"(p2), [p3]"+r"(p3), [num]"+r"(num)
+			: [s0]"r"(encryptions[0]->m_LayerEncryption.GetECBEncryption ().GetKeySchedule ()), 
+			  [s1]"r"(encryptions[1]->m_LayerEncryption.GetECBEncryption ().GetKeySchedule ()), 
+			  [s2]"r"(encryptions[2]->m_LayerEncryption.GetECBEncryption ().GetKeySchedule ()),
+			  [s3]"r"(encryptions[3]->m_LayerEncryption.GetECBEncryption ().GetKeySchedule ()),
+			  [iv0]"m"(ivs[0]), [iv1]"m"(ivs[1]), [iv2]"m"(ivs[2]), [iv3]"m"(ivs[3])
+			: "%xmm0", "%xmm1", "%xmm2", "%xmm3", "%xmm4", "cc", "memory"
 		);
-#else
+		// double IV encryption
+		for (int i = 0; i < 4; i++)
+			encryptions[i]->m_IVEncryption.Encrypt (ivs + i, (ChipherBlock *)payloads[i]);
+	}
+	
+#endif
+	
+	void TunnelDecryption::Decrypt (uint8_t * payload)
+	{
+#ifdef AESNI
+		if (m_IVDecryption.IsAESNI ())
+		{	
+			ChipherBlock iv;
+			m_IVDecryption.Decrypt ((ChipherBlock *)payload, &iv); 
+			m_IVDecryption.Decrypt (&iv, (ChipherBlock *)payload); // double iv
+			DecryptCBCAESNI (m_LayerDecryption.GetECBDecryption ().GetKeySchedule (), &iv, 63, // 63 blocks = 1008 bytes
+				(ChipherBlock *)(payload + 16), (ChipherBlock *)(payload + 16));
+			return;
+		}	
+#endif
 		m_IVDecryption.Decrypt ((ChipherBlock *)payload, (ChipherBlock *)payload); // iv
 		m_LayerDecryption.SetIV (payload);	
 		m_LayerDecryption.Decrypt (payload + 16, i2p::tunnel::TUNNEL_DATA_ENCRYPTED_SIZE, payload + 16); // data
 		m_IVDecryption.Decrypt ((ChipherBlock *)payload, (ChipherBlock *)payload); // double iv
-#endif
 	}
 }
 }
@@ -4,11 +4,14 @@
 #include <inttypes.h>
 #include <cryptopp/modes.h>
 #include <cryptopp/aes.h>
+#include "CPU.h"
 
 namespace i2p
 {
 namespace crypto
 {	
+	const int TUNNEL_ENCRYPTION_BATCH_SIZE = 4; // messages encrypted together
+
 	union ChipherBlock	
 	{
 		uint8_t buf[16];
@@ -38,67 +41,45 @@ namespace crypto
 			uint8_t * m_KeySchedule; // start of 16 bytes boundary of m_UnalignedBuffer
 			uint8_t m_UnalignedBuffer[256]; // 14 rounds for AES-256, 240 + 16 bytes
 	};	
+#endif
 
-	class ECBEncryptionAESNI: public ECBCryptoAESNI
-	{
-		public:
-		
-			void SetKey (const uint8_t * key) { ExpandKey (key); };
-			void Encrypt (const ChipherBlock * in, ChipherBlock * out);	
-	};	
-
-	class ECBDecryptionAESNI: public ECBCryptoAESNI
-	{
-		public:
-		
-			void SetKey (const uint8_t * key);
-			void Decrypt (const ChipherBlock * in, ChipherBlock * out);		
-	};	
-
-	typedef ECBEncryptionAESNI ECBEncryption;
-	typedef ECBDecryptionAESNI ECBDecryption;
-
-#else // use crypto++
-
+	// AES-NI is used if CPU supports it at the time key is set, otherwise crypto++
 	class ECBEncryption
+#ifdef AESNI
+		: public ECBCryptoAESNI
+#endif
 	{
 		public:
 		
-			void SetKey (const uint8_t * key) 
-			{ 
-				m_Encryption.SetKey (key, 32); 
-			}
-			void Encrypt (const ChipherBlock * in, ChipherBlock * out)
-			{
-				m_Encryption.ProcessData (out->buf, in->buf, 16);
-			}	
+			ECBEncryption (): m_IsAESNI (false) {};
+			void SetKey (const uint8_t * key);
+			void Encrypt (const ChipherBlock * in, ChipherBlock * out);
+			bool IsAESNI () const { return m_IsAESNI; };
 
 		private:
 
+			bool m_IsAESNI;
 			CryptoPP::ECB_Mode<CryptoPP::AES>::Encryption m_Encryption;
 	};	
 
 	class ECBDecryption
+#ifdef AESNI
+		: public ECBCryptoAESNI
+#endif
 	{
 		public:
 		
-			void SetKey (const uint8_t * key) 
-			{ 
-				m_Decryption.SetKey (key, 32); 
-			}
-			void Decrypt (const ChipherBlock * in, ChipherBlock * out)
-			{
-				m_Decryption.ProcessData (out->buf, in->buf, 16);
-			}	
+			ECBDecryption (): m_IsAESNI (false) {};
+			void SetKey (const uint8_t * key);
+			void Decrypt (const ChipherBlock * in, ChipherBlock * out);
+			bool IsAESNI () const { return m_IsAESNI; };
 
 		private:
 
+			bool m_IsAESNI;
 			CryptoPP::ECB_Mode<CryptoPP::AES>::Decryption m_Decryption;
 	};		
 
-
-#endif			
-
 	class CBCEncryption
 	{
 		public:
@@ -107,6 +88,7 @@ namespace crypto
 
 			void SetKey (const uint8_t * key) { m_ECBEncryption.SetKey (key); }; // 32 bytes
 			void SetIV (const uint8_t * iv) { memcpy (m_LastBlock.buf, iv, 16); }; // 16 bytes
+			ECBEncryption& GetECBEncryption () { return m_ECBEncryption; };
 
 			void Encrypt (int numBlocks, const ChipherBlock * in, ChipherBlock * out);
 			void Encrypt (const uint8_t * in, std::size_t len, uint8_t * out);
@@ -127,6 +109,7 @@ namespace crypto
 
 			void SetKey (const uint8_t * key) { m_ECBDecryption.SetKey (key); }; // 32 bytes
 			void SetIV (const uint8_t * iv) { memcpy (m_IV.buf, iv, 16); }; // 16 bytes
+			ECBDecryption& GetECBDecryption () { return m_ECBDecryption; };
 
 			void Decrypt (int numBlocks, const ChipherBlock * in, ChipherBlock * out);
 			void Decrypt (const uint8_t * in, std::size_t len, uint8_t * out);
@@ -149,15 +132,19 @@ namespace crypto
 			}	
 
 			void Encrypt (uint8_t * payload); // 1024 bytes (16 IV + 1008 data)		
+			// payloads of different tunnels, CBC chains are pipelined
+			static void Encrypt (TunnelEncryption * const encryptions[], uint8_t * const payloads[], int num);
 
 		private:
 
-			ECBEncryption m_IVEncryption;
 #ifdef AESNI
-			ECBEncryption m_LayerEncryption;
-#else
-			CBCEncryption m_LayerEncryption;
+			static void Encrypt4 (TunnelEncryption * const encryptions[], uint8_t * const payloads[]);
 #endif
+
+		private:
+
+			ECBEncryption m_IVEncryption;
+			CBCEncryption m_LayerEncryption;
 	};
 
 	class TunnelDecryption // with double IV encryption
@@ -175,11 +162,7 @@ namespace crypto
 		private:
 
 			ECBDecryption m_IVDecryption;
-#ifdef AESNI
-			ECBDecryption m_LayerDecryption;
-#else
 			CBCDecryption m_LayerDecryption;
-#endif
 	};
 }
 }
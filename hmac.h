@@ -13,43 +13,59 @@ namespace crypto
 	const uint64_t IPAD = 0x3636363636363636;
 	const uint64_t OPAD = 0x5C5C5C5C5C5C5C5C; 			
 
+	// key is 32 bytes, digest is 16 bytes, block size is 64 bytes
+	// key pads are hashed once by SetKey, so the same key is not rehashed for every message
+	class HMACMD5
+	{
+		public:
+
+			HMACMD5 () {};
+			HMACMD5 (const uint8_t * key) { SetKey (key); };
+
+			void SetKey (const uint8_t * key)
+			{
+				uint64_t pad[8];
+				// ikeypad
+				for (int i = 0; i < 4; i++) pad[i] = ((const uint64_t *)key)[i] ^ IPAD;
+				for (int i = 4; i < 8; i++) pad[i] = IPAD;
+				m_Inner.Restart ();
+				m_Inner.Update ((uint8_t *)pad, 64);
+				// okeypad
+				for (int i = 0; i < 4; i++) pad[i] = ((const uint64_t *)key)[i] ^ OPAD;
+				for (int i = 4; i < 8; i++) pad[i] = OPAD;
+				m_Outer.Restart ();
+				m_Outer.Update ((uint8_t *)pad, 64);
+			}
+
+			// message can be passed by parts
+			void Start () { m_Hash = m_Inner; };
+			void Update (const uint8_t * buf, size_t len) { m_Hash.Update (buf, len); };
+			void Final (uint8_t * digest)
+			{
+				uint8_t hash[32];
+				m_Hash.Final (hash);
+				// fill next 16 bytes with zeros (first hash size assumed 32 bytes in I2P)
+				memset (hash + 16, 0, 16);
+				m_Hash = m_Outer;
+				m_Hash.Update (hash, 32);
+				m_Hash.Final (digest);
+			}
+
+			void CalculateDigest (const uint8_t * msg, size_t len, uint8_t * digest)
+			{
+				Start ();
+				Update (msg, len);
+				Final (digest);
+			}
+
+		private:
+
+			CryptoPP::Weak1::MD5 m_Inner, m_Outer, m_Hash;
+	};
+
 	inline void HMACMD5Digest (uint8_t * msg, size_t len, const uint8_t * key, uint8_t * digest)
-	// key is 32 bytes
-	// digest is 16 bytes
-	// block size is 64 bytes	
 	{
-		uint64_t buf[256];
-		// ikeypad
-		buf[0] = ((uint64_t *)key)[0] ^ IPAD; 
-		buf[1] = ((uint64_t *)key)[1] ^ IPAD; 
-		buf[2] = ((uint64_t *)key)[2] ^ IPAD; 
-		buf[3] = ((uint64_t *)key)[3] ^ IPAD; 
-		buf[4] = IPAD; 
-		buf[5] = IPAD; 
-		buf[6] = IPAD; 
-		buf[7] = IPAD; 		
-		// concatenate with msg
-		memcpy (buf + 8, msg, len);
-		// calculate first hash
-		uint8_t hash[16]; // MD5
-		CryptoPP::Weak1::MD5().CalculateDigest (hash, (uint8_t *)buf, len + 64);
-		
-		// okeypad			
-		buf[0] = ((uint64_t *)key)[0] ^ OPAD; 
-		buf[1] = ((uint64_t *)key)[1] ^ OPAD; 
-		buf[2] = ((uint64_t *)key)[2] ^ OPAD; 
-		buf[3] = ((uint64_t *)key)[3] ^ OPAD; 
-		buf[4] = OPAD; 
-		buf[5] = OPAD; 
-		buf[6] = OPAD; 
-		buf[7] = OPAD; 
-		// copy first hash after okeypad		
-		memcpy (buf + 8, hash, 16);
-		// fill next 16 bytes with zeros (first hash size assumed 32 bytes in I2P)
-		memset (buf + 10, 0, 16);			
-		
-		// calculate digest
-		CryptoPP::Weak1::MD5().CalculateDigest (digest, (uint8_t *)buf, 96);
+		HMACMD5 (key).CalculateDigest (msg, len, digest);
 	}
 }
 }